@@ -0,0 +1,1285 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+	#define MSG_MORE 0
+#endif
+
+/*
+	Pool limits, can be changed before (or between) requests.
+	Setting http_pool_max_idle to 0 disables connection reuse.
+*/
+int http_pool_max_idle = 32;			/* idle connections kept in total */
+int http_pool_max_per_host = 6;			/* idle connections kept per (scheme, host, port) */
+int http_pool_idle_timeout = 30;		/* seconds an idle connection may stay in the pool */
+
+/*
+	Timeouts of requests made with http_req and the functions built on it, in
+	milliseconds, 0 disables them. http_connect_timeout bounds opening a
+	connection, TLS handshake included, http_request_timeout the whole request and
+	http_read_timeout every wait for data from the server.
+*/
+int http_connect_timeout = 0;
+int http_request_timeout = 0;
+int http_read_timeout = 0;
+
+/*
+	Reasons a request can fail
+*/
+enum http_error
+{
+	HTTP_ERROR_NONE = 0,
+	HTTP_ERROR_URL,				/* the url could not be parsed */
+	HTTP_ERROR_MEMORY,
+	HTTP_ERROR_RESOLVE,			/* the host name could not be resolved */
+	HTTP_ERROR_CONNECT,
+	HTTP_ERROR_TLS,
+	HTTP_ERROR_SEND,
+	HTTP_ERROR_RECV,
+	HTTP_ERROR_PROTOCOL,		/* the response is malformed or a callback aborted it */
+	HTTP_ERROR_ABORTED,			/* the request was cancelled before it completed */
+	HTTP_ERROR_TIMEOUT_CONNECT,	/* no connection within http_connect_timeout or the request deadline */
+	HTTP_ERROR_TIMEOUT_TLS,		/* the TLS handshake did not complete in time */
+	HTTP_ERROR_TIMEOUT_SEND,	/* the server did not take the request in time */
+	HTTP_ERROR_TIMEOUT_RECV		/* the response did not arrive in time, or the server went quiet */
+};
+
+/*
+	Milliseconds to wait for a connection attempt before the next address of the
+	host is tried in parallel, RFC 8305 recommends 250.
+*/
+int http_connect_attempt_delay = 250;
+
+/*
+	Connection attempts to the addresses of a host that race each other,
+	the first one to connect wins (Happy Eyeballs, RFC 8305)
+*/
+struct http_connect_race
+{
+	struct sockaddr_storage *addrs;
+	int count;
+	int next;						/* next address to try */
+	int *socks;						/* socket of every attempt in progress, -1 otherwise */
+	long long next_attempt;			/* when the next address is tried, in milliseconds */
+};
+
+/*
+	Represents an open connection to a host
+*/
+struct http_connection
+{
+	int sock;
+	int ishttps;
+	SSL *ssl;
+	char *scheme;
+	char *host;
+	char *port;
+	time_t last_used;
+	int reused;						/* set when handed out by the pool */
+	size_t written;					/* bytes sent since it was handed out */
+	struct http_connect_race *race;	/* set while connecting */
+	struct http2_session *h2;		/* set when the connection speaks HTTP/2 */
+	int nonblocking;				/* the socket is in non-blocking mode */
+	long long deadline;				/* I/O fails after this time, in milliseconds, 0 for never */
+	int read_timeout;				/* milliseconds a read may wait for data, 0 for no limit */
+	short timed_out;				/* POLLIN or POLLOUT when the last wait for it timed out */
+	struct http_connection *next;
+};
+
+/*
+	Body of a request: count segments in memory, or len bytes of the file fd
+	from offset on when fd is not -1
+*/
+struct http_upload
+{
+	const struct iovec *segments;
+	int count;
+	int fd;
+	off_t offset;
+	size_t len;
+};
+
+void http2_session_free(struct http2_session *session);
+int http2_connection_idle(struct http_connection *conn);
+
+/*
+	Idle connections, most recently used first
+*/
+struct http_connection *http_pool_head = NULL;
+int http_pool_count = 0;
+pthread_mutex_t http_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Limit of saved TLS sessions, one is kept per (host, port).
+	Setting it to 0 disables session resumption.
+*/
+int http_tls_max_sessions = 64;
+
+/*
+	Offer HTTP/2 to https servers during the TLS handshake (ALPN), servers that
+	do not support it keep talking HTTP/1.1
+*/
+int http_tls_alpn_h2 = 1;
+
+/*
+	Represents a TLS session saved for resumption
+*/
+struct http_tls_session
+{
+	char *key;						/* host:port */
+	SSL_SESSION *session;
+	struct http_tls_session *next;
+};
+
+/*
+	The TLS context shared by all connections and the saved sessions, most
+	recently saved first
+*/
+SSL_CTX *http_tls_ctx = NULL;
+struct http_tls_session *http_tls_sessions = NULL;
+int http_tls_session_count = 0;
+pthread_mutex_t http_tls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Builds the key a session of a connection is saved under, the caller frees
+	the returned string
+*/
+char* http_tls_session_key(struct http_connection *conn)
+{
+	char *key = (char*)malloc(strlen(conn->host) + strlen(conn->port) + 2);
+	if(key != NULL)
+		sprintf(key, "%s:%s", conn->host, conn->port);
+	return key;
+}
+
+/*
+	Gets the session saved for a key, NULL when there is none. The caller frees
+	the session with SSL_SESSION_free.
+*/
+SSL_SESSION* http_tls_session_get(const char *key)
+{
+	struct http_tls_session *entry;
+	SSL_SESSION *session = NULL;
+
+	pthread_mutex_lock(&http_tls_lock);
+	for(entry = http_tls_sessions; entry != NULL; entry = entry->next)
+	{
+		if(strcasecmp(entry->key, key) == 0)
+		{
+			if(SSL_SESSION_is_resumable(entry->session))
+			{
+				session = entry->session;
+				SSL_SESSION_up_ref(session);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&http_tls_lock);
+	return session;
+}
+
+/*
+	Called by OpenSSL when the server hands out a session, it replaces the session
+	saved for the host. Returns 1 as the reference to the session is kept.
+*/
+int http_tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct http_connection *conn = (struct http_connection*)SSL_get_app_data(ssl);
+	struct http_tls_session **link;
+	struct http_tls_session *entry = NULL;
+	char *key;
+
+	if(conn == NULL || http_tls_max_sessions <= 0 || (key = http_tls_session_key(conn)) == NULL)
+		return 0;
+
+	pthread_mutex_lock(&http_tls_lock);
+	for(link = &http_tls_sessions; *link != NULL; link = &(*link)->next)
+	{
+		if(strcasecmp((*link)->key, key) == 0)
+		{
+			entry = *link;
+			*link = entry->next;
+			http_tls_session_count--;
+			break;
+		}
+	}
+	if(entry == NULL)
+	{
+		entry = (struct http_tls_session*)malloc(sizeof(struct http_tls_session));
+		if(entry == NULL)
+		{
+			pthread_mutex_unlock(&http_tls_lock);
+			free(key);
+			return 0;
+		}
+		entry->key = key;
+	}
+	else
+	{
+		SSL_SESSION_free(entry->session);
+		free(key);
+	}
+	entry->session = session;
+	entry->next = http_tls_sessions;
+	http_tls_sessions = entry;
+	http_tls_session_count++;
+
+	/* Drop the oldest session when over the limit */
+	if(http_tls_session_count > http_tls_max_sessions)
+	{
+		link = &http_tls_sessions;
+		while((*link)->next != NULL)
+			link = &(*link)->next;
+		entry = *link;
+		*link = NULL;
+		http_tls_session_count--;
+		SSL_SESSION_free(entry->session);
+		free(entry->key);
+		free(entry);
+	}
+	pthread_mutex_unlock(&http_tls_lock);
+	return 1;
+}
+
+/*
+	Forgets all saved TLS sessions, the next connections do full handshakes
+*/
+void http_tls_flush()
+{
+	struct http_tls_session *entry;
+
+	pthread_mutex_lock(&http_tls_lock);
+	entry = http_tls_sessions;
+	http_tls_sessions = NULL;
+	http_tls_session_count = 0;
+	pthread_mutex_unlock(&http_tls_lock);
+
+	while(entry != NULL)
+	{
+		struct http_tls_session *next = entry->next;
+		SSL_SESSION_free(entry->session);
+		free(entry->key);
+		free(entry);
+		entry = next;
+	}
+}
+
+/*
+	Gets a monotonic time in milliseconds
+*/
+long long http_time_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+	Closes the sockets of the connection attempts still in progress
+*/
+void http_connect_race_free(struct http_connect_race *race)
+{
+	int i;
+	if(race == NULL)
+		return;
+	for(i = 0; i < race->count; i++)
+	{
+		if(race->socks[i] >= 0)
+			close(race->socks[i]);
+	}
+	free(race->addrs);
+	free(race->socks);
+	free(race);
+}
+
+/*
+	Closes a connection and frees its memory
+*/
+void http_connection_close(struct http_connection *conn)
+{
+	if(conn == NULL)
+		return;
+	http_connect_race_free(conn->race);
+	http2_session_free(conn->h2);
+	if(conn->ssl != NULL)
+	{
+		SSL_shutdown(conn->ssl);
+		ERR_clear_error();		/* a failed shutdown must not show up on the next connection */
+		SSL_free(conn->ssl);
+	}
+	if(conn->sock >= 0)
+	{
+		#ifdef _WIN32
+			closesocket(conn->sock);
+		#else
+			close(conn->sock);
+		#endif
+	}
+	free(conn->scheme);
+	free(conn->host);
+	free(conn->port);
+	free(conn);
+}
+
+/*
+	Allocates a connection to the host of the parsed url, without a socket
+*/
+struct http_connection* http_connection_new(struct parsed_url *purl)
+{
+	struct http_connection *conn = (struct http_connection*)malloc(sizeof(struct http_connection));
+	if(conn == NULL)
+	{
+		printf("Unable to allocate memory for connection.");
+		return NULL;
+	}
+	memset(conn, 0, sizeof(struct http_connection));
+	conn->sock = -1;
+	conn->scheme = str_dup(purl->scheme);
+	conn->host = str_dup(purl->host);
+	conn->port = str_dup(purl->port);
+	conn->ishttps = (strcmp(purl->scheme, "https") == 0 || atoi(purl->port) == 443);
+	return conn;
+}
+
+/*
+	Gets the addresses to connect to for the parsed url, in the order they should
+	be tried. Returns the amount of addresses, the caller frees *addrs.
+*/
+int http_connection_addresses(struct parsed_url *purl, struct sockaddr_storage **addrs)
+{
+	unsigned short port = htons(atoi(purl->port));
+	int count = http_dns_lookup_all(purl->host, addrs);
+	int i;
+
+	/* Fall back to the address the url was resolved to */
+	if(count == 0 && purl->ip != NULL)
+	{
+		*addrs = (struct sockaddr_storage*)malloc(sizeof(struct sockaddr_storage));
+		if(*addrs != NULL && http_dns_pton(purl->ip, *addrs) == 0)
+		{
+			count = 1;
+		}
+		else
+		{
+			free(*addrs);
+			*addrs = NULL;
+		}
+	}
+	for(i = 0; i < count; i++)
+	{
+		if((*addrs)[i].ss_family == AF_INET6)
+			((struct sockaddr_in6*)&(*addrs)[i])->sin6_port = port;
+		else
+			((struct sockaddr_in*)&(*addrs)[i])->sin_port = port;
+	}
+	return count;
+}
+
+/*
+	Makes the socket of an attempt the socket of the connection and drops the
+	other attempts
+*/
+void http_connect_race_win(struct http_connection *conn, int sock)
+{
+	int i;
+	for(i = 0; i < conn->race->count; i++)
+	{
+		if(conn->race->socks[i] == sock)
+			conn->race->socks[i] = -1;
+	}
+	conn->sock = sock;
+	conn->nonblocking = 1;
+	http_connect_race_free(conn->race);
+	conn->race = NULL;
+}
+
+/*
+	Starts a connection attempt to the next address. Addresses that fail right
+	away are skipped. Returns 1 when an attempt connected immediately, 0 when one
+	is in progress and -1 when no address is left.
+*/
+int http_connect_race_next(struct http_connection *conn)
+{
+	struct http_connect_race *race = conn->race;
+	while(race->next < race->count)
+	{
+		struct sockaddr_storage *addr = &race->addrs[race->next];
+		socklen_t len = addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		int sock = socket(addr->ss_family, SOCK_STREAM, IPPROTO_TCP);
+		int flags;
+
+		race->next++;
+		if(sock < 0)
+			continue;
+		flags = fcntl(sock, F_GETFL, 0);
+		if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
+		{
+			close(sock);
+			continue;
+		}
+		if(connect(sock, (struct sockaddr *)addr, len) == 0)
+		{
+			http_connect_race_win(conn, sock);
+			return 1;
+		}
+		if(errno != EINPROGRESS)
+		{
+			close(sock);
+			continue;
+		}
+		race->socks[race->next - 1] = sock;
+		race->next_attempt = http_time_ms() + http_connect_attempt_delay;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+	Gets the amount of milliseconds until the next address should be tried,
+	-1 when every address has been tried
+*/
+int http_connect_race_timeout(struct http_connection *conn)
+{
+	long long wait;
+	if(conn->race == NULL || conn->race->next >= conn->race->count)
+		return -1;
+	wait = conn->race->next_attempt - http_time_ms();
+	return wait > 0 ? (int)wait : 0;
+}
+
+/*
+	Waits at most timeout_ms milliseconds for an attempt of a connection to
+	connect, and starts the next attempt when it is due. The winning socket
+	becomes the socket of the connection, it stays non-blocking.
+	Returns 1 when connected, 0 when still connecting and -1 when every attempt
+	failed.
+*/
+int http_connect_race_step(struct http_connection *conn, int timeout_ms)
+{
+	struct http_connect_race *race = conn->race;
+	struct pollfd *fds;
+	int pending = 0;
+	int i, n;
+
+	if(race == NULL)
+		return 1;
+	fds = (struct pollfd*)malloc(race->count * sizeof(struct pollfd));
+	if(fds == NULL)
+		return -1;
+	for(i = 0; i < race->count; i++)
+	{
+		if(race->socks[i] < 0)
+			continue;
+		fds[pending].fd = race->socks[i];
+		fds[pending].events = POLLOUT;
+		fds[pending].revents = 0;
+		pending++;
+	}
+
+	n = pending > 0 ? poll(fds, pending, timeout_ms) : 0;
+	for(i = 0; i < pending && n > 0; i++)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		int j;
+
+		if(fds[i].revents == 0)
+			continue;
+		if(getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+		{
+			int sock = fds[i].fd;
+			free(fds);
+			http_connect_race_win(conn, sock);
+			return 1;
+		}
+		/* This address is unreachable */
+		for(j = 0; j < race->count; j++)
+		{
+			if(race->socks[j] == fds[i].fd)
+				race->socks[j] = -1;
+		}
+		close(fds[i].fd);
+		pending--;
+		fds[i] = fds[pending];
+		i--;
+	}
+	free(fds);
+
+	/* Start the next attempt when it is due, or right away when none is left */
+	if(pending == 0 || http_time_ms() >= race->next_attempt)
+	{
+		int result = http_connect_race_next(conn);
+		if(result == 1)
+			return 1;
+		if(result < 0 && pending == 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Starts opening a connection without blocking. The sockets are non-blocking
+	and the attempts are in progress, http_connect_race_step finishes them. For
+	https the TLS session is attached once connected.
+*/
+struct http_connection* http_connection_start(struct parsed_url *purl)
+{
+	struct http_connection *conn = http_connection_new(purl);
+	struct http_connect_race *race;
+	if(conn == NULL)
+		return NULL;
+
+	race = (struct http_connect_race*)malloc(sizeof(struct http_connect_race));
+	if(race == NULL)
+	{
+		http_connection_close(conn);
+		return NULL;
+	}
+	memset(race, 0, sizeof(struct http_connect_race));
+	conn->race = race;
+	race->count = http_connection_addresses(purl, &race->addrs);
+	if(race->count == 0)
+	{
+		printf("Not a valid IP");
+		http_connection_close(conn);
+		return NULL;
+	}
+	race->socks = (int*)malloc(race->count * sizeof(int));
+	if(race->socks == NULL)
+	{
+		race->count = 0;
+		http_connection_close(conn);
+		return NULL;
+	}
+	memset(race->socks, -1, race->count * sizeof(int));
+
+	if(http_connect_race_next(conn) < 0)
+	{
+		printf("Could not connect");
+		http_connection_close(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+/*
+	Tells why no connection to the host of purl could be started: the host does
+	not resolve, or no address accepted an attempt. Failed lookups are cached, so
+	asking again is cheap.
+*/
+enum http_error http_connection_start_error(struct parsed_url *purl)
+{
+	return parsed_url_resolve(purl) < 0 ? HTTP_ERROR_RESOLVE : HTTP_ERROR_CONNECT;
+}
+
+/*
+	Creates the TLS context shared by all connections on first use. Returns NULL
+	on failure.
+*/
+SSL_CTX* http_tls_context()
+{
+	SSL_CTX *ctx;
+	pthread_mutex_lock(&http_tls_lock);
+	if(http_tls_ctx == NULL)
+	{
+		/* init ssl */
+		SSLeay_add_ssl_algorithms();
+		SSL_load_error_strings();
+		http_tls_ctx = SSL_CTX_new(SSLv23_client_method());
+		if(http_tls_ctx != NULL)
+		{
+			/* Sessions are kept per host by the library, not by OpenSSL */
+			SSL_CTX_set_session_cache_mode(http_tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(http_tls_ctx, http_tls_new_session);
+		}
+	}
+	ctx = http_tls_ctx;
+	pthread_mutex_unlock(&http_tls_lock);
+	return ctx;
+}
+
+/*
+	Attaches a TLS session to a https connection, the handshake is not started.
+	A session saved by an earlier connection to the same host and port is offered
+	for resumption.
+*/
+int http_connection_tls_setup(struct http_connection *conn)
+{
+	SSL_CTX *ctx;
+	SSL_SESSION *session;
+	char *key;
+
+	if(!conn->ishttps)
+		return 0;
+
+	ctx = http_tls_context();
+	if(ctx == NULL || (conn->ssl = SSL_new(ctx)) == NULL)
+		return -1;
+	SSL_set_fd(conn->ssl, conn->sock); /* attach SSL stack to socket */
+	SSL_set_app_data(conn->ssl, conn);
+
+	// SNI support
+	SSL_set_tlsext_host_name(conn->ssl, conn->host);
+	if(http_tls_alpn_h2)
+		SSL_set_alpn_protos(conn->ssl, (const unsigned char*)"\x02h2\x08http/1.1", 12);
+
+	key = http_tls_session_key(conn);
+	session = key != NULL ? http_tls_session_get(key) : NULL;
+	if(session != NULL)
+	{
+		SSL_set_session(conn->ssl, session);
+		SSL_SESSION_free(session);
+	}
+	free(key);
+	return 0;
+}
+
+/*
+	Switches the socket of a connection between blocking and non-blocking mode
+*/
+int http_connection_set_nonblocking(struct http_connection *conn, int nonblocking)
+{
+	int flags;
+	if(conn->nonblocking == nonblocking)
+		return 0;
+	flags = fcntl(conn->sock, F_GETFL, 0);
+	if(flags < 0)
+		return -1;
+	flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if(fcntl(conn->sock, F_SETFL, flags) < 0)
+		return -1;
+	conn->nonblocking = nonblocking;
+	return 0;
+}
+
+/*
+	Gets the time timeout_ms milliseconds from now, 0 when timeout_ms is 0
+*/
+long long http_deadline(int timeout_ms)
+{
+	return timeout_ms > 0 ? http_time_ms() + timeout_ms : 0;
+}
+
+/*
+	Gets the earlier of two deadlines, 0 stands for none
+*/
+long long http_deadline_min(long long a, long long b)
+{
+	if(a == 0 || (b != 0 && b < a))
+		return b;
+	return a;
+}
+
+/*
+	Bounds the I/O on a connection: it fails once deadline has passed, and a read
+	waits at most read_timeout milliseconds for data (0 disables either). With a
+	limit the socket is non-blocking and waits are made with poll, without it the
+	socket blocks as usual. Returns 0 on success and -1 on failure.
+*/
+int http_connection_set_deadline(struct http_connection *conn, long long deadline, int read_timeout)
+{
+	conn->deadline = deadline;
+	conn->read_timeout = read_timeout;
+	conn->timed_out = 0;
+	return http_connection_set_nonblocking(conn, deadline != 0 || read_timeout > 0);
+}
+
+/*
+	Waits until the socket of a connection is ready for events (POLLIN or
+	POLLOUT), within the limits set with http_connection_set_deadline. Returns 0
+	when ready and -1 on failure or timeout, conn->timed_out is set on timeout.
+*/
+int http_connection_wait(struct http_connection *conn, short events)
+{
+	for(;;)
+	{
+		struct pollfd pfd;
+		long long wait = -1;
+		int idle = 0;		/* the wait is bounded by the read timeout */
+		int n;
+
+		if(conn->deadline != 0)
+		{
+			wait = conn->deadline - http_time_ms();
+			if(wait <= 0)
+			{
+				conn->timed_out = events;
+				return -1;
+			}
+		}
+		if((events & POLLIN) && conn->read_timeout > 0 && (wait < 0 || wait > conn->read_timeout))
+		{
+			wait = conn->read_timeout;
+			idle = 1;
+		}
+		pfd.fd = conn->sock;
+		pfd.events = events;
+		pfd.revents = 0;
+		n = poll(&pfd, 1, wait > INT_MAX ? INT_MAX : (int)wait);
+		if(n > 0)
+			return 0;
+		if(n < 0 && errno != EINTR)
+			return -1;
+		if(n == 0 && idle)
+		{
+			conn->timed_out = events;
+			return -1;
+		}
+	}
+}
+
+/*
+	Checks whether a TLS read that returned result without data ended because
+	the peer closed the connection. Many servers close the socket without a
+	close_notify, that ends a body delimited by the end of the connection.
+	OpenSSL 1.1 reports it as a syscall error without errno, OpenSSL 3 as an
+	unexpected EOF.
+*/
+int http_connection_ssl_eof(struct http_connection *conn, long result)
+{
+	int error = SSL_get_error(conn->ssl, (int)result);
+	if(error == SSL_ERROR_ZERO_RETURN)
+		return 1;
+	if(error == SSL_ERROR_SYSCALL && result == 0 && ERR_peek_error() == 0)
+		return 1;
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+	if(error == SSL_ERROR_SSL && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+	{
+		ERR_clear_error();
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/*
+	Handles an I/O operation on a connection that returned result without
+	success: waits when it would have blocked, for events on plain connections and
+	for what OpenSSL asks for on TLS connections. Returns 0 when the operation
+	should be tried again and -1 when it failed.
+*/
+int http_connection_retry(struct http_connection *conn, long result, short events)
+{
+	if(conn->ssl != NULL)
+	{
+		int error = SSL_get_error(conn->ssl, (int)result);
+		if(error == SSL_ERROR_WANT_READ)
+			return http_connection_wait(conn, POLLIN);
+		if(error == SSL_ERROR_WANT_WRITE)
+			return http_connection_wait(conn, POLLOUT);
+		return -1;
+	}
+	if(result < 0 && errno == EINTR)
+		return 0;
+	if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return http_connection_wait(conn, events);
+	return -1;
+}
+
+/*
+	Opens a new connection to the host of the parsed url. The addresses of the
+	host are raced, so an unreachable address family does not delay the request.
+	Connecting and the TLS handshake must be done by deadline (0 for no limit),
+	*error receives the reason of a failure.
+*/
+struct http_connection* http_connection_open(struct parsed_url *purl, long long deadline, enum http_error *error)
+{
+	struct http_connection *conn = http_connection_start(purl);
+	int result = 0;
+	if(conn == NULL)
+	{
+		*error = http_connection_start_error(purl);
+		return NULL;
+	}
+
+	/* Connect */
+	while(result == 0)
+	{
+		long long wait = http_connect_race_timeout(conn);
+		if(deadline != 0)
+		{
+			long long left = deadline - http_time_ms();
+			if(left <= 0)
+				break;
+			if(wait < 0 || wait > left)
+				wait = left > INT_MAX ? INT_MAX : left;
+		}
+		result = http_connect_race_step(conn, (int)wait);
+	}
+	if(result <= 0 || http_connection_set_deadline(conn, deadline, 0) < 0)
+	{
+		printf("Could not connect");
+		*error = result == 0 ? HTTP_ERROR_TIMEOUT_CONNECT : HTTP_ERROR_CONNECT;
+		http_connection_close(conn);
+		return NULL;
+	}
+
+	if(conn->ishttps)
+	{
+		if(http_connection_tls_setup(conn) < 0)
+			result = -1;
+		else
+		{
+			/* initiate SSL handshake */
+			while((result = SSL_connect(conn->ssl)) <= 0 && http_connection_retry(conn, result, 0) == 0)
+				;
+		}
+		if(result <= 0)
+		{
+			printf("SSL handshake failed");
+			*error = conn->timed_out ? HTTP_ERROR_TIMEOUT_TLS : HTTP_ERROR_TLS;
+			http_connection_close(conn);
+			return NULL;
+		}
+	}
+	return conn;
+}
+
+/*
+	Largest piece of consecutive small segments that is copied into one TLS record
+*/
+#define HTTP_TLS_RECORD 16384
+
+/*
+	Most segments passed to sendmsg at once
+*/
+#define HTTP_SENDV_MAX 64
+
+/*
+	Sends the segments over the connection in order, returns 0 on success and -1
+	on failure. Plain connections hand the segments to the kernel with sendmsg,
+	a partial write continues where it stopped. TLS connections write small
+	segments together in one record, so headers and a short body go out in a
+	single packet, larger segments are written in place.
+*/
+int http_connection_sendv(struct http_connection *conn, const struct iovec *iov, int iovcnt)
+{
+	size_t offset = 0;		/* bytes of iov[0] already sent */
+	if(conn->ishttps)
+	{
+		char record[HTTP_TLS_RECORD];
+		size_t used = 0;
+		int i;
+		for(i = 0; i <= iovcnt; i++)
+		{
+			const char *data = i < iovcnt ? (const char*)iov[i].iov_base : NULL;
+			size_t len = i < iovcnt ? iov[i].iov_len : 0;
+
+			/* Collect small segments, they are written with the next large one */
+			if(i < iovcnt && used + len <= sizeof(record))
+			{
+				memcpy(record + used, data, len);
+				used += len;
+				continue;
+			}
+			offset = 0;
+			if(used > 0)
+			{
+				size_t sent = 0;
+
+				/* Top the record up with the start of the large segment */
+				offset = len < sizeof(record) - used ? len : sizeof(record) - used;
+				if(offset > 0)
+					memcpy(record + used, data, offset);
+				used += offset;
+				while(sent < used)
+				{
+					int tmpres = SSL_write(conn->ssl, record + sent, used - sent);
+					if(tmpres <= 0)
+					{
+						if(http_connection_retry(conn, tmpres, POLLOUT) < 0)
+							return -1;
+						continue;
+					}
+					sent += tmpres;
+					conn->written += tmpres;
+				}
+				used = 0;
+			}
+			while(offset < len)
+			{
+				int chunk = len - offset > INT_MAX ? INT_MAX : (int)(len - offset);
+				int tmpres = SSL_write(conn->ssl, data + offset, chunk);
+				if(tmpres <= 0)
+				{
+					if(http_connection_retry(conn, tmpres, POLLOUT) < 0)
+						return -1;
+					continue;
+				}
+				offset += tmpres;
+				conn->written += tmpres;
+			}
+		}
+		return 0;
+	}
+	while(iovcnt > 0)
+	{
+		struct iovec batch[HTTP_SENDV_MAX];
+		struct msghdr msg;
+		ssize_t tmpres;
+		int count = iovcnt < HTTP_SENDV_MAX ? iovcnt : HTTP_SENDV_MAX;
+
+		memcpy(batch, iov, count * sizeof(struct iovec));
+		batch[0].iov_base = (char*)batch[0].iov_base + offset;
+		batch[0].iov_len -= offset;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = batch;
+		msg.msg_iovlen = count;
+		tmpres = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+		if(tmpres < 0)
+		{
+			if(http_connection_retry(conn, tmpres, POLLOUT) < 0)
+				return -1;
+			continue;
+		}
+
+		/* Skip the segments that were sent completely */
+		conn->written += tmpres;
+		tmpres += offset;
+		while(iovcnt > 0 && (size_t)tmpres >= iov[0].iov_len)
+		{
+			tmpres -= iov[0].iov_len;
+			iov++;
+			iovcnt--;
+		}
+		offset = tmpres;
+	}
+	return 0;
+}
+
+/*
+	Sends all data over the connection, returns 0 on success and -1 on failure
+*/
+int http_connection_send(struct http_connection *conn, const char *data, size_t len)
+{
+	struct iovec iov;
+	iov.iov_base = (void*)data;
+	iov.iov_len = len;
+	return http_connection_sendv(conn, &iov, 1);
+}
+
+/*
+	Sends head followed by len bytes of the file fd from offset on, returns 0 on
+	success and -1 on failure. On plain connections the head is sent with MSG_MORE
+	and the file with sendfile, so it goes from the page cache to the socket
+	without being copied into user space. TLS connections, and files sendfile
+	does not support, are read with pread into a record sized buffer, the head
+	shares the first buffer.
+*/
+int http_connection_sendfile(struct http_connection *conn, const char *head, size_t head_len, int fd, off_t offset, size_t len)
+{
+	char chunk[HTTP_TLS_RECORD];
+	size_t used = 0;
+	if(!conn->ishttps)
+	{
+		size_t sent = 0;
+		while(sent < head_len)
+		{
+			ssize_t tmpres = send(conn->sock, head + sent, head_len - sent, MSG_NOSIGNAL | (len > 0 ? MSG_MORE : 0));
+			if(tmpres < 0)
+			{
+				if(http_connection_retry(conn, tmpres, POLLOUT) < 0)
+					return -1;
+				continue;
+			}
+			sent += tmpres;
+			conn->written += tmpres;
+		}
+		head_len = 0;
+#if defined(__linux__)
+		while(len > 0)
+		{
+			ssize_t tmpres = sendfile(conn->sock, fd, &offset, len > 0x7ffff000 ? 0x7ffff000 : len);
+			if(tmpres < 0 && (errno == EINVAL || errno == ENOSYS))
+				break;		/* not supported for this file, read it instead */
+			if(tmpres < 0 && http_connection_retry(conn, tmpres, POLLOUT) == 0)
+				continue;
+			if(tmpres <= 0)
+				return -1;	/* failure, or the file is shorter than len */
+			len -= tmpres;
+			conn->written += tmpres;
+		}
+#endif
+	}
+
+	/* Read the file in chunks, the head goes out with the first one */
+	if(head_len > sizeof(chunk))
+	{
+		if(http_connection_send(conn, head, head_len) < 0)
+			return -1;
+	}
+	else
+	{
+		memcpy(chunk, head, head_len);
+		used = head_len;
+	}
+	while(len > 0 || used > 0)
+	{
+		size_t want = sizeof(chunk) - used < len ? sizeof(chunk) - used : len;
+		while(want > 0)
+		{
+			ssize_t tmpres = pread(fd, chunk + used, want, offset);
+			if(tmpres < 0 && errno == EINTR)
+				continue;
+			if(tmpres <= 0)
+				return -1;
+			used += tmpres;
+			offset += tmpres;
+			len -= tmpres;
+			want -= tmpres;
+		}
+		if(http_connection_send(conn, chunk, used) < 0)
+			return -1;
+		used = 0;
+	}
+	return 0;
+}
+
+/*
+	Receives at most len bytes, returns the amount read, 0 on EOF and -1 on failure
+*/
+long http_connection_recv(struct http_connection *conn, char *buf, size_t len)
+{
+	for(;;)
+	{
+		long n;
+		if(conn->ishttps)
+		{
+			n = SSL_read(conn->ssl, buf, len);
+			if(n > 0)
+				return n;
+			if(http_connection_ssl_eof(conn, n))
+				return 0;
+		}
+		else
+		{
+			n = recv(conn->sock, buf, len, 0);
+			if(n >= 0)
+				return n;
+		}
+		if(http_connection_retry(conn, n, POLLIN) < 0)
+			return -1;
+	}
+}
+
+/*
+	Checks whether an idle connection is still usable. An idle HTTP/1.1
+	connection must not be readable: readable means the server closed it or sent
+	junk. A HTTP/2 server may send frames at any time, they are handled.
+*/
+int http_connection_is_alive(struct http_connection *conn)
+{
+	struct pollfd pfd;
+	if(conn->h2 != NULL)
+		return http2_connection_idle(conn);
+	if(conn->ssl != NULL && SSL_pending(conn->ssl) > 0)
+		return 0;
+	pfd.fd = conn->sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if(poll(&pfd, 1, 0) != 0)
+		return 0;
+	return 1;
+}
+
+/*
+	Checks whether a connection belongs to the given (scheme, host, port)
+*/
+int http_connection_matches(struct http_connection *conn, char *scheme, char *host, char *port)
+{
+	return strcmp(conn->scheme, scheme) == 0
+		&& strcasecmp(conn->host, host) == 0
+		&& strcmp(conn->port, port) == 0;
+}
+
+/*
+	Closes idle connections that have been in the pool for too long
+*/
+void http_pool_evict_idle()
+{
+	struct http_connection *expired = NULL;
+	struct http_connection **link;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&http_pool_lock);
+	link = &http_pool_head;
+	while(*link != NULL)
+	{
+		struct http_connection *conn = *link;
+		if(now - conn->last_used >= http_pool_idle_timeout)
+		{
+			*link = conn->next;
+			conn->next = expired;
+			expired = conn;
+			http_pool_count--;
+		}
+		else
+		{
+			link = &conn->next;
+		}
+	}
+	pthread_mutex_unlock(&http_pool_lock);
+
+	while(expired != NULL)
+	{
+		struct http_connection *next = expired->next;
+		http_connection_close(expired);
+		expired = next;
+	}
+}
+
+/*
+	Closes all idle connections
+*/
+void http_pool_flush()
+{
+	struct http_connection *conn;
+
+	pthread_mutex_lock(&http_pool_lock);
+	conn = http_pool_head;
+	http_pool_head = NULL;
+	http_pool_count = 0;
+	pthread_mutex_unlock(&http_pool_lock);
+
+	while(conn != NULL)
+	{
+		struct http_connection *next = conn->next;
+		http_connection_close(conn);
+		conn = next;
+	}
+}
+
+/*
+	Takes an idle connection to the host of the parsed url out of the pool,
+	returns NULL when there is none.
+*/
+struct http_connection* http_pool_take(struct parsed_url *purl)
+{
+	struct http_connection **link;
+
+	http_pool_evict_idle();
+
+	for(;;)
+	{
+		struct http_connection *conn = NULL;
+
+		pthread_mutex_lock(&http_pool_lock);
+		for(link = &http_pool_head; *link != NULL; link = &(*link)->next)
+		{
+			if(http_connection_matches(*link, purl->scheme, purl->host, purl->port))
+			{
+				conn = *link;
+				*link = conn->next;
+				conn->next = NULL;
+				http_pool_count--;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&http_pool_lock);
+
+		if(conn == NULL)
+			return NULL;
+		if(http_connection_is_alive(conn))
+		{
+			conn->reused = 1;
+			conn->written = 0;
+			return conn;
+		}
+		/* The server closed it while it was idle */
+		http_connection_close(conn);
+	}
+}
+
+/*
+	Returns a connection to the host of the parsed url. An idle pooled connection
+	is handed out when allow_reuse is set and one is available, otherwise a new
+	connection is opened by deadline, see http_connection_open.
+*/
+struct http_connection* http_pool_checkout(struct parsed_url *purl, int allow_reuse, long long deadline, enum http_error *error)
+{
+	struct http_connection *conn = allow_reuse ? http_pool_take(purl) : NULL;
+	if(conn != NULL)
+		return conn;
+	return http_connection_open(purl, deadline, error);
+}
+
+/*
+	Hands a connection back to the pool after a complete response has been read
+	from it. The connection is closed when the pool limits are reached.
+*/
+void http_pool_checkin(struct http_connection *conn)
+{
+	struct http_connection *conn_iter;
+	struct http_connection *evicted = NULL;
+	int per_host = 0;
+
+	if(conn == NULL)
+		return;
+	conn->last_used = time(NULL);
+	conn->reused = 0;
+
+	/* Idle connections block, the next request sets its own limits */
+	if(http_connection_set_deadline(conn, 0, 0) < 0)
+	{
+		http_connection_close(conn);
+		return;
+	}
+
+	pthread_mutex_lock(&http_pool_lock);
+	for(conn_iter = http_pool_head; conn_iter != NULL; conn_iter = conn_iter->next)
+	{
+		if(http_connection_matches(conn_iter, conn->scheme, conn->host, conn->port))
+			per_host++;
+	}
+	if(http_pool_max_idle <= 0 || per_host >= http_pool_max_per_host)
+	{
+		evicted = conn;
+	}
+	else
+	{
+		conn->next = http_pool_head;
+		http_pool_head = conn;
+		http_pool_count++;
+
+		/* Drop the least recently used connection when over the limit */
+		if(http_pool_count > http_pool_max_idle)
+		{
+			struct http_connection **link = &http_pool_head;
+			while((*link)->next != NULL)
+				link = &(*link)->next;
+			evicted = *link;
+			*link = NULL;
+			http_pool_count--;
+		}
+	}
+	pthread_mutex_unlock(&http_pool_lock);
+
+	http_connection_close(evicted);
+}
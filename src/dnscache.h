@@ -0,0 +1,503 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+/*
+	Cache settings, in seconds. The system resolver does not report record TTLs,
+	so every answer is kept for http_dns_ttl. An entry that is used within
+	http_dns_refresh_ahead seconds of expiring is refreshed in the background.
+	Setting http_dns_ttl to 0 disables the cache.
+*/
+int http_dns_ttl = 60;
+int http_dns_negative_ttl = 5;			/* failed lookups */
+int http_dns_refresh_ahead = 10;
+int http_dns_max_entries = 1024;
+
+#define HTTP_DNS_BUCKETS 256
+
+/*
+	Represents a cached lookup
+*/
+struct http_dns_entry
+{
+	char *host;							/* lower case */
+	struct sockaddr_storage *addrs;		/* NULL for a failed lookup */
+	int count;
+	time_t expires;
+	int refreshing;
+	struct http_dns_entry *next;
+};
+
+struct http_dns_entry *http_dns_table[HTTP_DNS_BUCKETS];
+int http_dns_count = 0;
+pthread_mutex_t http_dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Resolves a hostname with the system resolver, bypassing the cache. Every
+	A and AAAA record is returned, ordered as RFC 8305 asks: the address families
+	alternate, starting with IPv6. A host in brackets is an IPv6 literal.
+	Returns the amount of addresses, the caller frees *addrs. 0 is returned when
+	the hostname does not resolve.
+*/
+int http_dns_resolve(const char *hostname, struct sockaddr_storage **addrs)
+{
+	struct addrinfo hints, *result, *ai, *v6, *v4;
+	struct sockaddr_storage *list;
+	char literal[INET6_ADDRSTRLEN];
+	size_t len = strlen(hostname);
+	int total = 0, count = 0;
+
+	*addrs = NULL;
+	if(len > 2 && hostname[0] == '[' && hostname[len - 1] == ']' && len - 2 < sizeof(literal))
+	{
+		memcpy(literal, hostname + 1, len - 2);
+		literal[len - 2] = '\0';
+		hostname = literal;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(hostname, NULL, &hints, &result) != 0)
+		return 0;
+	for(ai = result; ai != NULL; ai = ai->ai_next)
+		total++;
+	list = (struct sockaddr_storage*)calloc(total, sizeof(struct sockaddr_storage));
+	if(list == NULL)
+	{
+		freeaddrinfo(result);
+		return 0;
+	}
+
+	/* Interleave the families, keeping the order of the resolver within each */
+	v6 = result;
+	v4 = result;
+	for(;;)
+	{
+		while(v6 != NULL && v6->ai_family != AF_INET6)
+			v6 = v6->ai_next;
+		while(v4 != NULL && v4->ai_family != AF_INET)
+			v4 = v4->ai_next;
+		if(v6 == NULL && v4 == NULL)
+			break;
+		if(v6 != NULL)
+		{
+			memcpy(&list[count++], v6->ai_addr, sizeof(struct sockaddr_in6));
+			v6 = v6->ai_next;
+		}
+		if(v4 != NULL)
+		{
+			memcpy(&list[count++], v4->ai_addr, sizeof(struct sockaddr_in));
+			v4 = v4->ai_next;
+		}
+	}
+	freeaddrinfo(result);
+	if(count == 0)
+	{
+		free(list);
+		return 0;
+	}
+	*addrs = list;
+	return count;
+}
+
+/*
+	Formats an address as a string, the caller frees the returned string
+*/
+char* http_dns_ntop(const struct sockaddr_storage *addr)
+{
+	char ip[INET6_ADDRSTRLEN];
+	const void *src = addr->ss_family == AF_INET6
+		? (const void*)&((const struct sockaddr_in6*)addr)->sin6_addr
+		: (const void*)&((const struct sockaddr_in*)addr)->sin_addr;
+	if(inet_ntop(addr->ss_family, src, ip, sizeof(ip)) == NULL)
+		return NULL;
+	return str_dup(ip);
+}
+
+/*
+	Parses a numeric IPv4 or IPv6 address, returns 0 on success and -1 otherwise
+*/
+int http_dns_pton(const char *ip, struct sockaddr_storage *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+	if(inet_pton(AF_INET, ip, &((struct sockaddr_in*)addr)->sin_addr) == 1)
+	{
+		addr->ss_family = AF_INET;
+		return 0;
+	}
+	if(inet_pton(AF_INET6, ip, &((struct sockaddr_in6*)addr)->sin6_addr) == 1)
+	{
+		addr->ss_family = AF_INET6;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+	Hashes a hostname, case insensitive
+*/
+unsigned int http_dns_hash(const char *hostname)
+{
+	unsigned int hash = 2166136261u;
+	for(; *hostname; hostname++)
+		hash = (hash ^ (unsigned char)tolower((unsigned char)*hostname)) * 16777619u;
+	return hash % HTTP_DNS_BUCKETS;
+}
+
+/*
+	Finds the entry of a hostname, the lock must be held
+*/
+struct http_dns_entry* http_dns_find(const char *hostname)
+{
+	struct http_dns_entry *entry;
+	for(entry = http_dns_table[http_dns_hash(hostname)]; entry != NULL; entry = entry->next)
+	{
+		if(strcasecmp(entry->host, hostname) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+	Frees a cache entry
+*/
+void http_dns_entry_free(struct http_dns_entry *entry)
+{
+	free(entry->host);
+	free(entry->addrs);
+	free(entry);
+}
+
+/*
+	Makes room for a new entry by dropping expired entries, or the entry that
+	expires first when none has expired. The lock must be held.
+*/
+void http_dns_evict()
+{
+	struct http_dns_entry **oldest = NULL;
+	time_t now = time(NULL);
+	int i;
+
+	for(i = 0; i < HTTP_DNS_BUCKETS; i++)
+	{
+		struct http_dns_entry **link = &http_dns_table[i];
+		while(*link != NULL)
+		{
+			struct http_dns_entry *entry = *link;
+			if(entry->expires <= now)
+			{
+				*link = entry->next;
+				http_dns_entry_free(entry);
+				http_dns_count--;
+				continue;
+			}
+			if(oldest == NULL || entry->expires < (*oldest)->expires)
+				oldest = link;
+			link = &entry->next;
+		}
+	}
+	if(http_dns_count >= http_dns_max_entries && oldest != NULL)
+	{
+		struct http_dns_entry *entry = *oldest;
+		*oldest = entry->next;
+		http_dns_entry_free(entry);
+		http_dns_count--;
+	}
+}
+
+/*
+	Stores the result of a lookup and takes ownership of addrs, addrs is NULL
+	for a failed lookup. The lock must be held.
+*/
+void http_dns_store(const char *hostname, struct sockaddr_storage *addrs, int count, int ttl)
+{
+	struct http_dns_entry *entry = http_dns_find(hostname);
+	if(entry == NULL)
+	{
+		unsigned int bucket = http_dns_hash(hostname);
+		char *host;
+		char *c;
+
+		if(http_dns_count >= http_dns_max_entries)
+			http_dns_evict();
+		entry = (struct http_dns_entry*)malloc(sizeof(struct http_dns_entry));
+		host = str_dup(hostname);
+		if(entry == NULL || host == NULL)
+		{
+			free(entry);
+			free(host);
+			free(addrs);
+			return;
+		}
+		for(c = host; *c; c++)
+			*c = tolower((unsigned char)*c);
+		entry->host = host;
+		entry->addrs = NULL;
+		entry->refreshing = 0;
+		entry->next = http_dns_table[bucket];
+		http_dns_table[bucket] = entry;
+		http_dns_count++;
+	}
+	free(entry->addrs);
+	entry->addrs = addrs;
+	entry->count = addrs != NULL ? count : 0;
+	entry->expires = time(NULL) + ttl;
+}
+
+/*
+	Re-resolves a hostname in the background. A failure keeps the old answer
+	until it expires, an entry that was flushed meanwhile is not recreated.
+*/
+void* http_dns_refresh(void *arg)
+{
+	char *hostname = (char*)arg;
+	struct sockaddr_storage *addrs;
+	int count = http_dns_resolve(hostname, &addrs);
+	struct http_dns_entry *entry;
+
+	pthread_mutex_lock(&http_dns_lock);
+	entry = http_dns_find(hostname);
+	if(entry != NULL)
+	{
+		if(count > 0)
+		{
+			http_dns_store(hostname, addrs, count, http_dns_ttl);
+			addrs = NULL;
+		}
+		entry->refreshing = 0;
+	}
+	pthread_mutex_unlock(&http_dns_lock);
+
+	free(addrs);
+	free(hostname);
+	return NULL;
+}
+
+/*
+	Retrieves every address of a hostname through the cache, in the order they
+	should be tried. Returns the amount of addresses, the caller frees *addrs.
+	0 is returned when the hostname does not resolve.
+*/
+int http_dns_lookup_all(const char *hostname, struct sockaddr_storage **addrs)
+{
+	struct http_dns_entry *entry;
+	struct sockaddr_storage *copy;
+	int count;
+	time_t now = time(NULL);
+
+	if(http_dns_ttl <= 0)
+		return http_dns_resolve(hostname, addrs);
+
+	*addrs = NULL;
+	pthread_mutex_lock(&http_dns_lock);
+	entry = http_dns_find(hostname);
+	if(entry != NULL && entry->expires > now)
+	{
+		count = entry->count;
+		if(count > 0)
+		{
+			*addrs = (struct sockaddr_storage*)malloc(count * sizeof(struct sockaddr_storage));
+			if(*addrs != NULL)
+				memcpy(*addrs, entry->addrs, count * sizeof(struct sockaddr_storage));
+			else
+				count = 0;
+		}
+
+		/* Refresh before the entry expires, so that lookups never wait for it */
+		if(entry->count > 0 && !entry->refreshing && entry->expires - now <= http_dns_refresh_ahead)
+		{
+			pthread_t thread;
+			char *host = str_dup(entry->host);
+			if(host != NULL && pthread_create(&thread, NULL, http_dns_refresh, host) == 0)
+			{
+				entry->refreshing = 1;
+				pthread_detach(thread);
+			}
+			else
+			{
+				free(host);
+			}
+		}
+		pthread_mutex_unlock(&http_dns_lock);
+		return count;
+	}
+	pthread_mutex_unlock(&http_dns_lock);
+
+	/* Missing or expired, resolve without holding the lock */
+	count = http_dns_resolve(hostname, addrs);
+	copy = NULL;
+	if(count > 0)
+	{
+		copy = (struct sockaddr_storage*)malloc(count * sizeof(struct sockaddr_storage));
+		if(copy != NULL)
+			memcpy(copy, *addrs, count * sizeof(struct sockaddr_storage));
+	}
+
+	pthread_mutex_lock(&http_dns_lock);
+	if(count == 0 || copy != NULL)
+		http_dns_store(hostname, copy, count, count > 0 ? http_dns_ttl : http_dns_negative_ttl);
+	pthread_mutex_unlock(&http_dns_lock);
+	return count;
+}
+
+/*
+	Checks whether a lookup of hostname is answered without waiting for the
+	resolver: the host is a numeric address, or the cache holds an answer that has
+	not expired. With the cache disabled 1 is returned, as an answer found elsewhere
+	would not be kept for the lookup that follows.
+*/
+int http_dns_ready(const char *hostname)
+{
+	struct sockaddr_storage addr;
+	struct http_dns_entry *entry;
+	size_t len = strlen(hostname);
+	int ready;
+
+	if(http_dns_ttl <= 0 || (len > 2 && hostname[0] == '[' && hostname[len - 1] == ']')
+		|| http_dns_pton(hostname, &addr) == 0)
+		return 1;
+	pthread_mutex_lock(&http_dns_lock);
+	entry = http_dns_find(hostname);
+	ready = entry != NULL && entry->expires > time(NULL);
+	pthread_mutex_unlock(&http_dns_lock);
+	return ready;
+}
+
+/*
+	A lookup run on a thread of its own by http_dns_lookup_async
+*/
+struct http_dns_async
+{
+	char *host;
+	void (*done)(void *user);
+	void *user;
+};
+
+/*
+	Looks a hostname up into the cache and reports that it is done
+*/
+void* http_dns_lookup_thread(void *arg)
+{
+	struct http_dns_async *async = (struct http_dns_async*)arg;
+	struct sockaddr_storage *addrs;
+
+	http_dns_lookup_all(async->host, &addrs);
+	free(addrs);
+	async->done(async->user);
+	free(async->host);
+	free(async);
+	return NULL;
+}
+
+/*
+	Looks a hostname up into the cache on a thread of its own, so that the caller
+	does not wait for the resolver. done is called with user on that thread once
+	the answer, or the failure, is in the cache. Returns 0 when the lookup started
+	and -1 when it could not, done is not called then.
+*/
+int http_dns_lookup_async(const char *hostname, void (*done)(void *user), void *user)
+{
+	struct http_dns_async *async = (struct http_dns_async*)malloc(sizeof(struct http_dns_async));
+	pthread_t thread;
+
+	if(async == NULL)
+		return -1;
+	async->host = str_dup(hostname);
+	async->done = done;
+	async->user = user;
+	if(async->host == NULL || pthread_create(&thread, NULL, http_dns_lookup_thread, async) != 0)
+	{
+		free(async->host);
+		free(async);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+	Retrieves the preferred address of a hostname through the cache as a string.
+	The caller frees the returned string, NULL is returned when the hostname does
+	not resolve.
+*/
+char* http_dns_lookup(const char *hostname)
+{
+	struct sockaddr_storage *addrs;
+	char *ip = NULL;
+	if(http_dns_lookup_all(hostname, &addrs) > 0)
+		ip = http_dns_ntop(&addrs[0]);
+	free(addrs);
+	return ip;
+}
+
+/*
+	Adds an answer to the cache, for example to pre-seed it at startup. ip is a
+	numeric IPv4 or IPv6 address, or NULL to cache a failed lookup.
+*/
+void http_dns_seed(const char *hostname, const char *ip, int ttl)
+{
+	struct sockaddr_storage *addr = NULL;
+	if(ip != NULL)
+	{
+		addr = (struct sockaddr_storage*)malloc(sizeof(struct sockaddr_storage));
+		if(addr == NULL || http_dns_pton(ip, addr) < 0)
+		{
+			free(addr);
+			return;
+		}
+	}
+	pthread_mutex_lock(&http_dns_lock);
+	http_dns_store(hostname, addr, 1, ttl);
+	pthread_mutex_unlock(&http_dns_lock);
+}
+
+/*
+	Removes a hostname from the cache, or every entry when hostname is NULL
+*/
+void http_dns_flush(const char *hostname)
+{
+	int i;
+
+	pthread_mutex_lock(&http_dns_lock);
+	for(i = 0; i < HTTP_DNS_BUCKETS; i++)
+	{
+		struct http_dns_entry **link = &http_dns_table[i];
+		while(*link != NULL)
+		{
+			struct http_dns_entry *entry = *link;
+			if(hostname == NULL || strcasecmp(entry->host, hostname) == 0)
+			{
+				*link = entry->next;
+				http_dns_entry_free(entry);
+				http_dns_count--;
+				continue;
+			}
+			link = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&http_dns_lock);
+}
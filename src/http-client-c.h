@@ -30,22 +30,35 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
 
 #ifdef _WIN32
 	#include <winsock2.h>
 	#include <ws2tcpip.h>
 	#include <stdio.h>
 	#pragma comment(lib, "Ws2_32.lib")
-#elif _LINUX
-	#include <sys/socket.h>
-#elif __FreeBSD__
+#elif defined(_LINUX) || defined(__linux__) || defined(__FreeBSD__)
     #include <sys/socket.h>
 	
     #include <netinet/in.h>
     #include <netdb.h>
     #include <arpa/inet.h>
     #include <unistd.h>
-	
+    #include <strings.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <sys/uio.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #if defined(__linux__)
+        #include <sys/sendfile.h>
+    #endif
+    #include <pthread.h>
+#else
+	#error Platform not suppoted.
+#endif
+
 //#define OPENSSL
 #if defined(OPENSSL)
 	#include <openssl/crypto.h>
@@ -56,22 +69,44 @@
 	#include <openssl/x509.h>
 	#include <openssl/x509_vfy.h>
 #endif
-#else
-	#error Platform not suppoted.
-#endif
 
 #include <errno.h>
+#include <zlib.h>
 #include "stringx.h"
+#include "httpscan.h"
+#include "dnscache.h"
 #include "urlparser.h"
+#include "connpool.h"
+#include "httpheaders.h"
+#include "httpparser.h"
+#include "httpinflate.h"
+#include "http2.h"
 
 /*
 	Prototype functions
 */
+struct http_callbacks;
 struct http_response* http_req(char *http_headers, struct parsed_url *purl);
+struct http_response* http_req_stream(char *http_headers, struct parsed_url *purl, struct http_callbacks *callbacks);
+struct http_response* http_cache_req(char *http_headers, struct parsed_url *purl);
+extern int http_cache_max_bytes;
+extern char *http_cache_dir;
+struct http_response* http_req_fetch(char *http_headers, struct parsed_url *purl);
+void http_response_discard(struct http_response *hresp);
+int http_engine_idempotent(const char *http_headers);
+struct http_response* http_req_body(char *http_headers, struct parsed_url *purl, const struct iovec *body, int body_count, struct http_callbacks *callbacks);
+struct http_response* http_req_file(char *http_headers, struct parsed_url *purl, int fd, off_t offset, size_t len, struct http_callbacks *callbacks);
 struct http_response* http_put(char *url, char *custom_headers);
+struct http_response* http_put_file(char *url, char *custom_headers, int fd, off_t offset, size_t len);
+struct http_response* http_post_file(char *url, char *custom_headers, int fd, off_t offset, size_t len);
 struct http_response* http_get(char *url, char *custom_headers);
+struct http_response* http_get_stream(char *url, char *custom_headers, struct http_callbacks *callbacks);
+struct http_response* http_get_arena(char *url, char *custom_headers, struct http_arena *arena);
 struct http_response* http_head(char *url, char *custom_headers);
 struct http_response* http_post(char *url, char *custom_headers, char *post_data);
+int http_build_request_head(struct str_buffer *buf, const char *method, struct parsed_url *purl, const char *custom_headers, const char *content_type, long content_length);
+int http_build_request(struct str_buffer *buf, const char *method, struct parsed_url *purl, const char *custom_headers, const char *content_type, const char *body, size_t body_len);
+char* http_build(const char *method, struct parsed_url *purl, const char *custom_headers, const char *content_type, long content_length);
 
 
 /*
@@ -81,640 +116,988 @@ struct http_response
 {
 	struct parsed_url *request_uri;
 	char *body;
+	size_t body_len;
+	size_t encoded_len;					/* length of the body as sent, before it was decoded */
+	void *mapping;						/* body and strings point into it when set, see httpdiskcache.h */
+	size_t mapping_len;
 	char *status_code;
 	int status_code_int;
 	char *status_text;
 	char *request_headers;
 	char *response_headers;
+	struct http_header_table headers;	/* fields of response_headers, see http_response_header */
+	struct http_arena *arena;			/* the response and its strings live in it when set */
+	char **redirects;					/* urls the request was redirected from, in order */
+	int redirect_count;
 };
 
 /*
-	Handles redirect if needed for get requests
+	Callbacks for streaming a response instead of collecting it in memory
 */
-struct http_response* handle_redirect_get(struct http_response* hresp, char* custom_headers)
+struct http_callbacks
 {
-	if(hresp->status_code_int > 300 && hresp->status_code_int < 399)
-	{
-		char *token = strtok(hresp->response_headers, "\r\n");
-		while(token != NULL)
-		{
-			if(str_contains(token, "Location:"))
-			{
-				/* Extract url */
-				char *location = str_replace("Location: ", "", token);
-				return http_get(location, custom_headers);
-			}
-			token = strtok(NULL, "\r\n");
-		}
-	}
-	else
-	{
-		/* We're not dealing with a redirect, just return the same structure */
-		return hresp;
-	}
+	/*
+		Called once the status and headers of a response are known, redirect
+		responses that are followed are skipped. A non-zero return aborts the request.
+	*/
+	int (*on_headers)(struct http_response *hresp, void *user);
+	/* Called for every piece of the body as it arrives, a non-zero return aborts the request */
+	int (*on_body)(const char *data, size_t len, void *user);
+	void *user;
+};
+
+/*
+	Gets the value of a response header, the name is case insensitive. The value
+	points into response_headers and is not NUL terminated, its length is stored
+	in len. Returns NULL when the response has no such header.
+*/
+const char* http_response_header(struct http_response *hresp, const char *name, size_t *len)
+{
+	const struct http_header *field = http_header_table_find(&hresp->headers, hresp->response_headers, name);
+	if(field == NULL)
+		return NULL;
+	if(len != NULL)
+		*len = field->value_len;
+	return hresp->response_headers + field->value_offset;
 }
 
 /*
-	Handles redirect if needed for head requests
+	Gets the value of a well-known response header, like http_response_header
 */
-struct http_response* handle_redirect_head(struct http_response* hresp, char* custom_headers)
+const char* http_response_header_by_id(struct http_response *hresp, enum http_header_id id, size_t *len)
 {
-	if(hresp->status_code_int > 300 && hresp->status_code_int < 399)
-	{
-		char *token = strtok(hresp->response_headers, "\r\n");
-		while(token != NULL)
-		{
-			if(str_contains(token, "Location:"))
-			{
-				/* Extract url */
-				char *location = str_replace("Location: ", "", token);
-				return http_head(location, custom_headers);
-			}
-			token = strtok(NULL, "\r\n");
-		}
-	}
-	else
-	{
-		/* We're not dealing with a redirect, just return the same structure */
-		return hresp;
-	}
+	const struct http_header *field;
+	if(id <= HTTP_HEADER_OTHER || id >= HTTP_HEADER_COUNT || hresp->headers.index[id] == 0)
+		return NULL;
+	field = &hresp->headers.fields[hresp->headers.index[id] - 1];
+	if(len != NULL)
+		*len = field->value_len;
+	return hresp->response_headers + field->value_offset;
 }
 
 /*
-	Handles redirect if needed for post requests
+	Gets the header at position i (0 to hresp->headers.count - 1) of a response,
+	for iterating over all headers. Returns 0 on success and -1 when i is out of range.
 */
-struct http_response* handle_redirect_post(struct http_response* hresp, char* custom_headers, char *post_data)
+int http_response_header_at(struct http_response *hresp, int i, const char **name, size_t *name_len, const char **value, size_t *value_len)
 {
-	if(hresp->status_code_int > 300 && hresp->status_code_int < 399)
-	{
-		char *token = strtok(hresp->response_headers, "\r\n");
-		while(token != NULL)
-		{
-			if(str_contains(token, "Location:"))
-			{
-				/* Extract url */
-				char *location = str_replace("Location: ", "", token);
-				return http_post(location, custom_headers, post_data);
-			}
-			token = strtok(NULL, "\r\n");
-		}
-	}
-	else
-	{
-		/* We're not dealing with a redirect, just return the same structure */
-		return hresp;
-	}
+	const struct http_header *field;
+	if(i < 0 || i >= hresp->headers.count)
+		return -1;
+	field = &hresp->headers.fields[i];
+	*name = hresp->response_headers + field->name_offset;
+	*name_len = field->name_len;
+	*value = hresp->response_headers + field->value_offset;
+	*value_len = field->value_len;
+	return 0;
 }
 
 /*
-	Makes a HTTP request and returns the response
+	Gets the Location of a redirect response, the caller frees the returned
+	string. Returns NULL when the response is not a redirect or has no Location.
 */
-struct http_response* http_req(char *http_headers, struct parsed_url *purl)
+char* http_response_location(struct http_response *hresp)
 {
-	
-	SSL *ssl; 
-	SSL_CTX *ctx; 
-	SSL_METHOD *client_method; 
-	X509 *server_cert;
-	
-	int sd,err;	
-	char *str;
-	int ishttps;
-	
-	/* Parse url */
-	if(purl == NULL)
-	{
-		printf("Unable to parse url");
+	const char *location;
+	size_t len;
+	if(hresp == NULL || hresp->status_code_int <= 300 || hresp->status_code_int >= 399)
 		return NULL;
+	location = http_response_header_by_id(hresp, HTTP_HEADER_LOCATION, &len);
+	return location != NULL ? str_ndup(location, len) : NULL;
+}
+
+/*
+	Returns the value used for the Connection header of outgoing requests
+*/
+const char* http_connection_header()
+{
+	return http_pool_max_idle > 0 ? "keep-alive" : "close";
+}
+
+/*
+	State of a request while its response is parsed
+*/
+struct http_req_context
+{
+	struct http_response *hresp;
+	struct http_callbacks *callbacks;
+	struct http_parser parser;
+	struct str_buffer body;
+	struct http_inflate inflate;		/* decodes a compressed body */
+	size_t encoded_len;
+};
+
+/*
+	Fills in the status and headers of the response once the parser has them
+*/
+int http_req_on_headers(struct http_parser *parser, void *data)
+{
+	struct http_req_context *context = (struct http_req_context*)data;
+	struct http_response *hresp = context->hresp;
+
+	/* Status code and text */
+	hresp->status_code = http_arena_strndup(hresp->arena, parser->head.data + 9, 3);
+	hresp->status_code_int = parser->status_code;
+	hresp->status_text = http_arena_strndup(hresp->arena, parser->head.data + parser->status_text_offset, parser->status_text_len);
+
+	/* Response headers, the head buffer without the blank line is handed over */
+	parser->head.len -= parser->head.len >= 4 && memcmp(parser->head.data + parser->head.len - 4, "\r\n\r\n", 4) == 0 ? 4 : 2;
+	parser->head.data[parser->head.len] = '\0';
+	hresp->response_headers = parser->head.data;
+	hresp->headers = parser->headers;
+	str_buffer_init_arena(&parser->head, hresp->arena);
+	http_header_table_init_arena(&parser->headers, hresp->arena);
+
+	/* A body compressed as asked for with Accept-Encoding is decoded as it arrives */
+	if(http_accept_encoding && !parser->head_request && parser->status_code != 204 && parser->status_code != 304)
+	{
+		size_t len;
+		const char *encoding = http_response_header_by_id(hresp, HTTP_HEADER_CONTENT_ENCODING, &len);
+		int decoder = encoding != NULL ? http_inflate_encoding(encoding, len) : 0;
+		if(decoder != 0 && http_inflate_init(&context->inflate, decoder, hresp->arena) < 0)
+			return -1;
 	}
 
-	/* Declare variable */
-	int sock;
-	int tmpres;
-	char buf[BUFSIZ+1];
-	struct sockaddr_in *remote;
+	if(context->callbacks != NULL && context->callbacks->on_headers != NULL)
+		return context->callbacks->on_headers(hresp, context->callbacks->user);
+	return 0;
+}
+
+/*
+	Passes a piece of the (decoded) body to the callback, or collects it
+*/
+int http_req_emit_body(void *data, const char *at, size_t len)
+{
+	struct http_req_context *context = (struct http_req_context*)data;
+	if(context->callbacks != NULL && context->callbacks->on_body != NULL)
+		return context->callbacks->on_body(at, len, context->callbacks->user);
+	return str_buffer_append(&context->body, at, len);
+}
+
+/*
+	Handles a piece of the body as received, it is decoded first when compressed
+*/
+int http_req_on_body(struct http_parser *parser, const char *at, size_t len, void *data)
+{
+	struct http_req_context *context = (struct http_req_context*)data;
+	(void)parser;
+	context->encoded_len += len;
+	if(context->inflate.active)
+		return http_inflate_feed(&context->inflate, at, len, http_req_emit_body, context);
+	return http_req_emit_body(context, at, len);
+}
 
+/*
+	Prepares the response and the parser for a request. The response takes
+	ownership of http_headers and purl once the request succeeds. When purl lives
+	in an arena the response, its strings and the parser buffers are allocated
+	there too.
+*/
+int http_req_context_init(struct http_req_context *context, char *http_headers, struct parsed_url *purl, struct http_callbacks *callbacks)
+{
 	/* Allocate memeory for htmlcontent */
-	struct http_response *hresp = (struct http_response*)malloc(sizeof(struct http_response));
+	struct http_arena *arena = purl->arena;
+	struct http_response *hresp = (struct http_response*)http_arena_malloc(arena, sizeof(struct http_response));
 	if(hresp == NULL)
 	{
 		printf("Unable to allocate memory for htmlcontent.");
-		return NULL;
+		return -1;
 	}
 	hresp->body = NULL;
-	hresp->request_headers = NULL;
+	hresp->body_len = 0;
+	hresp->encoded_len = 0;
+	hresp->mapping = NULL;
+	hresp->mapping_len = 0;
 	hresp->response_headers = NULL;
 	hresp->status_code = NULL;
 	hresp->status_text = NULL;
+	hresp->status_code_int = 0;
+	hresp->arena = arena;
+	hresp->redirects = NULL;
+	hresp->redirect_count = 0;
+	http_header_table_init(&hresp->headers);
 
-	/* Create TCP socket */
-	if((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+	/* Assign request headers */
+	hresp->request_headers = http_headers;
+
+	/* Assign request url */
+	hresp->request_uri = purl;
+
+	context->hresp = hresp;
+	context->callbacks = callbacks;
+	str_buffer_init_arena(&context->body, arena);
+	memset(&context->inflate, 0, sizeof(struct http_inflate));
+	context->encoded_len = 0;
+	http_parser_init_arena(&context->parser, strncmp(http_headers, "HEAD ", 5) == 0, arena);
+	context->parser.on_headers_complete = http_req_on_headers;
+	context->parser.on_body = http_req_on_body;
+	context->parser.data = context;
+	return 0;
+}
+
+/*
+	Returns the response once the parser is done with it, or frees it and
+	returns NULL when the response is incomplete.
+*/
+struct http_response* http_req_context_finish(struct http_req_context *context)
+{
+	struct http_response *hresp = context->hresp;
+	http_parser_free(&context->parser);
+
+	/* A compressed body must end with the end of its compressed data */
+	if(context->inflate.active && http_inflate_finish(&context->inflate) < 0)
+		context->parser.state = HTTP_PARSER_ERROR;
+	http_inflate_free(&context->inflate);
+
+	if(context->parser.state != HTTP_PARSER_DONE)
 	{
-	    printf("Can't create TCP socket");
+		/* What was allocated in an arena goes when the arena is released */
+		if(hresp->arena != NULL)
+			return NULL;
+		str_buffer_free(&context->body);
+		free(hresp->status_code);
+		free(hresp->status_text);
+		free(hresp->response_headers);
+		http_header_table_free(&hresp->headers);
+		free(hresp);
 		return NULL;
 	}
 
-	/* Set remote->sin_addr.s_addr */
-	remote = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in *));
-	remote->sin_family = AF_INET;
-  	tmpres = inet_pton(AF_INET, purl->ip, (void *)(&(remote->sin_addr.s_addr)));
-  	if( tmpres < 0)
-  	{
-		free(remote);
-    	printf("Can't set remote->sin_addr.s_addr");
-    	return NULL;
-  	}
-	else if(tmpres == 0)
-  	{
-		free(remote);
-		printf("Not a valid IP");
-    	return NULL;
-  	}
-	remote->sin_port = htons(atoi(purl->port));
-	
-	if(atoi(purl->port) == 443)
-		ishttps = 1;
-	else
-		ishttps = 0;
-	
-	if(ishttps)
+	/* Body */
+	hresp->encoded_len = context->encoded_len;
+	if(context->callbacks == NULL || context->callbacks->on_body == NULL)
+	{
+		if(context->body.data == NULL)
+			str_buffer_append(&context->body, "", 0);
+		hresp->body = context->body.data;
+		hresp->body_len = context->body.len;
+	}
+	return hresp;
+}
+
+/*
+	Reason the last request of the calling thread failed, HTTP_ERROR_NONE when it
+	got a response
+*/
+__thread enum http_error http_req_error = HTTP_ERROR_NONE;
+
+/*
+	Makes a HTTP request with the body described by upload, it is sent after
+	http_headers without being copied into the request. With callbacks the response
+	body is passed to callbacks->on_body as it arrives and the body of the returned
+	response is NULL. The request is bounded by http_connect_timeout,
+	http_request_timeout and http_read_timeout, http_req_error tells which phase
+	failed or timed out.
+*/
+struct http_response* http_req_upload(char *http_headers, struct parsed_url *purl, const struct http_upload *upload, struct http_callbacks *callbacks)
+{
+	struct http_connection *conn = NULL;
+	struct http_req_context context;
+	struct http_parser *parser = &context.parser;
+	struct http_response *hresp;
+	enum http_error error = HTTP_ERROR_NONE;
+	long long deadline = http_deadline(http_request_timeout);
+	struct iovec *iov;
+	int attempt, idempotent;
+
+	/* Parse url */
+	if(purl == NULL)
 	{
-		/* init ssl */
-		printf("(1) SSL context initialized\n\n"); 
-		SSLeay_add_ssl_algorithms();
-		client_method = SSLv23_client_method(); 
-		SSL_load_error_strings(); 
-		ctx = SSL_CTX_new(client_method);
+		printf("Unable to parse url");
+		http_req_error = HTTP_ERROR_URL;
+		return NULL;
 	}
-	/* Connect */
-	if(connect(sock, (struct sockaddr *)remote, sizeof(struct sockaddr)) < 0)
+	if(http_req_context_init(&context, http_headers, purl, callbacks) < 0)
 	{
-		free(remote);
-	    printf("Could not connect");
+		http_req_error = HTTP_ERROR_MEMORY;
 		return NULL;
 	}
-	if(ishttps)
+	iov = (struct iovec*)http_arena_malloc(purl->arena, (upload->count + 1) * sizeof(struct iovec));
+	if(iov == NULL)
 	{
-		printf("(3) TCP connection open to host '%s', port %d\n\n", purl->host, remote->sin_port); 
-		ssl = SSL_new(ctx);
-		SSL_set_fd(ssl, sock); /* attach SSL stack to socket */
-		
-		// SNI support
-		SSL_set_tlsext_host_name(ssl,purl->host);
-		
-		err = SSL_connect(ssl); /* initiate SSL handshake */ 
-		printf("(4) SSL endpoint created & handshake completed\n\n"); 
-		printf("(5) SSL connected with cipher: %s\n\n", SSL_get_cipher(ssl)); 
-		server_cert = SSL_get_peer_certificate(ssl); 
-		printf("(6) server's certificate was received:\n\n"); 
-		str = X509_NAME_oneline(X509_get_subject_name(server_cert), 0, 0); 
-		printf(" subject: %s\n", str); 
-		str = X509_NAME_oneline(X509_get_issuer_name(server_cert), 0, 0); 
-		printf(" issuer: %s\n\n", str); 
-		X509_free(server_cert);
+		printf("Unable to allocate memory for the request.");
+		http_req_error = HTTP_ERROR_MEMORY;
+		return http_req_context_finish(&context);
 	}
-	/* Send headers to server */
-	int sent = 0;
-	while(sent < strlen(http_headers))
+	iov[0].iov_base = http_headers;
+	iov[0].iov_len = strlen(http_headers);
+	if(upload->count > 0)
+		memcpy(iov + 1, upload->segments, upload->count * sizeof(struct iovec));
+
+	/*
+		A pooled connection may have been closed by the server since it was used,
+		in that case the request is retried once on a new connection. Only an
+		idempotent request is sent again once a byte of it reached the server,
+		the server may have acted on the others.
+	*/
+	idempotent = http_engine_idempotent(http_headers);
+	for(attempt = 0; attempt < 2; attempt++)
 	{
-		if(ishttps)
-			tmpres = SSL_write(ssl, http_headers+sent, strlen(http_headers)-sent);
-		else
-			tmpres = send(sock, http_headers+sent, strlen(http_headers)-sent, 0);
-		if(tmpres == -1)
+		char BUF[BUFSIZ];
+		long recived_len = 0;
+		size_t total_len = 0;
+		int reused;
+
+		conn = http_pool_checkout(purl, attempt == 0, http_deadline_min(deadline, http_deadline(http_connect_timeout)), &error);
+		if(conn == NULL)
+			break;
+		reused = conn->reused;
+		if(http_connection_set_deadline(conn, deadline, http_read_timeout) < 0)
 		{
-			printf("Can't send headers");
-			return NULL;
+			http_connection_close(conn);
+			conn = NULL;
+			error = HTTP_ERROR_CONNECT;
+			break;
 		}
-		sent += tmpres;
-	 }
-	
-	shutdown (sd, 1); /* send EOF to server */
-	if(ishttps)
-		printf("(7) sent HTTP request over encrypted channel:\n\n%s\n",http_headers);	
 
-	/* Recieve into response*/
-	char *response = (char*)malloc(0);
-	char BUF[BUFSIZ];
-	size_t recived_len = 0;
-
-//	while((recived_len = recv(sock, BUF, BUFSIZ-1, 0)) > 0)
-	if(ishttps)
-	{
-		while((recived_len = SSL_read(ssl, BUF, BUFSIZ-1)) > 0)
+		/* A HTTP/2 connection carries the request as a stream */
+		if(http2_connection_setup(conn) < 0)
 		{
-			BUF[recived_len] = '\0';
-			response = (char*)realloc(response, strlen(response) + strlen(BUF) + 1);
-			sprintf(response, "%s%s", response, BUF);
+			http_connection_close(conn);
+			conn = NULL;
+			printf("Unable to allocate memory for the request.");
+			error = HTTP_ERROR_MEMORY;
+			break;
 		}
-	}
-	else {
-		while((recived_len = recv(sock, BUF, BUFSIZ-1, 0)) > 0)
+		if(conn->h2 != NULL)
 		{
-			BUF[recived_len] = '\0';
-			response = (char*)realloc(response, strlen(response) + strlen(BUF) + 1);
-			sprintf(response, "%s%s", response, BUF);			
+			int result = http2_request(conn, http_headers, upload, parser);
+			short timed_out = conn->timed_out;
+			if(result == 0 && !conn->h2->dead && !conn->h2->goaway)
+				http_pool_checkin(conn);
+			else
+				http_connection_close(conn);
+			conn = NULL;
+			if(result == 0)
+				break;
+			if(timed_out)
+			{
+				error = timed_out == POLLOUT ? HTTP_ERROR_TIMEOUT_SEND : HTTP_ERROR_TIMEOUT_RECV;
+				break;
+			}
+			if(result > 0 || (reused && idempotent && parser->state == HTTP_PARSER_STATUS_LINE && parser->head.len == 0))
+				continue;
+			printf("Unabel to recieve");
+			error = parser->state == HTTP_PARSER_ERROR ? HTTP_ERROR_PROTOCOL : HTTP_ERROR_RECV;
+			break;
 		}
-	}
-	
-	if (recived_len < 0)
-    {
-		free(remote);
-		free(response);
-		free(http_headers);
-		#ifdef _WIN32
-			closesocket(sock);
-		#else
-			close(sock);
-		#endif
-        printf("Unabel to recieve");
-		return NULL;
-    }
-
-	/* Reallocate response */
-	response = (char*)realloc(response, strlen(response) + 1);
 
-	if(ishttps)
-		printf ("(8) HTTP response:\n\n%s\n",response); 
+		/* Send headers and body to server */
+		if((upload->fd >= 0 ? http_connection_sendfile(conn, http_headers, iov[0].iov_len, upload->fd, upload->offset, upload->len)
+				: http_connection_sendv(conn, iov, upload->count + 1)) < 0)
+		{
+			short timed_out = conn->timed_out;
+			size_t written = conn->written;
+			http_connection_close(conn);
+			conn = NULL;
+			if(reused && !timed_out && (idempotent || written == 0))
+				continue;
+			printf("Can't send headers");
+			error = timed_out ? HTTP_ERROR_TIMEOUT_SEND : HTTP_ERROR_SEND;
+			break;
+		}
 
-	/* Close socket */
-	#ifdef _WIN32
-		closesocket(sock);
-	#else
-	if(ishttps)
-	{
-		SSL_shutdown(ssl); 
-		close(sock);
-		SSL_free (ssl); 
-		SSL_CTX_free (ctx);
-	}
-	else {
-		close(sock);
-	}
-	#endif
+		/* Feed the parser until the response is complete */
+		while(parser->state != HTTP_PARSER_DONE && parser->state != HTTP_PARSER_ERROR)
+		{
+			recived_len = http_connection_recv(conn, BUF, BUFSIZ);
+			if(recived_len <= 0)
+				break;
+			total_len += recived_len;
+			if(http_parser_execute(parser, BUF, recived_len) < (size_t)recived_len && parser->state == HTTP_PARSER_DONE)
+				parser->keep_alive = 0;		/* unexpected bytes after the response */
+		}
+		if(recived_len == 0)
+			http_parser_finish(parser);
 
-	/* Parse status code and text */
-	char *status = get_until(response, "\r\n");
-	char *status_line = str_replace("HTTP/1.1 ", "", status);
-	
-	free(status);
-	
-	status = strndup(status_line, 4);
-	char *status_code = str_replace(" ", "", status);
-	
-	free(status);
-	
-	status = str_replace(status_code, "", status_line);
-	char *status_text = str_replace(" ", "", status);
-	
-	free(status);
-	free(status_line);
-	
-	hresp->status_code = status_code;
-	hresp->status_code_int = atoi(status_code);
-	hresp->status_text = status_text;
+		if(parser->state != HTTP_PARSER_DONE)
+		{
+			short timed_out = conn->timed_out;
+			http_connection_close(conn);
+			conn = NULL;
+			if(reused && idempotent && total_len == 0 && recived_len <= 0 && !timed_out)
+				continue;
+			printf("Unabel to recieve");
+			if(timed_out)
+				error = HTTP_ERROR_TIMEOUT_RECV;
+			else
+				error = parser->state == HTTP_PARSER_ERROR ? HTTP_ERROR_PROTOCOL : HTTP_ERROR_RECV;
+			break;
+		}
 
-	/* Parse response headers */
-	char *headers = get_until(response, "\r\n\r\n");
-	hresp->response_headers = headers;
+		/* Keep the connection when the server allows it */
+		if(parser->keep_alive)
+			http_pool_checkin(conn);
+		else
+			http_connection_close(conn);
+		conn = NULL;
+		break;
+	}
 
-	/* Assign request headers */
-	hresp->request_headers = http_headers;
+	/* Return response */
+	if(purl->arena == NULL)
+		free(iov);
+	hresp = http_req_context_finish(&context);
+	http_req_error = hresp != NULL ? HTTP_ERROR_NONE : error != HTTP_ERROR_NONE ? error : HTTP_ERROR_PROTOCOL;
+	return hresp;
+}
 
-	/* Assign request url */
-	hresp->request_uri = purl;
+/*
+	Makes a HTTP request whose body is made of body_count segments, they are sent
+	after http_headers with a single scatter-gather write.
+*/
+struct http_response* http_req_body(char *http_headers, struct parsed_url *purl, const struct iovec *body, int body_count, struct http_callbacks *callbacks)
+{
+	struct http_upload upload;
+	memset(&upload, 0, sizeof(upload));
+	upload.segments = body;
+	upload.count = body_count;
+	upload.fd = -1;
+	return http_req_upload(http_headers, purl, &upload, callbacks);
+}
 
-	/* Parse body */
-	char *body = strstr(response, "\r\n\r\n");
-	body = str_replace("\r\n\r\n", "", body);
-	hresp->body = body;
-	
-	free(remote);
-	free(response);
-	
+/*
+	Makes a HTTP request whose body is len bytes of the file fd from offset on. On
+	plain connections the file is sent by the kernel without being read into memory,
+	on TLS connections it is read and encrypted in bounded chunks.
+*/
+struct http_response* http_req_file(char *http_headers, struct parsed_url *purl, int fd, off_t offset, size_t len, struct http_callbacks *callbacks)
+{
+	struct http_upload upload;
+	memset(&upload, 0, sizeof(upload));
+	upload.fd = fd;
+	upload.offset = offset;
+	upload.len = len;
+	return http_req_upload(http_headers, purl, &upload, callbacks);
+}
 
-	/* Return response */
-	return hresp;
+/*
+	Makes a HTTP request and returns the response. With callbacks the body is passed
+	to callbacks->on_body as it arrives and the body of the returned response is NULL.
+	Without callbacks GET and HEAD requests go through the response cache when it
+	is enabled, and safe requests are retried and hedged as configured.
+*/
+struct http_response* http_req_stream(char *http_headers, struct parsed_url *purl, struct http_callbacks *callbacks)
+{
+	http_req_error = HTTP_ERROR_NONE;
+	if(callbacks == NULL && (http_cache_max_bytes > 0 || http_cache_dir != NULL))
+		return http_cache_req(http_headers, purl);
+	if(callbacks == NULL)
+		return http_req_fetch(http_headers, purl);
+	return http_req_body(http_headers, purl, NULL, 0, callbacks);
 }
 
+/*
+	Makes a HTTP request and returns the response
+*/
+struct http_response* http_req(char *http_headers, struct parsed_url *purl)
+{
+	return http_req_stream(http_headers, purl, NULL);
+}
 
 /*
-Makes a HTTP PUT request to the given url
+	Parses the url of a request made by one of the http_* functions. The url, the
+	request and its response are allocated in arena, or in a new arena that is
+	freed with the response when arena is NULL.
 */
-struct http_response* http_put(char *url, char *custom_headers)
+struct parsed_url* http_request_url(const char *url, struct http_arena *arena)
 {
-	/* Parse url */
-	struct parsed_url *purl = parse_url(url);
-	if(purl == NULL)
+	struct parsed_url *purl;
+	int owned = arena == NULL;
+	if(owned)
+	{
+		arena = http_arena_new(0);
+		if(arena == NULL)
 		{
-			printf("Unable to parse url");
+			printf("Unable to allocate memory for the request.");
+			http_req_error = HTTP_ERROR_MEMORY;
 			return NULL;
 		}
-	
-	/* Declare variable */
-	char *http_headers = (char*)malloc(1024);
-	memset(http_headers, 0, 1024);
-	
-	/* Build query/headers */
-	if(purl->path != NULL)
-		{
-			if(purl->query != NULL)
-				{
-					sprintf(http_headers, "PUT /%s?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->query, purl->host);
-				}
-			else
-				{
-					sprintf(http_headers, "PUT /%s HTTP/1.1\r\nHost:%s\r\napplication/javascript\r\nContent-length: %d\r\nConnection:close\r\n\r\n%s", \
-						purl->path, purl->host, strlen(custom_headers),custom_headers);
-				}
-		}
-	else
-		{
-			if(purl->query != NULL)
-				{
-					sprintf(http_headers, "PUT /?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->query, purl->host);
-				}
-			else
-				{
-					sprintf(http_headers, "PUT / HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->host);
-				}
-		}
-	
-	/* Handle authorisation if needed */
-	if(purl->username != NULL)
-		{
-			/* Format username:password pair */
-			char *upwd = (char*)malloc(1024);
-			sprintf(upwd, "%s:%s", purl->username, purl->password);
-			upwd = (char*)realloc(upwd, strlen(upwd) + 1);
-			
-			/* Base64 encode */
-			char *base64 = base64_encode(upwd);
-			
-			/* Form header */
-			char *auth_header = (char*)malloc(1024);
-			sprintf(auth_header, "Authorization: Basic %s\r\n", base64);
-			auth_header = (char*)realloc(auth_header, strlen(auth_header) + 1);
-			
-			/* Add to header */
-			http_headers = (char*)realloc(http_headers, strlen(http_headers) + strlen(auth_header) + 2);
-			sprintf(http_headers, "%s%s", http_headers, auth_header);
-		}
+		arena->keep = 0;
+	}
+	purl = parse_url_arena(url, arena);
+	if(purl == NULL)
+	{
+		if(owned)
+			http_arena_free(arena);
+		printf("Unable to parse url");
+		http_req_error = HTTP_ERROR_URL;
+	}
+	return purl;
+}
 
-	/* Add custom headers, and close */
-	if(custom_headers != NULL)
-		{
-			sprintf(http_headers, "%s%s\r\n", http_headers, custom_headers);
-		}
+/*
+	Frees the request headers and url of a request that got no response, the
+	arena of the url is released
+*/
+void http_request_free(char *http_headers, struct parsed_url *purl)
+{
+	struct http_arena *arena = purl != NULL ? purl->arena : NULL;
+	if(http_headers != NULL && !http_arena_owns(arena, http_headers))
+		free(http_headers);
+	if(arena != NULL)
+		http_arena_release(arena);
 	else
-		{
-			sprintf(http_headers, "%s\r\n", http_headers);
-		}
+		parsed_url_free(purl);
+}
 
-	http_headers = (char*)realloc(http_headers, strlen(http_headers) + 1);
 
-	/* Make request and return response */
-	struct http_response *hresp = http_req(http_headers, purl);
-	
-	/* Handle redirect */
-	return handle_redirect_get(hresp, custom_headers);
+/*
+	Redirects that are followed at most, the last redirect response is returned
+	when there are more
+*/
+int http_max_redirects = 10;
 
+/*
+	Checks whether a response is a redirect that is followed: 301, 302, 303, 307
+	or 308
+*/
+int http_redirect_followed(int status_code)
+{
+	return status_code == 301 || status_code == 302 || status_code == 303 || status_code == 307 || status_code == 308;
 }
 
 /*
-	Makes a HTTP GET request to the given url
+	Gets the length of the body described by upload
 */
-struct http_response* http_get(char *url, char *custom_headers)
+long http_upload_length(const struct http_upload *upload)
 {
-	/* Parse url */
-	struct parsed_url *purl = parse_url(url);
-	if(purl == NULL)
-	{
-		printf("Unable to parse url");
+	long len = 0;
+	int i;
+	if(upload->fd >= 0)
+		return (long)upload->len;
+	for(i = 0; i < upload->count; i++)
+		len += (long)upload->segments[i].iov_len;
+	return len;
+}
+
+/*
+	Gets the url a response redirects to, or NULL when it is not a redirect that
+	is followed: hops redirects were followed already, it has no Location, or the
+	Location does not resolve to a http or https url. purl is the url of the
+	request, the result is allocated in its arena.
+*/
+struct parsed_url* http_redirect_target(struct parsed_url *purl, struct http_response *hresp, int hops)
+{
+	struct parsed_url *next;
+	const char *location;
+	char *target;
+	size_t len = 0;
+
+	if(!http_redirect_followed(hresp->status_code_int) || hops >= http_max_redirects)
 		return NULL;
-	}
+	location = http_response_header_by_id(hresp, HTTP_HEADER_LOCATION, &len);
+	if(location == NULL)
+		return NULL;
+	target = parsed_url_join(purl, location, len, purl->arena);
+	if(target == NULL)
+		return NULL;
+	next = parse_url_arena(target, purl->arena);
+	if(next == NULL || (strcmp(next->scheme, "http") != 0 && strcmp(next->scheme, "https") != 0))
+		return NULL;
+	return next;
+}
 
-	/* Declare variable */
-	char *http_headers = (char*)malloc(1024);
+/*
+	Stands between a redirected request and the callbacks of the caller, a hop
+	that is followed is not passed on
+*/
+struct http_follow
+{
+	struct http_callbacks *callbacks;	/* of the caller */
+	struct parsed_url *purl;			/* url of the current hop */
+	struct parsed_url *next;			/* set once the current hop turns out to be followed */
+	int hops;
+};
 
-	/* Build query/headers */
-	if(purl->path != NULL)
+int http_follow_on_headers(struct http_response *hresp, void *user)
+{
+	struct http_follow *follow = (struct http_follow*)user;
+	follow->next = http_redirect_target(follow->purl, hresp, follow->hops);
+	if(follow->next != NULL || follow->callbacks->on_headers == NULL)
+		return 0;
+	return follow->callbacks->on_headers(hresp, follow->callbacks->user);
+}
+
+int http_follow_on_body(const char *data, size_t len, void *user)
+{
+	struct http_follow *follow = (struct http_follow*)user;
+	if(follow->next != NULL)
+		return 0;
+	return follow->callbacks->on_body(data, len, follow->callbacks->user);
+}
+
+/*
+	Makes a request with the given method to url and follows its redirects one
+	after the other, at most http_max_redirects of them. Every hop is parsed and
+	allocated in the arena of the request, so following a redirect frees nothing
+	and allocates little, and a redirect to the same origin reuses the pooled
+	connection. 303 turns every method but HEAD into GET, 301 and 302 turn POST
+	into GET, 307 and 308 keep the method and send the body again. Without
+	upload the request goes through http_req_stream, with its cache and retries.
+	The urls the request was redirected from are in hresp->redirects.
+	Callbacks only see the response that is returned: the headers and body of a
+	redirect that is followed are dropped, a redirect that is not followed (the
+	last one allowed, or one without a usable Location) is passed on like any
+	other response.
+*/
+struct http_response* http_request_follow(const char *method, char *url, char *custom_headers, const char *content_type, const struct http_upload *upload, struct http_callbacks *callbacks, struct http_arena *arena)
+{
+	struct parsed_url *purl = http_request_url(url, arena);
+	struct http_callbacks hop_callbacks;
+	struct http_follow follow;
+	struct http_response *hresp;
+	struct str_buffer chain;
+	int hops;
+
+	if(purl == NULL)
+		return NULL;
+	if(callbacks != NULL)
 	{
-		if(purl->query != NULL)
-		{
-			sprintf(http_headers, "GET /%s?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->query, purl->host);
-		}
-		else
-		{
-			sprintf(http_headers, "GET /%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->host);
-		}
+		follow.callbacks = callbacks;
+		hop_callbacks.on_headers = http_follow_on_headers;
+		hop_callbacks.on_body = callbacks->on_body != NULL ? http_follow_on_body : NULL;
+		hop_callbacks.user = &follow;
 	}
-	else
+	str_buffer_init_arena(&chain, purl->arena);
+	for(hops = 0; ; hops++)
 	{
-		if(purl->query != NULL)
+		struct parsed_url *next;
+		char *http_headers = http_build(method, purl, custom_headers, upload != NULL ? content_type : NULL, upload != NULL ? http_upload_length(upload) : -1);
+		if(http_headers == NULL)
 		{
-			sprintf(http_headers, "GET /?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->query, purl->host);
+			http_request_free(NULL, purl);
+			http_req_error = HTTP_ERROR_MEMORY;
+			return NULL;
 		}
+		follow.purl = purl;
+		follow.next = NULL;
+		follow.hops = hops;
+
+		/* Make request */
+		if(upload != NULL)
+			hresp = http_req_upload(http_headers, purl, upload, callbacks != NULL ? &hop_callbacks : NULL);
 		else
+			hresp = http_req_stream(http_headers, purl, callbacks != NULL ? &hop_callbacks : NULL);
+		if(hresp == NULL)
 		{
-			sprintf(http_headers, "GET / HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->host);
+			http_request_free(http_headers, purl);
+			return NULL;
 		}
-	}
 
-	/* Handle authorisation if needed */
-	if(purl->username != NULL)
-	{
-		/* Format username:password pair */
-		char *upwd = (char*)malloc(1024);
-		sprintf(upwd, "%s:%s", purl->username, purl->password);
-		upwd = (char*)realloc(upwd, strlen(upwd) + 1);
-
-		/* Base64 encode */
-		char *base64 = base64_encode(upwd);
-
-		/* Form header */
-		char *auth_header = (char*)malloc(1024);
-		sprintf(auth_header, "Authorization: Basic %s\r\n", base64);
-		auth_header = (char*)realloc(auth_header, strlen(auth_header) + 1);
-
-		/* Add to header */
-		http_headers = (char*)realloc(http_headers, strlen(http_headers) + strlen(auth_header) + 2);
-		sprintf(http_headers, "%s%s", http_headers, auth_header);
-	}
+		/* Find where the redirect goes, a Location that can not be followed ends the chain */
+		next = callbacks != NULL ? follow.next : http_redirect_target(purl, hresp, hops);
+		if(next == NULL || str_buffer_append(&chain, purl->uri, strlen(purl->uri) + 1) < 0)
+			break;
 
-	/* Add custom headers, and close */
-	if(custom_headers != NULL)
-	{
-		sprintf(http_headers, "%s%s\r\n", http_headers, custom_headers);
+		/* The redirect response is dropped, its url and request stay in the arena */
+		if(hresp->status_code_int == 303 ? strcmp(method, "HEAD") != 0
+			: hresp->status_code_int <= 302 && strcmp(method, "POST") == 0)
+		{
+			method = "GET";
+			upload = NULL;
+		}
+		hresp->request_headers = NULL;
+		hresp->request_uri = NULL;
+		http_response_discard(hresp);
+		if(!http_arena_owns(purl->arena, http_headers))
+			free(http_headers);
+		purl = next;
 	}
-	else
+
+	/* Record the chain of redirects */
+	if(hops > 0)
 	{
-		sprintf(http_headers, "%s\r\n", http_headers);
+		char **redirects = (char**)http_arena_malloc(purl->arena, hops * sizeof(char*) + chain.len);
+		if(redirects != NULL)
+		{
+			char *urls = (char*)(redirects + hops);
+			int i;
+			memcpy(urls, chain.data, chain.len);
+			for(i = 0; i < hops; i++)
+			{
+				redirects[i] = urls;
+				urls += strlen(urls) + 1;
+			}
+			hresp->redirects = redirects;
+			hresp->redirect_count = hops;
+		}
 	}
-	http_headers = (char*)realloc(http_headers, strlen(http_headers) + 1);
+	str_buffer_free(&chain);
+	return hresp;
+}
 
-	/* Make request and return response */
-	struct http_response *hresp = http_req(http_headers, purl);
 
-	/* Handle redirect */
-	return handle_redirect_get(hresp, custom_headers);
+/*
+Makes a HTTP PUT request to the given url
+*/
+struct http_response* http_put(char *url, char *custom_headers)
+{
+	/* The body is empty */
+	struct http_upload upload;
+	memset(&upload, 0, sizeof(upload));
+	upload.fd = -1;
+	return http_request_follow("PUT", url, custom_headers, NULL, &upload, NULL, NULL);
 }
 
 /*
-	Makes a HTTP POST request to the given url
+	Uploads len bytes of the file fd from offset on to the given url with a PUT
+	request, the file is not read into memory
 */
-struct http_response* http_post(char *url, char *custom_headers, char *post_data)
+struct http_response* http_put_file(char *url, char *custom_headers, int fd, off_t offset, size_t len)
 {
-	/* Parse url */
-	struct parsed_url *purl = parse_url(url);
-	if(purl == NULL)
-	{
-		printf("Unable to parse url");
-		return NULL;
-	}
+	struct http_upload upload;
+	memset(&upload, 0, sizeof(upload));
+	upload.fd = fd;
+	upload.offset = offset;
+	upload.len = len;
+	return http_request_follow("PUT", url, custom_headers, "application/octet-stream", &upload, NULL, NULL);
+}
 
-	/* Declare variable */
-	char *http_headers = (char*)malloc(1024);
+/*
+	Uploads len bytes of the file fd from offset on to the given url with a POST
+	request, the file is not read into memory
+*/
+struct http_response* http_post_file(char *url, char *custom_headers, int fd, off_t offset, size_t len)
+{
+	struct http_upload upload;
+	memset(&upload, 0, sizeof(upload));
+	upload.fd = fd;
+	upload.offset = offset;
+	upload.len = len;
+	return http_request_follow("POST", url, custom_headers, "application/octet-stream", &upload, NULL, NULL);
+}
 
-	/* Build query/headers */
-	if(purl->path != NULL)
+/*
+	A piece of a request being serialized
+*/
+struct http_request_piece
+{
+	const char *data;
+	size_t len;
+};
+
+/*
+	Adds a piece to a request being serialized
+*/
+void http_request_piece_add(struct http_request_piece *pieces, int *count, const char *data, size_t len)
+{
+	pieces[*count].data = data;
+	pieces[*count].len = len;
+	(*count)++;
+}
+
+/*
+	Base64 encodes "username:password" into out, which holds
+	4 * ((username_len + password_len + 3) / 3) bytes
+*/
+void http_request_encode_userinfo(char *out, const char *username, size_t username_len, const char *password, size_t password_len)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t len = username_len + 1 + password_len;
+	size_t i;
+	for(i = 0; i < len; i += 3)
 	{
-		if(purl->query != NULL)
-		{
-			sprintf(http_headers, "POST /%s?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\nContent-Length:%zu\r\nContent-Type:application/x-www-form-urlencoded\r\n", purl->path, purl->query, purl->host, strlen(post_data));
-		}
-		else
+		unsigned char in[3] = { 0, 0, 0 };
+		size_t j;
+		for(j = 0; j < 3 && i + j < len; j++)
 		{
-			sprintf(http_headers, "POST /%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\nContent-Length:%zu\r\nContent-Type:application/x-www-form-urlencoded\r\n", purl->path, purl->host, strlen(post_data));
+			size_t k = i + j;
+			in[j] = k < username_len ? username[k] : k == username_len ? ':' : password[k - username_len - 1];
 		}
+		*out++ = b64[in[0] >> 2];
+		*out++ = b64[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		*out++ = j > 1 ? b64[((in[1] & 0x0f) << 2) | (in[2] >> 6)] : '=';
+		*out++ = j > 2 ? b64[in[2] & 0x3f] : '=';
 	}
-	else
+}
+
+/*
+	Serializes the head of a request for the parsed url into buf in a single pass:
+	the request line, Host, Authorization (when the url has a username), Connection,
+	Accept-Encoding (with http_accept_encoding), Content-Length and Content-Type when
+	content_length is not -1, custom_headers (each line ending in CRLF) and the blank
+	line. The exact size is reserved up front, so at most one allocation is done, and
+	none when buf is reused and large enough. The head is appended to buf, returns 0
+	on success and -1 when out of memory.
+*/
+int http_build_request_head(struct str_buffer *buf, const char *method, struct parsed_url *purl, const char *custom_headers, const char *content_type, long content_length)
+{
+	struct http_request_piece pieces[24];
+	const char *default_port = strcmp(purl->scheme, "https") == 0 ? "443" : "80";
+	const char *connection = http_connection_header();
+	char length[48];
+	size_t username_len = 0, password_len = 0, auth_len = 0;
+	size_t total = 0;
+	char *out;
+	int count = 0, i;
+
+	/* Request line */
+	http_request_piece_add(pieces, &count, method, strlen(method));
+	http_request_piece_add(pieces, &count, " /", 2);
+	if(purl->path != NULL)
+		http_request_piece_add(pieces, &count, purl->path, strlen(purl->path));
+	if(purl->query != NULL)
 	{
-		if(purl->query != NULL)
-		{
-			sprintf(http_headers, "POST /?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\nContent-Length:%zu\r\nContent-Type:application/x-www-form-urlencoded\r\n", purl->query, purl->host, strlen(post_data));
-		}
-		else
-		{
-			sprintf(http_headers, "POST / HTTP/1.1\r\nHost:%s\r\nConnection:close\r\nContent-Length:%zu\r\nContent-Type:application/x-www-form-urlencoded\r\n", purl->host, strlen(post_data));
-		}
+		http_request_piece_add(pieces, &count, "?", 1);
+		http_request_piece_add(pieces, &count, purl->query, strlen(purl->query));
+	}
+	http_request_piece_add(pieces, &count, " HTTP/1.1\r\nHost:", 16);
+	http_request_piece_add(pieces, &count, purl->host, strlen(purl->host));
+	if(strcmp(purl->port, default_port) != 0)
+	{
+		http_request_piece_add(pieces, &count, ":", 1);
+		http_request_piece_add(pieces, &count, purl->port, strlen(purl->port));
 	}
+	http_request_piece_add(pieces, &count, "\r\n", 2);
 
-	/* Handle authorisation if needed */
+	/* Handle authorisation if needed, the credentials are encoded in place */
 	if(purl->username != NULL)
 	{
-		/* Format username:password pair */
-		char *upwd = (char*)malloc(1024);
-		sprintf(upwd, "%s:%s", purl->username, purl->password);
-		upwd = (char*)realloc(upwd, strlen(upwd) + 1);
-
-		/* Base64 encode */
-		char *base64 = base64_encode(upwd);
-
-		/* Form header */
-		char *auth_header = (char*)malloc(1024);
-		sprintf(auth_header, "Authorization: Basic %s\r\n", base64);
-		auth_header = (char*)realloc(auth_header, strlen(auth_header) + 1);
-
-		/* Add to header */
-		http_headers = (char*)realloc(http_headers, strlen(http_headers) + strlen(auth_header) + 2);
-		sprintf(http_headers, "%s%s", http_headers, auth_header);
+		username_len = strlen(purl->username);
+		password_len = purl->password != NULL ? strlen(purl->password) : 0;
+		auth_len = 4 * ((username_len + password_len + 3) / 3);
+		http_request_piece_add(pieces, &count, "Authorization: Basic ", 21);
+		http_request_piece_add(pieces, &count, NULL, auth_len);
+		http_request_piece_add(pieces, &count, "\r\n", 2);
 	}
 
-	if(custom_headers != NULL)
+	http_request_piece_add(pieces, &count, "Connection:", 11);
+	http_request_piece_add(pieces, &count, connection, strlen(connection));
+	http_request_piece_add(pieces, &count, "\r\n", 2);
+	if(http_accept_encoding)
+		http_request_piece_add(pieces, &count, "Accept-Encoding: gzip, deflate\r\n", 32);
+
+	if(content_length >= 0)
 	{
-		sprintf(http_headers, "%s%s\r\n", http_headers, custom_headers);
-		sprintf(http_headers, "%s\r\n%s", http_headers, post_data);
+		http_request_piece_add(pieces, &count, length, snprintf(length, sizeof(length), "Content-Length:%ld\r\n", content_length));
+		if(content_type != NULL)
+		{
+			http_request_piece_add(pieces, &count, "Content-Type:", 13);
+			http_request_piece_add(pieces, &count, content_type, strlen(content_type));
+			http_request_piece_add(pieces, &count, "\r\n", 2);
+		}
 	}
-	else
+	if(custom_headers != NULL)
+		http_request_piece_add(pieces, &count, custom_headers, strlen(custom_headers));
+	http_request_piece_add(pieces, &count, "\r\n", 2);
+
+	for(i = 0; i < count; i++)
+		total += pieces[i].len;
+	if(str_buffer_reserve(buf, total) < 0)
+		return -1;
+	out = buf->data + buf->len;
+	for(i = 0; i < count; i++)
 	{
-		sprintf(http_headers, "%s\r\n%s", http_headers, post_data);
+		if(pieces[i].data != NULL)
+			memcpy(out, pieces[i].data, pieces[i].len);
+		else
+			http_request_encode_userinfo(out, purl->username, username_len, purl->password, password_len);
+		out += pieces[i].len;
 	}
-	http_headers = (char*)realloc(http_headers, strlen(http_headers) + 1);
-
-	/* Make request and return response */
-	struct http_response *hresp = http_req(http_headers, purl);
+	buf->len += total;
+	buf->data[buf->len] = '\0';
+	return 0;
+}
 
-	/* Handle redirect */
-	return handle_redirect_post(hresp, custom_headers, post_data);
+/*
+	Serializes a request with its body into buf, the head as http_build_request_head
+	does and the body after it. Returns 0 on success and -1 when out of memory.
+*/
+int http_build_request(struct str_buffer *buf, const char *method, struct parsed_url *purl, const char *custom_headers, const char *content_type, const char *body, size_t body_len)
+{
+	if(http_build_request_head(buf, method, purl, custom_headers, content_type, body != NULL ? (long)body_len : -1) < 0)
+		return -1;
+	if(body != NULL && str_buffer_append(buf, body, body_len) < 0)
+		return -1;
+	return 0;
 }
 
 /*
-	Makes a HTTP HEAD request to the given url
+	Serializes the head of a request like http_build_request_head into a new
+	string, in the arena of purl when it has one. The caller frees it otherwise.
+	Returns NULL when out of memory.
 */
-struct http_response* http_head(char *url, char *custom_headers)
+char* http_build(const char *method, struct parsed_url *purl, const char *custom_headers, const char *content_type, long content_length)
 {
-	/* Parse url */
-	struct parsed_url *purl = parse_url(url);
-	if(purl == NULL)
+	struct str_buffer buf;
+	str_buffer_init_arena(&buf, purl->arena);
+	if(http_build_request_head(&buf, method, purl, custom_headers, content_type, content_length) < 0)
 	{
-		printf("Unable to parse url");
+		str_buffer_free(&buf);
 		return NULL;
 	}
+	return buf.data;
+}
 
-	/* Declare variable */
-	char *http_headers = (char*)malloc(1024);
+/*
+	Builds the headers of a HTTP GET request for the parsed url
+*/
+char* http_build_get(struct parsed_url *purl, char *custom_headers)
+{
+	return http_build("GET", purl, custom_headers, NULL, -1);
+}
 
-	/* Build query/headers */
-	if(purl->path != NULL)
-	{
-		if(purl->query != NULL)
-		{
-			sprintf(http_headers, "HEAD /%s?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->query, purl->host);
-		}
-		else
-		{
-			sprintf(http_headers, "HEAD /%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->host);
-		}
-	}
-	else
-	{
-		if(purl->query != NULL)
-		{
-			sprintf(http_headers, "HEAD/?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->query, purl->host);
-		}
-		else
-		{
-			sprintf(http_headers, "HEAD / HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->host);
-		}
-	}
+/*
+	Makes a HTTP GET request to the given url. With callbacks the body is passed to
+	them as it arrives instead of being collected in the response. The response is
+	allocated in arena, or in an arena of its own when arena is NULL.
+*/
+struct http_response* http_get_ex(char *url, char *custom_headers, struct http_callbacks *callbacks, struct http_arena *arena)
+{
+	return http_request_follow("GET", url, custom_headers, NULL, NULL, callbacks, arena);
+}
 
-	/* Handle authorisation if needed */
-	if(purl->username != NULL)
-	{
-		/* Format username:password pair */
-		char *upwd = (char*)malloc(1024);
-		sprintf(upwd, "%s:%s", purl->username, purl->password);
-		upwd = (char*)realloc(upwd, strlen(upwd) + 1);
-
-		/* Base64 encode */
-		char *base64 = base64_encode(upwd);
-
-		/* Form header */
-		char *auth_header = (char*)malloc(1024);
-		sprintf(auth_header, "Authorization: Basic %s\r\n", base64);
-		auth_header = (char*)realloc(auth_header, strlen(auth_header) + 1);
-
-		/* Add to header */
-		http_headers = (char*)realloc(http_headers, strlen(http_headers) + strlen(auth_header) + 2);
-		sprintf(http_headers, "%s%s", http_headers, auth_header);
-	}
+/*
+	Makes a HTTP GET request to the given url, the body is passed to the callbacks
+	as it arrives instead of being collected in the response.
+*/
+struct http_response* http_get_stream(char *url, char *custom_headers, struct http_callbacks *callbacks)
+{
+	return http_get_ex(url, custom_headers, callbacks, NULL);
+}
 
-	if(custom_headers != NULL)
-	{
-		sprintf(http_headers, "%s%s\r\n", http_headers, custom_headers);
-	}
-	else
-	{
-		sprintf(http_headers, "%s\r\n", http_headers);
-	}
-	http_headers = (char*)realloc(http_headers, strlen(http_headers) + 1);
+/*
+	Makes a HTTP GET request to the given url with the response in arena, made
+	with http_arena_new. Freeing the response resets the arena, so that a loop of
+	requests reuses the same memory. Only one response can live in an arena.
+*/
+struct http_response* http_get_arena(char *url, char *custom_headers, struct http_arena *arena)
+{
+	return http_get_ex(url, custom_headers, NULL, arena);
+}
+
+/*
+	Makes a HTTP GET request to the given url
+*/
+struct http_response* http_get(char *url, char *custom_headers)
+{
+	return http_get_stream(url, custom_headers, NULL);
+}
 
-	/* Make request and return response */
-	struct http_response *hresp = http_req(http_headers, purl);
+/*
+	Makes a HTTP POST request to the given url
+*/
+struct http_response* http_post(char *url, char *custom_headers, char *post_data)
+{
+	/* The body is sent from post_data itself */
+	struct http_upload upload;
+	struct iovec body;
+	body.iov_base = post_data;
+	body.iov_len = strlen(post_data);
+	memset(&upload, 0, sizeof(upload));
+	upload.segments = &body;
+	upload.count = 1;
+	upload.fd = -1;
+	return http_request_follow("POST", url, custom_headers, "application/x-www-form-urlencoded", &upload, NULL, NULL);
+}
 
-	/* Handle redirect */
-	return handle_redirect_head(hresp, custom_headers);
+/*
+	Makes a HTTP HEAD request to the given url
+*/
+struct http_response* http_head(char *url, char *custom_headers)
+{
+	return http_request_follow("HEAD", url, custom_headers, NULL, NULL, NULL, NULL);
 }
 
 /*
@@ -722,86 +1105,59 @@ struct http_response* http_head(char *url, char *custom_headers)
 */
 struct http_response* http_options(char *url)
 {
-	/* Parse url */
-	struct parsed_url *purl = parse_url(url);
-	if(purl == NULL)
-	{
-		printf("Unable to parse url");
-		return NULL;
-	}
-
-	/* Declare variable */
-	char *http_headers = (char*)malloc(1024);
+	return http_request_follow("OPTIONS", url, NULL, NULL, NULL, NULL, NULL);
+}
 
-	/* Build query/headers */
-	if(purl->path != NULL)
-	{
-		if(purl->query != NULL)
-		{
-			sprintf(http_headers, "OPTIONS /%s?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->query, purl->host);
-		}
-		else
-		{
-			sprintf(http_headers, "OPTIONS /%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->path, purl->host);
-		}
-	}
-	else
+/*
+	Free memory of http_response
+*/
+void http_response_free(struct http_response *hresp)
+{
+	if(hresp != NULL)
 	{
-		if(purl->query != NULL)
+		/* The request url lives in an arena when the response does, and may do so on its own */
+		struct http_arena *arena = hresp->request_uri != NULL ? hresp->request_uri->arena : hresp->arena;
+		if(hresp->request_headers != NULL && !http_arena_owns(arena, hresp->request_headers)) free(hresp->request_headers);
+		if(hresp->request_uri != NULL && arena == NULL) parsed_url_free(hresp->request_uri);
+		if(hresp->redirects != NULL && !http_arena_owns(arena, hresp->redirects)) free(hresp->redirects);
+		if(hresp->mapping != NULL)
 		{
-			sprintf(http_headers, "OPTIONS/?%s HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->query, purl->host);
+			/* Served from the disk cache, the strings live in the mapping */
+			munmap(hresp->mapping, hresp->mapping_len);
 		}
-		else
+		if(hresp->arena == NULL)
 		{
-			sprintf(http_headers, "OPTIONS / HTTP/1.1\r\nHost:%s\r\nConnection:close\r\n", purl->host);
+			if(hresp->mapping == NULL)
+			{
+				if(hresp->body != NULL) free(hresp->body);
+				if(hresp->status_code != NULL) free(hresp->status_code);
+				if(hresp->status_text != NULL) free(hresp->status_text);
+				if(hresp->response_headers != NULL) free(hresp->response_headers);
+			}
+			http_header_table_free(&hresp->headers);
+			free(hresp);
 		}
+		http_arena_release(arena);
 	}
-
-	/* Handle authorisation if needed */
-	if(purl->username != NULL)
-	{
-		/* Format username:password pair */
-		char *upwd = (char*)malloc(1024);
-		sprintf(upwd, "%s:%s", purl->username, purl->password);
-		upwd = (char*)realloc(upwd, strlen(upwd) + 1);
-
-		/* Base64 encode */
-		char *base64 = base64_encode(upwd);
-
-		/* Form header */
-		char *auth_header = (char*)malloc(1024);
-		sprintf(auth_header, "Authorization: Basic %s\r\n", base64);
-		auth_header = (char*)realloc(auth_header, strlen(auth_header) + 1);
-
-		/* Add to header */
-		http_headers = (char*)realloc(http_headers, strlen(http_headers) + strlen(auth_header) + 2);
-		sprintf(http_headers, "%s%s", http_headers, auth_header);
-	}
-
-	/* Build headers */
-	sprintf(http_headers, "%s\r\n", http_headers);
-	http_headers = (char*)realloc(http_headers, strlen(http_headers) + 1);
-
-	/* Make request and return response */
-	struct http_response *hresp = http_req(http_headers, purl);
-
-	/* Handle redirect */
-	return hresp;
 }
 
 /*
-	Free memory of http_response
+	Frees a response that another response of the same request replaces. The
+	memory of a response in an arena is left to the arena, which the other
+	response still uses.
 */
-void http_response_free(struct http_response *hresp)
+void http_response_discard(struct http_response *hresp)
 {
-	if(hresp != NULL)
+	if(hresp != NULL && hresp->arena != NULL)
 	{
-		if(hresp->request_uri != NULL) parsed_url_free(hresp->request_uri);
-		if(hresp->body != NULL) free(hresp->body);
-		if(hresp->status_code != NULL) free(hresp->status_code);
-		if(hresp->status_text != NULL) free(hresp->status_text);
-		if(hresp->request_headers != NULL) free(hresp->request_headers);
-		if(hresp->response_headers != NULL) free(hresp->response_headers);
-		free(hresp);
+		if(hresp->mapping != NULL)
+			munmap(hresp->mapping, hresp->mapping_len);
+		return;
 	}
+	http_response_free(hresp);
 }
+
+#include "httpengine.h"
+#include "httpretry.h"
+#include "httpcache.h"
+#include "httpdiskcache.h"
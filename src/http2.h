@@ -0,0 +1,1471 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+
+/*
+	HTTP/2 (RFC 7540) transport. Requests are built as HTTP/1.1 heads like for any
+	other connection and translated into HEADERS frames, the responses of streams
+	are translated back into HTTP/1.1 for their response parsers, so the rest of the
+	library does not have to know which protocol a connection speaks.
+*/
+
+/*
+	Speak HTTP/2 to http:// urls right away, without asking the server first (h2c
+	with prior knowledge). Only for servers that are known to support it.
+*/
+int http2_prior_knowledge = 0;
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_WINDOW (1 << 24)		/* receive window of the connection and of every stream */
+#define HTTP2_MAX_FRAME 16384		/* largest frame payload accepted */
+#define HTTP2_MAX_STREAMS 100		/* streams in flight when the server sets no limit */
+
+#define HTTP2_FLAG_END_STREAM 0x1
+#define HTTP2_FLAG_ACK 0x1
+#define HTTP2_FLAG_END_HEADERS 0x4
+#define HTTP2_FLAG_PADDED 0x8
+#define HTTP2_FLAG_PRIORITY 0x20
+
+/*
+	Frame types
+*/
+enum http2_frame_type
+{
+	HTTP2_DATA = 0,
+	HTTP2_HEADERS,
+	HTTP2_PRIORITY,
+	HTTP2_RST_STREAM,
+	HTTP2_SETTINGS,
+	HTTP2_PUSH_PROMISE,
+	HTTP2_PING,
+	HTTP2_GOAWAY,
+	HTTP2_WINDOW_UPDATE,
+	HTTP2_CONTINUATION
+};
+
+/*
+	Entry of the HPACK static table (RFC 7541, appendix A)
+*/
+struct http2_static_entry
+{
+	const char *name;
+	const char *value;
+};
+
+const struct http2_static_entry http2_static_table[61] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+/*
+	HPACK Huffman code (RFC 7541, appendix B). The code is canonical, so it is
+	described by the number of codes of every length and the symbols in code order.
+*/
+const unsigned char http2_huffman_counts[31] =
+{
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+const unsigned short http2_huffman_symbols[257] =
+{
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+	52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+	110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+	119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+	43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+	179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+	163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+	158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+	144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+	212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+	2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+	256
+};
+
+/*
+	Entry of the HPACK dynamic table, name and value share one allocation
+*/
+struct http2_hpack_entry
+{
+	char *name;
+	size_t name_len;
+	char *value;
+	size_t value_len;
+};
+
+/*
+	HPACK dynamic table of a decoder, a ring buffer with the newest entry first
+*/
+struct http2_hpack
+{
+	struct http2_hpack_entry *entries;
+	int count;
+	int cap;
+	int first;						/* position of the newest entry */
+	size_t size;					/* size as defined by RFC 7541, section 4.1 */
+	size_t max_size;
+};
+
+/*
+	A request sent on a HTTP/2 connection
+*/
+struct http2_stream
+{
+	struct http2_session *session;
+	unsigned int id;
+	long send_window;
+	long recv_unacked;				/* received bytes not yet given back with WINDOW_UPDATE */
+	struct http_upload body;		/* what is left of the request body */
+	struct iovec inline_body;		/* body that follows the head in the request string */
+	int body_index;					/* current segment of body */
+	size_t body_offset;				/* bytes of the current segment already sent */
+	size_t body_left;
+	struct http_parser *parser;		/* receives the response as HTTP/1.1 */
+	int final;						/* the final (non 1xx) response headers arrived */
+	int chunked;					/* the body is passed to the parser as chunks */
+	int closed;						/* the server ended the stream */
+	int reset;						/* the stream was reset or refused */
+	int refused;					/* the server did not process the request, it can be sent again */
+	struct http2_stream *next;
+};
+
+/*
+	A HTTP/2 connection
+*/
+struct http2_session
+{
+	int tls;
+	unsigned int next_stream_id;
+	int streams;					/* streams in flight */
+	long send_window;
+	long recv_unacked;
+	long peer_initial_window;
+	unsigned int peer_max_frame;
+	unsigned int peer_max_streams;
+	int goaway;						/* no new streams may be started */
+	int dead;						/* a connection error happened */
+	struct http2_hpack decoder;
+	struct str_buffer in;			/* received bytes of incomplete frames */
+	struct str_buffer out;			/* frames to send */
+	struct str_buffer block;		/* header block being received */
+	unsigned int block_stream;		/* stream of the header block, 0 when there is none */
+	int block_end_stream;
+	struct str_buffer text;			/* HTTP/1.1 translation of a header block */
+	struct str_buffer scratch;
+	struct http2_stream *stream_list;
+};
+
+/*
+	Initializes a HPACK dynamic table
+*/
+void http2_hpack_init(struct http2_hpack *hpack, size_t max_size)
+{
+	memset(hpack, 0, sizeof(struct http2_hpack));
+	hpack->max_size = max_size;
+}
+
+/*
+	Evicts the oldest entries until the table is at most limit in size
+*/
+void http2_hpack_evict(struct http2_hpack *hpack, size_t limit)
+{
+	while(hpack->count > 0 && hpack->size > limit)
+	{
+		struct http2_hpack_entry *entry = &hpack->entries[(hpack->first + hpack->count - 1) % hpack->cap];
+		hpack->size -= 32 + entry->name_len + entry->value_len;
+		free(entry->name);
+		hpack->count--;
+	}
+}
+
+/*
+	Frees the memory of a HPACK dynamic table
+*/
+void http2_hpack_free(struct http2_hpack *hpack)
+{
+	http2_hpack_evict(hpack, 0);
+	free(hpack->entries);
+	hpack->entries = NULL;
+	hpack->cap = 0;
+}
+
+/*
+	Adds an entry to the dynamic table, returns 0 on success and -1 when out of memory
+*/
+int http2_hpack_add(struct http2_hpack *hpack, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+	size_t size = 32 + name_len + value_len;
+	struct http2_hpack_entry *entry;
+
+	/* An entry larger than the table empties it */
+	if(size > hpack->max_size)
+	{
+		http2_hpack_evict(hpack, 0);
+		return 0;
+	}
+	http2_hpack_evict(hpack, hpack->max_size - size);
+	if(hpack->count == hpack->cap)
+	{
+		int cap = hpack->cap ? hpack->cap * 2 : 16;
+		struct http2_hpack_entry *entries = (struct http2_hpack_entry*)malloc(cap * sizeof(struct http2_hpack_entry));
+		int i;
+		if(entries == NULL)
+			return -1;
+		for(i = 0; i < hpack->count; i++)
+			entries[i] = hpack->entries[(hpack->first + i) % hpack->cap];
+		free(hpack->entries);
+		hpack->entries = entries;
+		hpack->cap = cap;
+		hpack->first = 0;
+	}
+	hpack->first = (hpack->first + hpack->cap - 1) % hpack->cap;
+	entry = &hpack->entries[hpack->first];
+	entry->name = (char*)malloc(name_len + value_len + 2);
+	if(entry->name == NULL)
+	{
+		hpack->first = (hpack->first + 1) % hpack->cap;
+		return -1;
+	}
+	memcpy(entry->name, name, name_len);
+	entry->name[name_len] = '\0';
+	entry->name_len = name_len;
+	entry->value = entry->name + name_len + 1;
+	memcpy(entry->value, value, value_len);
+	entry->value[value_len] = '\0';
+	entry->value_len = value_len;
+	hpack->count++;
+	hpack->size += size;
+	return 0;
+}
+
+/*
+	Looks up an index of the static and dynamic tables, returns -1 when it is not valid
+*/
+int http2_hpack_get(struct http2_hpack *hpack, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+	if(index == 0)
+		return -1;
+	if(index <= 61)
+	{
+		*name = http2_static_table[index - 1].name;
+		*name_len = strlen(*name);
+		*value = http2_static_table[index - 1].value;
+		*value_len = strlen(*value);
+		return 0;
+	}
+	index -= 62;
+	if(index >= (size_t)hpack->count)
+		return -1;
+	{
+		struct http2_hpack_entry *entry = &hpack->entries[(hpack->first + index) % hpack->cap];
+		*name = entry->name;
+		*name_len = entry->name_len;
+		*value = entry->value;
+		*value_len = entry->value_len;
+	}
+	return 0;
+}
+
+/*
+	Decodes an integer with a prefix of prefix_bits bits (RFC 7541, section 5.1),
+	returns 0 on success and -1 when it is truncated or too large
+*/
+int http2_hpack_integer(const unsigned char **pos, const unsigned char *end, int prefix_bits, size_t *value)
+{
+	size_t max = (1 << prefix_bits) - 1;
+	int shift = 0;
+	if(*pos >= end)
+		return -1;
+	*value = **pos & max;
+	(*pos)++;
+	if(*value < max)
+		return 0;
+	for(;;)
+	{
+		unsigned char byte;
+		if(*pos >= end || shift > 28)
+			return -1;
+		byte = **pos;
+		(*pos)++;
+		*value += (size_t)(byte & 0x7f) << shift;
+		shift += 7;
+		if((byte & 0x80) == 0)
+			return 0;
+	}
+}
+
+/*
+	Appends an integer with a prefix of prefix_bits bits, the high bits of the
+	first byte are set to flags
+*/
+int http2_hpack_put_integer(struct str_buffer *out, unsigned char flags, int prefix_bits, size_t value)
+{
+	unsigned char bytes[16];
+	size_t max = (1 << prefix_bits) - 1;
+	int n = 0;
+	if(value < max)
+	{
+		bytes[n++] = flags | (unsigned char)value;
+	}
+	else
+	{
+		bytes[n++] = flags | (unsigned char)max;
+		value -= max;
+		while(value >= 128)
+		{
+			bytes[n++] = (unsigned char)(0x80 | (value & 0x7f));
+			value >>= 7;
+		}
+		bytes[n++] = (unsigned char)value;
+	}
+	return str_buffer_append(out, (const char*)bytes, n);
+}
+
+/*
+	Decodes Huffman coded data and appends it to out, returns 0 on success and -1
+	when the data is not valid
+*/
+int http2_huffman_decode(const unsigned char *data, size_t len, struct str_buffer *out)
+{
+	int code = 0, first = 0, index = 0, bits = 0;
+	int ones = 1;					/* the pending bits are all ones */
+	size_t i;
+	int bit;
+	for(i = 0; i < len; i++)
+	{
+		for(bit = 7; bit >= 0; bit--)
+		{
+			int value = (data[i] >> bit) & 1;
+			int count;
+			code |= value;
+			ones &= value;
+			bits++;
+			if(bits > 30)
+				return -1;
+			count = http2_huffman_counts[bits];
+			if(code - count < first)
+			{
+				int symbol = http2_huffman_symbols[index + (code - first)];
+				char c = (char)symbol;
+				if(symbol == 256 || str_buffer_append(out, &c, 1) < 0)
+					return -1;
+				code = first = index = bits = 0;
+				ones = 1;
+				continue;
+			}
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+	}
+
+	/* At most 7 bits of padding, the start of the end of string code */
+	return (bits <= 7 && ones) ? 0 : -1;
+}
+
+/*
+	Decodes a string literal and appends it to out
+*/
+int http2_hpack_string(const unsigned char **pos, const unsigned char *end, struct str_buffer *out)
+{
+	int huffman;
+	size_t len;
+	if(*pos >= end)
+		return -1;
+	huffman = **pos & 0x80;
+	if(http2_hpack_integer(pos, end, 7, &len) < 0 || len > (size_t)(end - *pos))
+		return -1;
+	if(huffman)
+	{
+		if(http2_huffman_decode(*pos, len, out) < 0)
+			return -1;
+	}
+	else if(str_buffer_append(out, (const char*)*pos, len) < 0)
+	{
+		return -1;
+	}
+	*pos += len;
+	return 0;
+}
+
+/*
+	Called for every field of a decoded header block, a non-zero return aborts
+*/
+typedef int (*http2_field_callback)(void *user, const char *name, size_t name_len, const char *value, size_t value_len);
+
+/*
+	Decodes a header block (RFC 7541, section 6) and passes its fields to emit.
+	Returns 0 on success and -1 when the block is not valid.
+*/
+int http2_hpack_decode(struct http2_hpack *hpack, const unsigned char *data, size_t len, struct str_buffer *scratch, http2_field_callback emit, void *user)
+{
+	const unsigned char *pos = data;
+	const unsigned char *end = data + len;
+	while(pos < end)
+	{
+		const char *name, *value;
+		size_t name_len, value_len, index;
+		int indexing = 0;
+		int prefix;
+
+		if(*pos & 0x80)
+		{
+			/* Indexed field */
+			if(http2_hpack_integer(&pos, end, 7, &index) < 0 || http2_hpack_get(hpack, index, &name, &name_len, &value, &value_len) < 0)
+				return -1;
+			if(emit(user, name, name_len, value, value_len) != 0)
+				return -1;
+			continue;
+		}
+		if((*pos & 0xe0) == 0x20)
+		{
+			/* Dynamic table size update */
+			if(http2_hpack_integer(&pos, end, 5, &index) < 0 || index > 4096)
+				return -1;
+			hpack->max_size = index;
+			http2_hpack_evict(hpack, index);
+			continue;
+		}
+
+		/* Literal field, with incremental indexing, without indexing or never indexed */
+		indexing = (*pos & 0xc0) == 0x40;
+		prefix = indexing ? 6 : 4;
+		scratch->len = 0;
+		if(http2_hpack_integer(&pos, end, prefix, &index) < 0)
+			return -1;
+		if(index > 0)
+		{
+			if(http2_hpack_get(hpack, index, &name, &name_len, &value, &value_len) < 0
+				|| str_buffer_append(scratch, name, name_len) < 0)
+				return -1;
+		}
+		else if(http2_hpack_string(&pos, end, scratch) < 0)
+		{
+			return -1;
+		}
+		name_len = scratch->len;
+		if(http2_hpack_string(&pos, end, scratch) < 0)
+			return -1;
+		value_len = scratch->len - name_len;
+		if(indexing && http2_hpack_add(hpack, scratch->data, name_len, scratch->data + name_len, value_len) < 0)
+			return -1;
+		if(emit(user, scratch->data, name_len, scratch->data + name_len, value_len) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Appends a header field to a header block, as indexed field when the static
+	table has it and as literal without indexing otherwise
+*/
+int http2_hpack_encode(struct str_buffer *out, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+	size_t name_index = 0;
+	size_t i;
+	for(i = 0; i < 61; i++)
+	{
+		const struct http2_static_entry *entry = &http2_static_table[i];
+		if(strlen(entry->name) != name_len || memcmp(entry->name, name, name_len) != 0)
+			continue;
+		if(strlen(entry->value) == value_len && memcmp(entry->value, value, value_len) == 0)
+			return http2_hpack_put_integer(out, 0x80, 7, i + 1);
+		if(name_index == 0)
+			name_index = i + 1;
+	}
+	if(http2_hpack_put_integer(out, 0x00, 4, name_index) < 0)
+		return -1;
+	if(name_index == 0 && (http2_hpack_put_integer(out, 0x00, 7, name_len) < 0 || str_buffer_append(out, name, name_len) < 0))
+		return -1;
+	if(http2_hpack_put_integer(out, 0x00, 7, value_len) < 0 || str_buffer_append(out, value, value_len) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+	Appends a frame header to out
+*/
+int http2_frame_header(struct str_buffer *out, size_t len, int type, int flags, unsigned int stream_id)
+{
+	unsigned char header[9];
+	header[0] = (unsigned char)(len >> 16);
+	header[1] = (unsigned char)(len >> 8);
+	header[2] = (unsigned char)len;
+	header[3] = (unsigned char)type;
+	header[4] = (unsigned char)flags;
+	header[5] = (unsigned char)((stream_id >> 24) & 0x7f);
+	header[6] = (unsigned char)(stream_id >> 16);
+	header[7] = (unsigned char)(stream_id >> 8);
+	header[8] = (unsigned char)stream_id;
+	return str_buffer_append(out, (const char*)header, 9);
+}
+
+/*
+	Appends a frame whose payload is a 32-bit value, like WINDOW_UPDATE and RST_STREAM
+*/
+int http2_frame_u32(struct str_buffer *out, int type, unsigned int stream_id, unsigned int value)
+{
+	unsigned char payload[4];
+	payload[0] = (unsigned char)(value >> 24);
+	payload[1] = (unsigned char)(value >> 16);
+	payload[2] = (unsigned char)(value >> 8);
+	payload[3] = (unsigned char)value;
+	if(http2_frame_header(out, 4, type, 0, stream_id) < 0)
+		return -1;
+	return str_buffer_append(out, (const char*)payload, 4);
+}
+
+/*
+	Reads a 32-bit value in network order
+*/
+unsigned int http2_u32(const unsigned char *data)
+{
+	return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3];
+}
+
+void http2_session_free(struct http2_session *session);
+
+/*
+	Creates the session of a new connection, the connection preface and the
+	settings are queued in session->out. Returns NULL when out of memory.
+*/
+struct http2_session* http2_session_new(int tls)
+{
+	static const unsigned char settings[] =
+	{
+		0x00, 0x02, 0x00, 0x00, 0x00, 0x00,		/* ENABLE_PUSH 0 */
+		0x00, 0x04, (HTTP2_WINDOW >> 24) & 0xff, (HTTP2_WINDOW >> 16) & 0xff, (HTTP2_WINDOW >> 8) & 0xff, HTTP2_WINDOW & 0xff	/* INITIAL_WINDOW_SIZE */
+	};
+	struct http2_session *session = (struct http2_session*)malloc(sizeof(struct http2_session));
+	if(session == NULL)
+		return NULL;
+	memset(session, 0, sizeof(struct http2_session));
+	session->tls = tls;
+	session->next_stream_id = 1;
+	session->send_window = 65535;
+	session->peer_initial_window = 65535;
+	session->peer_max_frame = 16384;
+	session->peer_max_streams = HTTP2_MAX_STREAMS;
+	http2_hpack_init(&session->decoder, 4096);
+	str_buffer_init(&session->in);
+	str_buffer_init(&session->out);
+	str_buffer_init(&session->block);
+	str_buffer_init(&session->text);
+	str_buffer_init(&session->scratch);
+	if(str_buffer_append(&session->out, HTTP2_PREFACE, strlen(HTTP2_PREFACE)) < 0
+		|| http2_frame_header(&session->out, sizeof(settings), HTTP2_SETTINGS, 0, 0) < 0
+		|| str_buffer_append(&session->out, (const char*)settings, sizeof(settings)) < 0
+		|| http2_frame_u32(&session->out, HTTP2_WINDOW_UPDATE, 0, HTTP2_WINDOW - 65535) < 0)
+	{
+		http2_session_free(session);
+		return NULL;
+	}
+	return session;
+}
+
+/*
+	Frees a session and the streams still in it
+*/
+void http2_session_free(struct http2_session *session)
+{
+	if(session == NULL)
+		return;
+	while(session->stream_list != NULL)
+	{
+		struct http2_stream *stream = session->stream_list;
+		session->stream_list = stream->next;
+		free(stream);
+	}
+	http2_hpack_free(&session->decoder);
+	str_buffer_free(&session->in);
+	str_buffer_free(&session->out);
+	str_buffer_free(&session->block);
+	str_buffer_free(&session->text);
+	str_buffer_free(&session->scratch);
+	free(session);
+}
+
+/*
+	Returns whether a new stream can be started on the session
+*/
+int http2_session_available(struct http2_session *session)
+{
+	return !session->dead && !session->goaway && session->streams < (int)session->peer_max_streams
+		&& session->next_stream_id < 0x7fffffff;
+}
+
+/*
+	Finds a stream in flight by id
+*/
+struct http2_stream* http2_session_stream(struct http2_session *session, unsigned int id)
+{
+	struct http2_stream *stream;
+	for(stream = session->stream_list; stream != NULL; stream = stream->next)
+	{
+		if(stream->id == id)
+			return stream;
+	}
+	return NULL;
+}
+
+/*
+	Marks a stream as ended without a complete response, a refused stream was
+	not processed by the server and may be sent again
+*/
+void http2_stream_abort(struct http2_stream *stream, int refused)
+{
+	stream->closed = 1;
+	stream->reset = 1;
+	stream->refused = refused;
+	stream->body_left = 0;
+}
+
+/*
+	Writes DATA frames of the request bodies as far as the flow control windows
+	allow. A stream whose file can not be read is reset. Returns 0 on success and
+	-1 when out of memory.
+*/
+int http2_session_pump(struct http2_session *session)
+{
+	struct http2_stream *stream;
+	for(stream = session->stream_list; stream != NULL; stream = stream->next)
+	{
+		while(stream->body_left > 0 && !stream->reset)
+		{
+			size_t room = stream->body_left;
+			size_t header_at;
+			if((long)room > session->send_window)
+				room = session->send_window;
+			if((long)room > stream->send_window)
+				room = stream->send_window;
+			if(room > session->peer_max_frame)
+				room = session->peer_max_frame;
+			if(session->send_window <= 0 || stream->send_window <= 0 || room == 0)
+				break;
+
+			while(stream->body.fd < 0 && stream->body.segments[stream->body_index].iov_len == 0)
+				stream->body_index++;
+			header_at = session->out.len;
+			if(http2_frame_header(&session->out, 0, HTTP2_DATA, 0, stream->id) < 0)
+				return -1;
+			if(stream->body.fd >= 0)
+			{
+				ssize_t n;
+				if(str_buffer_reserve(&session->out, room) < 0)
+					return -1;
+				do
+				{
+					n = pread(stream->body.fd, session->out.data + session->out.len, room, stream->body.offset);
+				} while(n < 0 && errno == EINTR);
+				if(n <= 0)
+				{
+					/* The file can not be read, only this stream is given up */
+					session->out.len = header_at;
+					http2_stream_abort(stream, 0);
+					if(http2_frame_u32(&session->out, HTTP2_RST_STREAM, stream->id, 0x8) < 0)	/* CANCEL */
+						return -1;
+					break;
+				}
+				room = n;
+				stream->body.offset += n;
+				session->out.len += n;
+			}
+			else
+			{
+				const struct iovec *segment = &stream->body.segments[stream->body_index];
+				if(room > segment->iov_len - stream->body_offset)
+					room = segment->iov_len - stream->body_offset;
+				if(str_buffer_append(&session->out, (const char*)segment->iov_base + stream->body_offset, room) < 0)
+					return -1;
+				stream->body_offset += room;
+				while(stream->body_index < stream->body.count && stream->body_offset == stream->body.segments[stream->body_index].iov_len)
+				{
+					stream->body_index++;
+					stream->body_offset = 0;
+				}
+			}
+
+			/* Fill in the length and flags of the frame */
+			stream->body_left -= room;
+			session->out.data[header_at] = (char)(room >> 16);
+			session->out.data[header_at + 1] = (char)(room >> 8);
+			session->out.data[header_at + 2] = (char)room;
+			if(stream->body_left == 0)
+				session->out.data[header_at + 4] = HTTP2_FLAG_END_STREAM;
+			session->send_window -= room;
+			stream->send_window -= room;
+		}
+	}
+	return 0;
+}
+
+/*
+	Returns whether a header line of a request is specific to HTTP/1.1 and has no
+	place in a HTTP/2 request
+*/
+int http2_connection_specific(const char *name, size_t len)
+{
+	static const char *names[] = { "host", "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade" };
+	size_t i;
+	for(i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		if(strlen(names[i]) == len && memcmp(names[i], name, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Translates a HTTP/1.1 request head into a HPACK header block in out. Returns 0
+	on success and -1 when the head is not valid.
+*/
+int http2_encode_request(struct http2_session *session, const char *http_headers, struct str_buffer *out)
+{
+	const char *line = http_headers;
+	const char *method_end = strchr(line, ' ');
+	const char *target, *target_end, *host = NULL, *end;
+	size_t host_len = 0;
+
+	if(method_end == NULL)
+		return -1;
+	target = method_end + 1;
+	target_end = strchr(target, ' ');
+	end = strstr(http_headers, "\r\n");
+	if(target_end == NULL || end == NULL || target_end > end)
+		return -1;
+
+	/* The authority comes from the Host header */
+	for(line = end + 2; *line != '\0' && strncmp(line, "\r\n", 2) != 0; line = end + 2)
+	{
+		end = strstr(line, "\r\n");
+		if(end == NULL)
+			return -1;
+		if(strncasecmp(line, "host:", 5) == 0)
+		{
+			host = line + 5;
+			while(*host == ' ' || *host == '\t')
+				host++;
+			host_len = end - host;
+		}
+	}
+	if(http2_hpack_encode(out, ":method", 7, http_headers, method_end - http_headers) < 0
+		|| http2_hpack_encode(out, ":scheme", 7, session->tls ? "https" : "http", session->tls ? 5 : 4) < 0
+		|| (host != NULL && http2_hpack_encode(out, ":authority", 10, host, host_len) < 0)
+		|| http2_hpack_encode(out, ":path", 5, target, target_end - target) < 0)
+		return -1;
+
+	/* Header names are lower case in HTTP/2 */
+	end = strstr(http_headers, "\r\n");
+	for(line = end + 2; *line != '\0' && strncmp(line, "\r\n", 2) != 0; line = end + 2)
+	{
+		const char *colon, *value;
+		size_t i;
+		end = strstr(line, "\r\n");
+		colon = (const char*)memchr(line, ':', end - line);
+		if(colon == NULL)
+			return -1;
+		session->scratch.len = 0;
+		if(str_buffer_append(&session->scratch, line, colon - line) < 0)
+			return -1;
+		for(i = 0; i < session->scratch.len; i++)
+			session->scratch.data[i] = tolower((unsigned char)session->scratch.data[i]);
+		if(http2_connection_specific(session->scratch.data, session->scratch.len))
+			continue;
+		value = colon + 1;
+		while(value < end && (*value == ' ' || *value == '\t'))
+			value++;
+		if(session->scratch.len == 2 && memcmp(session->scratch.data, "te", 2) == 0 && (end - value != 8 || strncasecmp(value, "trailers", 8) != 0))
+			continue;
+		if(http2_hpack_encode(out, session->scratch.data, session->scratch.len, value, end - value) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Starts a stream for a request. http_headers is the HTTP/1.1 head of the
+	request, body (which may be NULL) its body, the response is passed to parser
+	as HTTP/1.1. The frames are queued in session->out. Returns NULL when the head
+	is not valid or out of memory.
+*/
+struct http2_stream* http2_session_submit(struct http2_session *session, const char *http_headers, const struct http_upload *body, struct http_parser *parser)
+{
+	struct http2_stream *stream;
+	struct str_buffer block;
+	size_t sent = 0;
+	int i;
+
+	stream = (struct http2_stream*)malloc(sizeof(struct http2_stream));
+	if(stream == NULL)
+		return NULL;
+	memset(stream, 0, sizeof(struct http2_stream));
+	stream->session = session;
+	stream->parser = parser;
+	stream->send_window = session->peer_initial_window;
+	stream->body.fd = -1;
+	if(body == NULL || (body->fd < 0 && body->count == 0))
+	{
+		/* A request string may carry its body after the head */
+		const char *end = strstr(http_headers, "\r\n\r\n");
+		if(end != NULL && end[4] != '\0')
+		{
+			stream->inline_body.iov_base = (void*)(end + 4);
+			stream->inline_body.iov_len = strlen(end + 4);
+			stream->body.segments = &stream->inline_body;
+			stream->body.count = 1;
+			stream->body_left = stream->inline_body.iov_len;
+		}
+	}
+	else
+	{
+		stream->body = *body;
+		if(body->fd >= 0)
+			stream->body_left = body->len;
+		for(i = 0; body->fd < 0 && i < body->count; i++)
+			stream->body_left += body->segments[i].iov_len;
+	}
+
+	str_buffer_init(&block);
+	if(http2_encode_request(session, http_headers, &block) < 0)
+	{
+		str_buffer_free(&block);
+		free(stream);
+		return NULL;
+	}
+	stream->id = session->next_stream_id;
+	session->next_stream_id += 2;
+
+	/* HEADERS and CONTINUATION frames of at most peer_max_frame bytes */
+	do
+	{
+		size_t len = block.len - sent;
+		int flags = 0;
+		if(len > session->peer_max_frame)
+			len = session->peer_max_frame;
+		if(sent + len == block.len)
+			flags |= HTTP2_FLAG_END_HEADERS;
+		if(sent == 0 && stream->body_left == 0)
+			flags |= HTTP2_FLAG_END_STREAM;
+		if(http2_frame_header(&session->out, len, sent == 0 ? HTTP2_HEADERS : HTTP2_CONTINUATION, flags, stream->id) < 0
+			|| str_buffer_append(&session->out, block.data + sent, len) < 0)
+		{
+			str_buffer_free(&block);
+			free(stream);
+			session->dead = 1;
+			return NULL;
+		}
+		sent += len;
+	} while(sent < block.len);
+	str_buffer_free(&block);
+
+	stream->next = session->stream_list;
+	session->stream_list = stream;
+	session->streams++;
+	if(http2_session_pump(session) < 0)
+		session->dead = 1;
+	return stream;
+}
+
+/*
+	Removes a stream from its session once the response has been handled. A stream
+	the server did not end yet is cancelled.
+*/
+void http2_stream_close(struct http2_stream *stream)
+{
+	struct http2_session *session = stream->session;
+	struct http2_stream **link;
+	if(!stream->closed && !session->dead)
+		http2_frame_u32(&session->out, HTTP2_RST_STREAM, stream->id, 0x8);	/* CANCEL */
+	for(link = &session->stream_list; *link != NULL; link = &(*link)->next)
+	{
+		if(*link == stream)
+		{
+			*link = stream->next;
+			break;
+		}
+	}
+	session->streams--;
+	free(stream);
+}
+
+/*
+	Passes the HTTP/1.1 translation of a response to the parser of a stream
+*/
+void http2_stream_deliver(struct http2_stream *stream, const char *data, size_t len)
+{
+	struct http_parser *parser = stream->parser;
+	if(parser == NULL || len == 0 || parser->state == HTTP_PARSER_DONE || parser->state == HTTP_PARSER_ERROR)
+		return;
+	http_parser_execute(parser, data, len);
+}
+
+/*
+	State of the translation of a header block into HTTP/1.1
+*/
+struct http2_translation
+{
+	struct str_buffer *text;
+	int trailers;
+	int status;
+	int has_length;
+};
+
+/*
+	Adds a decoded field to the HTTP/1.1 translation of a header block
+*/
+int http2_translate_field(void *user, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+	struct http2_translation *translation = (struct http2_translation*)user;
+	struct str_buffer *text = translation->text;
+	if(name_len > 0 && name[0] == ':')
+	{
+		if(translation->trailers || name_len != 7 || memcmp(name, ":status", 7) != 0)
+			return 0;
+		if(value_len != 3 || !isdigit((unsigned char)value[0]) || !isdigit((unsigned char)value[1]) || !isdigit((unsigned char)value[2]) || translation->status != 0)
+			return -1;
+		translation->status = atoi(value);
+		return str_buffer_append(text, "HTTP/1.1 ", 9) < 0 || str_buffer_append(text, value, 3) < 0
+			|| str_buffer_append(text, "\r\n", 2) < 0 ? -1 : 0;
+	}
+	if(!translation->trailers && translation->status == 0)
+		return -1;
+	if(http2_connection_specific(name, name_len))
+		return 0;
+	if(name_len == 14 && memcmp(name, "content-length", 14) == 0)
+		translation->has_length = 1;
+	if(str_buffer_append(text, name, name_len) < 0 || str_buffer_append(text, ": ", 2) < 0
+		|| str_buffer_append(text, value, value_len) < 0 || str_buffer_append(text, "\r\n", 2) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+	Handles a complete header block of a stream. Returns -1 on a connection error.
+*/
+int http2_session_headers(struct http2_session *session, unsigned int stream_id, const char *block, size_t len, int end_stream)
+{
+	struct http2_stream *stream = http2_session_stream(session, stream_id);
+	struct http2_translation translation;
+
+	translation.text = &session->text;
+	translation.trailers = stream != NULL && stream->final;
+	translation.status = 0;
+	translation.has_length = 0;
+	session->text.len = 0;
+	if(translation.trailers && str_buffer_append(&session->text, "0\r\n", 3) < 0)
+		return -1;
+
+	/* The block is decoded even without a stream, it changes the dynamic table */
+	if(http2_hpack_decode(&session->decoder, (const unsigned char*)block, len, &session->scratch, http2_translate_field, &translation) < 0)
+		return -1;
+	if(stream == NULL || stream->closed)
+		return 0;
+
+	if(translation.trailers)
+	{
+		if(!end_stream)
+			return -1;
+		stream->closed = 1;
+		if(!stream->chunked)
+			return 0;		/* a body with Content-Length has no place for trailers */
+	}
+	else if(translation.status >= 100 && translation.status < 200)
+	{
+		/* Interim response, the final one follows */
+		if(end_stream)
+			return -1;
+	}
+	else
+	{
+		stream->final = 1;
+		if(end_stream)
+		{
+			if(!translation.has_length && str_buffer_append(&session->text, "content-length: 0\r\n", 19) < 0)
+				return -1;
+		}
+		else if(!translation.has_length)
+		{
+			/* DATA frames are passed on as chunks, the end of the stream ends the body */
+			if(str_buffer_append(&session->text, "transfer-encoding: chunked\r\n", 28) < 0)
+				return -1;
+			stream->chunked = 1;
+		}
+	}
+	if(str_buffer_append(&session->text, "\r\n", 2) < 0)
+		return -1;
+	http2_stream_deliver(stream, session->text.data, session->text.len);
+	if(end_stream)
+		stream->closed = 1;
+	return 0;
+}
+
+/*
+	Gives received bytes back to the flow control windows once half of a window
+	is used up
+*/
+int http2_session_ack(struct http2_session *session, struct http2_stream *stream, size_t len)
+{
+	session->recv_unacked += len;
+	if(session->recv_unacked >= HTTP2_WINDOW / 2)
+	{
+		if(http2_frame_u32(&session->out, HTTP2_WINDOW_UPDATE, 0, session->recv_unacked) < 0)
+			return -1;
+		session->recv_unacked = 0;
+	}
+	if(stream == NULL || stream->closed)
+		return 0;
+	stream->recv_unacked += len;
+	if(stream->recv_unacked >= HTTP2_WINDOW / 2)
+	{
+		if(http2_frame_u32(&session->out, HTTP2_WINDOW_UPDATE, stream->id, stream->recv_unacked) < 0)
+			return -1;
+		stream->recv_unacked = 0;
+	}
+	return 0;
+}
+
+/*
+	Handles a DATA frame, the payload is passed to the parser of the stream as a
+	chunk of the body
+*/
+int http2_session_data(struct http2_session *session, unsigned int stream_id, int flags, const char *payload, size_t len, size_t frame_len)
+{
+	struct http2_stream *stream = http2_session_stream(session, stream_id);
+	if(stream_id == 0 || http2_session_ack(session, stream, frame_len) < 0)
+		return -1;
+	if(stream == NULL || stream->closed)
+		return 0;
+	if(!stream->final)
+		return -1;
+	if(len > 0 && !stream->chunked)
+	{
+		http2_stream_deliver(stream, payload, len);
+	}
+	else if(len > 0)
+	{
+		char size[24];
+		session->text.len = 0;
+		if(str_buffer_append(&session->text, size, sprintf(size, "%lx\r\n", (unsigned long)len)) < 0
+			|| str_buffer_append(&session->text, payload, len) < 0 || str_buffer_append(&session->text, "\r\n", 2) < 0)
+			return -1;
+		http2_stream_deliver(stream, session->text.data, session->text.len);
+	}
+	if(flags & HTTP2_FLAG_END_STREAM)
+	{
+		if(stream->chunked)
+			http2_stream_deliver(stream, "0\r\n\r\n", 5);
+		stream->closed = 1;
+	}
+	return 0;
+}
+
+/*
+	Handles a SETTINGS frame of the server
+*/
+int http2_session_settings(struct http2_session *session, int flags, const unsigned char *payload, size_t len)
+{
+	size_t i;
+	if(flags & HTTP2_FLAG_ACK)
+		return len == 0 ? 0 : -1;
+	if(len % 6 != 0)
+		return -1;
+	for(i = 0; i < len; i += 6)
+	{
+		unsigned int id = (payload[i] << 8) | payload[i + 1];
+		unsigned int value = http2_u32(payload + i + 2);
+		struct http2_stream *stream;
+		switch(id)
+		{
+			case 0x3:		/* MAX_CONCURRENT_STREAMS */
+				session->peer_max_streams = value;
+				break;
+			case 0x4:		/* INITIAL_WINDOW_SIZE, changes the windows of open streams too */
+				if(value > 0x7fffffff)
+					return -1;
+				for(stream = session->stream_list; stream != NULL; stream = stream->next)
+					stream->send_window += (long)value - session->peer_initial_window;
+				session->peer_initial_window = value;
+				break;
+			case 0x5:		/* MAX_FRAME_SIZE */
+				if(value < 16384 || value > 16777215)
+					return -1;
+				session->peer_max_frame = value < HTTP2_MAX_FRAME ? value : HTTP2_MAX_FRAME;
+				break;
+			default:
+				/* HEADER_TABLE_SIZE does not matter, the encoder does not index */
+				break;
+		}
+	}
+	return http2_frame_header(&session->out, 0, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0);
+}
+
+/*
+	Handles a complete frame. Returns 0 on success and -1 on a connection error.
+*/
+int http2_session_frame(struct http2_session *session, int type, int flags, unsigned int stream_id, const unsigned char *payload, size_t len)
+{
+	struct http2_stream *stream;
+	size_t frame_len = len;
+	size_t pad = 0;
+
+	/* A header block must not be interrupted by other frames */
+	if(session->block_stream != 0 && (type != HTTP2_CONTINUATION || stream_id != session->block_stream))
+		return -1;
+
+	if((type == HTTP2_DATA || type == HTTP2_HEADERS) && (flags & HTTP2_FLAG_PADDED))
+	{
+		if(len < 1 || payload[0] >= len)
+			return -1;
+		pad = payload[0];
+		payload++;
+		len -= pad + 1;
+	}
+
+	switch(type)
+	{
+		case HTTP2_DATA:
+			return http2_session_data(session, stream_id, flags, (const char*)payload, len, frame_len);
+		case HTTP2_HEADERS:
+			if(stream_id == 0)
+				return -1;
+			if(flags & HTTP2_FLAG_PRIORITY)
+			{
+				if(len < 5)
+					return -1;
+				payload += 5;
+				len -= 5;
+			}
+			session->block.len = 0;
+			session->block_end_stream = flags & HTTP2_FLAG_END_STREAM;
+			/* fall through */
+		case HTTP2_CONTINUATION:
+			if(type == HTTP2_CONTINUATION && session->block_stream == 0)
+				return -1;
+			if(str_buffer_append(&session->block, (const char*)payload, len) < 0)
+				return -1;
+			if(!(flags & HTTP2_FLAG_END_HEADERS))
+			{
+				session->block_stream = stream_id;
+				return 0;
+			}
+			session->block_stream = 0;
+			return http2_session_headers(session, stream_id, session->block.data, session->block.len, session->block_end_stream);
+		case HTTP2_RST_STREAM:
+			if(stream_id == 0 || len != 4)
+				return -1;
+			stream = http2_session_stream(session, stream_id);
+			if(stream != NULL && !stream->closed)
+				http2_stream_abort(stream, http2_u32(payload) == 0x7);	/* REFUSED_STREAM */
+			return 0;
+		case HTTP2_SETTINGS:
+			if(stream_id != 0 || http2_session_settings(session, flags, payload, len) < 0)
+				return -1;
+			return http2_session_pump(session);
+		case HTTP2_PUSH_PROMISE:
+			return -1;		/* push is disabled */
+		case HTTP2_PING:
+			if(stream_id != 0 || len != 8)
+				return -1;
+			if(flags & HTTP2_FLAG_ACK)
+				return 0;
+			if(http2_frame_header(&session->out, 8, HTTP2_PING, HTTP2_FLAG_ACK, 0) < 0)
+				return -1;
+			return str_buffer_append(&session->out, (const char*)payload, 8);
+		case HTTP2_GOAWAY:
+		{
+			unsigned int last;
+			if(stream_id != 0 || len < 8)
+				return -1;
+			last = http2_u32(payload) & 0x7fffffff;
+			session->goaway = 1;
+			for(stream = session->stream_list; stream != NULL; stream = stream->next)
+			{
+				if(stream->id > last && !stream->closed)
+					http2_stream_abort(stream, 1);
+			}
+			return 0;
+		}
+		case HTTP2_WINDOW_UPDATE:
+		{
+			unsigned int increment;
+			if(len != 4)
+				return -1;
+			increment = http2_u32(payload) & 0x7fffffff;
+			if(stream_id == 0)
+			{
+				session->send_window += increment;
+			}
+			else
+			{
+				stream = http2_session_stream(session, stream_id);
+				if(stream != NULL)
+					stream->send_window += increment;
+			}
+			return http2_session_pump(session);
+		}
+		default:
+			return 0;		/* PRIORITY and unknown frames are ignored */
+	}
+}
+
+/*
+	Feeds bytes received on the connection to the session. The responses are
+	passed to the parsers of their streams, frames to send in reply are queued in
+	session->out. Returns 0 on success and -1 on a connection error, the session
+	is dead then.
+*/
+int http2_session_feed(struct http2_session *session, const char *data, size_t len)
+{
+	const unsigned char *frame;
+	size_t used = 0;
+
+	if(session->dead || str_buffer_append(&session->in, data, len) < 0)
+	{
+		session->dead = 1;
+		return -1;
+	}
+	frame = (const unsigned char*)session->in.data;
+	while(session->in.len - used >= 9)
+	{
+		size_t frame_len = ((size_t)frame[used] << 16) | (frame[used + 1] << 8) | frame[used + 2];
+		if(frame_len > HTTP2_MAX_FRAME)
+		{
+			session->dead = 1;
+			return -1;
+		}
+		if(session->in.len - used < 9 + frame_len)
+			break;
+		if(http2_session_frame(session, frame[used + 3], frame[used + 4], http2_u32(frame + used + 5) & 0x7fffffff, frame + used + 9, frame_len) < 0)
+		{
+			/* GOAWAY with PROTOCOL_ERROR, best effort */
+			unsigned char payload[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+			if(http2_frame_header(&session->out, 8, HTTP2_GOAWAY, 0, 0) == 0)
+				str_buffer_append(&session->out, (const char*)payload, 8);
+			session->dead = 1;
+			return -1;
+		}
+		used += 9 + frame_len;
+	}
+	memmove(session->in.data, session->in.data + used, session->in.len - used);
+	session->in.len -= used;
+	return 0;
+}
+
+/*
+	Writes the frames queued in session->out. Returns 0 on success and -1 on
+	failure.
+*/
+int http2_session_flush(struct http_connection *conn)
+{
+	struct http2_session *session = conn->h2;
+	while(session->out.len > 0)
+	{
+		size_t len = session->out.len;
+		if(http_connection_send(conn, session->out.data, len) < 0)
+		{
+			session->dead = 1;
+			return -1;
+		}
+		session->out.len = 0;
+
+		/* The windows may allow more of the request bodies now */
+		if(http2_session_pump(session) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Makes a request on a HTTP/2 connection, the response is passed to parser as
+	HTTP/1.1. Other streams of the connection are not served, a blocking
+	connection carries one request at a time. Returns 0 when the response is
+	complete, 1 when the server refused the stream and the request can be sent
+	again, -1 on failure.
+*/
+int http2_request(struct http_connection *conn, const char *http_headers, const struct http_upload *upload, struct http_parser *parser)
+{
+	struct http2_session *session = conn->h2;
+	struct http2_stream *stream;
+	char BUF[BUFSIZ];
+	int result;
+
+	if(!http2_session_available(session))
+		return 1;
+	stream = http2_session_submit(session, http_headers, upload, parser);
+	if(stream == NULL)
+		return -1;
+	while(http2_session_flush(conn) == 0 && !stream->closed)
+	{
+		long n = http_connection_recv(conn, BUF, BUFSIZ);
+		if(n <= 0)
+		{
+			session->dead = 1;
+			break;
+		}
+		if(http2_session_feed(session, BUF, n) < 0)
+			break;
+	}
+	if(parser->state == HTTP_PARSER_DONE)
+		result = 0;
+	else
+		result = stream->refused ? 1 : -1;
+	http2_stream_close(stream);
+	if(!session->dead)
+		http2_session_flush(conn);
+	return result;
+}
+
+/*
+	Handles the frames the server sent while a connection was idle in the pool.
+	Returns whether the connection can carry new streams.
+*/
+int http2_connection_idle(struct http_connection *conn)
+{
+	struct http2_session *session = conn->h2;
+	char BUF[BUFSIZ];
+	int flags = fcntl(conn->sock, F_GETFL, 0);
+
+	if(flags < 0 || fcntl(conn->sock, F_SETFL, flags | O_NONBLOCK) < 0)
+		return 0;
+	while(!session->dead)
+	{
+		long n;
+		if(conn->ssl != NULL)
+		{
+			n = SSL_read(conn->ssl, BUF, BUFSIZ);
+			if(n <= 0 && SSL_get_error(conn->ssl, n) == SSL_ERROR_WANT_READ)
+				break;
+		}
+		else
+		{
+			n = recv(conn->sock, BUF, BUFSIZ, 0);
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				break;
+		}
+		if(n <= 0)
+			session->dead = 1;
+		else
+			http2_session_feed(session, BUF, n);
+	}
+	fcntl(conn->sock, F_SETFL, flags);
+	if(!session->dead)
+		http2_session_flush(conn);
+	return !session->dead && http2_session_available(session);
+}
+
+/*
+	Starts HTTP/2 on a new connection when the server agreed to it during the
+	TLS handshake (ALPN), or on a plain connection with http2_prior_knowledge.
+	conn->h2 stays NULL for HTTP/1.1. Returns -1 when out of memory.
+*/
+int http2_connection_setup(struct http_connection *conn)
+{
+	if(conn->h2 != NULL)
+		return 0;
+	if(conn->ssl != NULL)
+	{
+		const unsigned char *protocol = NULL;
+		unsigned int len = 0;
+		SSL_get0_alpn_selected(conn->ssl, &protocol, &len);
+		if(len != 2 || memcmp(protocol, "h2", 2) != 0)
+			return 0;
+		/* Frames are appended to session->out while a write waits for the socket */
+		SSL_set_mode(conn->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	}
+	else if(conn->ishttps || !http2_prior_knowledge)
+	{
+		return 0;
+	}
+	conn->h2 = http2_session_new(conn->ishttps);
+	return conn->h2 != NULL ? 0 : -1;
+}
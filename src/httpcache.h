@@ -0,0 +1,642 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+
+/*
+	In-memory cache of GET and HEAD responses (RFC 7234, as a private cache).
+	Responses are stored when Cache-Control max-age makes them fresh for a while
+	or when they carry an ETag or Last-Modified to revalidate them with. A fresh
+	response is served without any network I/O, a stale one is revalidated with a
+	conditional request and served again when the server answers 304.
+*/
+
+/*
+	Bytes of responses the cache keeps at most, the least recently used responses
+	are dropped first. 0 disables the cache.
+*/
+int http_cache_max_bytes = 0;
+
+#define HTTP_CACHE_BUCKETS 256
+
+/*
+	Represents a cached response
+*/
+struct http_cache_entry
+{
+	char *key;							/* method and normalized url */
+	char *vary;							/* request header values the response varies on */
+	struct http_response *hresp;		/* without request_uri and request_headers */
+	time_t expires;						/* fresh until then */
+	size_t size;
+	struct http_cache_entry *next;		/* in its bucket */
+	struct http_cache_entry *newer;		/* in the LRU list */
+	struct http_cache_entry *older;
+};
+
+struct http_cache_entry *http_cache_table[HTTP_CACHE_BUCKETS];
+struct http_cache_entry *http_cache_newest = NULL;
+struct http_cache_entry *http_cache_oldest = NULL;
+size_t http_cache_bytes = 0;
+pthread_mutex_t http_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Cache-Control directives that matter to the cache
+*/
+struct http_cache_control
+{
+	int no_store;
+	int no_cache;
+	long max_age;						/* -1 when absent */
+};
+
+/*
+	Parses the directives of a Cache-Control value, value may be NULL
+*/
+void http_cache_control_parse(const char *value, size_t len, struct http_cache_control *control)
+{
+	const char *end = value + len;
+	memset(control, 0, sizeof(struct http_cache_control));
+	control->max_age = -1;
+	while(value != NULL && value < end)
+	{
+		const char *token, *token_end;
+		size_t token_len;
+		while(value < end && (*value == ' ' || *value == '\t' || *value == ','))
+			value++;
+		token = value;
+		while(value < end && *value != ',')
+			value++;
+		token_end = value;
+		while(token_end > token && (token_end[-1] == ' ' || token_end[-1] == '\t'))
+			token_end--;
+		token_len = token_end - token;
+
+		if(token_len == 8 && strncasecmp(token, "no-store", 8) == 0)
+			control->no_store = 1;
+		else if(token_len >= 8 && strncasecmp(token, "no-cache", 8) == 0)
+			control->no_cache = 1;		/* also no-cache="field" */
+		else if(token_len > 8 && strncasecmp(token, "max-age=", 8) == 0)
+		{
+			const char *digits = token + 8;
+			long age = 0;
+			if(*digits == '"')
+				digits++;
+			if(!isdigit((unsigned char)*digits))
+				continue;
+			for(; digits < token_end && isdigit((unsigned char)*digits); digits++)
+				age = age < 100000000 ? age * 10 + (*digits - '0') : age;
+			control->max_age = age;
+		}
+	}
+}
+
+/*
+	Gets the value of a header of a request head, the name is case insensitive.
+	The value is not NUL terminated, its length is stored in len. Returns NULL when
+	the request has no such header.
+*/
+const char* http_cache_request_header(const char *http_headers, const char *name, size_t *len)
+{
+	size_t name_len = strlen(name);
+	const char *line = strstr(http_headers, "\r\n");
+	while(line != NULL && strncmp(line, "\r\n\r\n", 4) != 0)
+	{
+		const char *end;
+		line += 2;
+		end = strstr(line, "\r\n");
+		if(end == NULL)
+			break;
+		if((size_t)(end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0)
+		{
+			const char *value = line + name_len + 1;
+			while(value < end && (*value == ' ' || *value == '\t'))
+				value++;
+			*len = end - value;
+			return value;
+		}
+		line = end;
+	}
+	return NULL;
+}
+
+/*
+	Builds the key of a request: the method and the url with scheme and host in
+	lower case and the port always present. The caller frees the returned
+	string. Returns NULL for methods that are not cached or when out of memory.
+*/
+char* http_cache_key(const char *http_headers, struct parsed_url *purl)
+{
+	struct str_buffer key;
+	const char *method_end = strchr(http_headers, ' ');
+	size_t i, host_at;
+
+	if(method_end == NULL || !((method_end - http_headers == 3 && strncmp(http_headers, "GET", 3) == 0)
+		|| (method_end - http_headers == 4 && strncmp(http_headers, "HEAD", 4) == 0)))
+		return NULL;
+	str_buffer_init(&key);
+	if(str_buffer_append(&key, http_headers, method_end - http_headers + 1) < 0
+		|| str_buffer_append(&key, purl->scheme, strlen(purl->scheme)) < 0
+		|| str_buffer_append(&key, "://", 3) < 0)
+	{
+		str_buffer_free(&key);
+		return NULL;
+	}
+	for(i = method_end - http_headers + 1; i < key.len; i++)
+		key.data[i] = tolower((unsigned char)key.data[i]);
+	if(purl->username != NULL && (str_buffer_append(&key, purl->username, strlen(purl->username)) < 0 || str_buffer_append(&key, "@", 1) < 0))
+	{
+		str_buffer_free(&key);
+		return NULL;
+	}
+	host_at = key.len;
+	if(str_buffer_append(&key, purl->host, strlen(purl->host)) < 0
+		|| str_buffer_append(&key, ":", 1) < 0 || str_buffer_append(&key, purl->port, strlen(purl->port)) < 0
+		|| str_buffer_append(&key, "/", 1) < 0
+		|| (purl->path != NULL && str_buffer_append(&key, purl->path, strlen(purl->path)) < 0)
+		|| (purl->query != NULL && (str_buffer_append(&key, "?", 1) < 0 || str_buffer_append(&key, purl->query, strlen(purl->query)) < 0)))
+	{
+		str_buffer_free(&key);
+		return NULL;
+	}
+	for(i = host_at; i < host_at + strlen(purl->host); i++)
+		key.data[i] = tolower((unsigned char)key.data[i]);
+	return key.data;
+}
+
+/*
+	Collects the values of the request headers named in a Vary value, as
+	"name: value\r\n" lines in the order of the Vary value. The caller frees the
+	returned string. Returns NULL for Vary: * and when out of memory.
+*/
+char* http_cache_vary(const char *vary, size_t vary_len, const char *http_headers)
+{
+	struct str_buffer out;
+	const char *end = vary + vary_len;
+	str_buffer_init(&out);
+	if(str_buffer_append(&out, "", 0) < 0)
+		return NULL;
+	while(vary != NULL && vary < end)
+	{
+		const char *name, *value;
+		char field[64];
+		size_t len, value_len = 0, i;
+		while(vary < end && (*vary == ' ' || *vary == '\t' || *vary == ','))
+			vary++;
+		name = vary;
+		while(vary < end && *vary != ',' && *vary != ' ' && *vary != '\t')
+			vary++;
+		len = vary - name;
+		if(len == 0)
+			continue;
+		if((len == 1 && *name == '*') || len >= sizeof(field))
+		{
+			str_buffer_free(&out);
+			return NULL;
+		}
+		for(i = 0; i < len; i++)
+			field[i] = tolower((unsigned char)name[i]);
+		field[len] = '\0';
+		value = http_cache_request_header(http_headers, field, &value_len);
+		if(str_buffer_append(&out, field, len) < 0 || str_buffer_append(&out, ": ", 2) < 0
+			|| (value != NULL && str_buffer_append(&out, value, value_len) < 0) || str_buffer_append(&out, "\r\n", 2) < 0)
+		{
+			str_buffer_free(&out);
+			return NULL;
+		}
+	}
+	return out.data;
+}
+
+/*
+	Copies the status, headers and body of a response into a new response, which
+	takes ownership of http_headers and purl. The copy is allocated in arena, or
+	with malloc when arena is NULL. Returns NULL when out of memory.
+*/
+struct http_response* http_cache_copy(struct http_response *source, char *http_headers, struct parsed_url *purl, struct http_arena *arena)
+{
+	struct http_response *hresp = (struct http_response*)http_arena_malloc(arena, sizeof(struct http_response));
+	size_t headers_len = strlen(source->response_headers);
+	if(hresp == NULL)
+		return NULL;
+	memset(hresp, 0, sizeof(struct http_response));
+	hresp->arena = arena;
+	hresp->body = source->body != NULL ? (char*)http_arena_malloc(arena, source->body_len + 1) : NULL;
+	hresp->status_code = http_arena_strndup(arena, source->status_code, strlen(source->status_code));
+	hresp->status_text = http_arena_strndup(arena, source->status_text, strlen(source->status_text));
+	hresp->response_headers = http_arena_strndup(arena, source->response_headers, headers_len);
+	hresp->headers = source->headers;
+	hresp->headers.arena = arena;
+	hresp->headers.fields = (struct http_header*)http_arena_malloc(arena, (source->headers.count + 1) * sizeof(struct http_header));
+	hresp->headers.cap = source->headers.count + 1;
+	if((source->body != NULL && hresp->body == NULL) || hresp->status_code == NULL || hresp->status_text == NULL
+		|| hresp->response_headers == NULL || hresp->headers.fields == NULL)
+	{
+		http_response_discard(hresp);
+		return NULL;
+	}
+	if(source->body != NULL)
+	{
+		memcpy(hresp->body, source->body, source->body_len);
+		hresp->body[source->body_len] = '\0';
+	}
+	memcpy(hresp->headers.fields, source->headers.fields, source->headers.count * sizeof(struct http_header));
+	hresp->body_len = source->body_len;
+	hresp->encoded_len = source->encoded_len;
+	hresp->status_code_int = source->status_code_int;
+	hresp->request_headers = http_headers;
+	hresp->request_uri = purl;
+	return hresp;
+}
+
+/*
+	Hashes a key
+*/
+unsigned int http_cache_hash(const char *key)
+{
+	unsigned int hash = 2166136261u;
+	for(; *key; key++)
+		hash = (hash ^ (unsigned char)*key) * 16777619u;
+	return hash % HTTP_CACHE_BUCKETS;
+}
+
+/*
+	Finds the entry of a key, the lock must be held
+*/
+struct http_cache_entry* http_cache_find(const char *key)
+{
+	struct http_cache_entry *entry;
+	for(entry = http_cache_table[http_cache_hash(key)]; entry != NULL; entry = entry->next)
+	{
+		if(strcmp(entry->key, key) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+	Moves an entry to the front of the LRU list, the lock must be held
+*/
+void http_cache_touch(struct http_cache_entry *entry)
+{
+	if(entry == http_cache_newest)
+		return;
+	entry->newer->older = entry->older;
+	if(entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		http_cache_oldest = entry->newer;
+	entry->newer = NULL;
+	entry->older = http_cache_newest;
+	http_cache_newest->newer = entry;
+	http_cache_newest = entry;
+}
+
+/*
+	Removes an entry from the cache and frees it, the lock must be held
+*/
+void http_cache_remove(struct http_cache_entry *entry)
+{
+	struct http_cache_entry **link = &http_cache_table[http_cache_hash(entry->key)];
+	while(*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+	if(entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		http_cache_newest = entry->older;
+	if(entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		http_cache_oldest = entry->newer;
+	http_cache_bytes -= entry->size;
+	http_response_free(entry->hresp);
+	free(entry->key);
+	free(entry->vary);
+	free(entry);
+}
+
+/*
+	Works out until when a response is fresh from its Cache-Control and Age
+	headers. A response without max-age, or with no-cache, is stale right away
+	and revalidated on every use.
+*/
+time_t http_cache_expires(struct http_response *hresp, time_t now)
+{
+	struct http_cache_control control;
+	const char *value;
+	size_t len = 0;
+	long age = 0;
+
+	value = http_response_header_by_id(hresp, HTTP_HEADER_CACHE_CONTROL, &len);
+	http_cache_control_parse(value, len, &control);
+	if(control.no_cache || control.max_age <= 0)
+		return now;
+	value = http_response_header_by_id(hresp, HTTP_HEADER_AGE, &len);
+	if(value != NULL)
+		age = strtol(value, NULL, 10);
+	if(age < 0 || age >= control.max_age)
+		return now;
+	return now + (control.max_age - age);
+}
+
+/*
+	Returns whether a response may be stored and is worth storing
+*/
+int http_cache_storable(struct http_response *hresp)
+{
+	struct http_cache_control control;
+	const char *value;
+	size_t len = 0;
+	int status = hresp->status_code_int;
+
+	/* Status codes that are cacheable by default (RFC 7231, section 6.1) */
+	if(status != 200 && status != 203 && status != 204 && status != 300 && status != 301
+		&& status != 404 && status != 405 && status != 410 && status != 414 && status != 501)
+		return 0;
+	value = http_response_header_by_id(hresp, HTTP_HEADER_CACHE_CONTROL, &len);
+	http_cache_control_parse(value, len, &control);
+	if(control.no_store)
+		return 0;
+
+	/* Without max-age it is stale right away, it needs something to revalidate with */
+	return control.max_age > 0 || http_response_header_by_id(hresp, HTTP_HEADER_ETAG, NULL) != NULL
+		|| http_response_header_by_id(hresp, HTTP_HEADER_LAST_MODIFIED, NULL) != NULL;
+}
+
+/*
+	Stores a response for a key, replacing the entry stored before. Responses
+	that may not or need not be stored are left out.
+*/
+void http_cache_store(const char *key, const char *http_headers, struct http_response *hresp)
+{
+	struct http_cache_entry *entry;
+	const char *value;
+	size_t len = 0;
+	time_t now = time(NULL);
+
+	if(http_cache_max_bytes <= 0 || !http_cache_storable(hresp))
+		return;
+	entry = (struct http_cache_entry*)calloc(1, sizeof(struct http_cache_entry));
+	if(entry == NULL)
+		return;
+	value = http_response_header_by_id(hresp, HTTP_HEADER_VARY, &len);
+	entry->vary = http_cache_vary(value, value != NULL ? len : 0, http_headers);
+	entry->key = str_dup(key);
+	entry->hresp = entry->vary != NULL && entry->key != NULL ? http_cache_copy(hresp, NULL, NULL, NULL) : NULL;
+	if(entry->hresp == NULL)
+	{
+		free(entry->key);
+		free(entry->vary);
+		free(entry);
+		return;
+	}
+	entry->expires = http_cache_expires(hresp, now);
+	entry->size = sizeof(struct http_cache_entry) + strlen(entry->key) + strlen(entry->vary) + hresp->body_len
+		+ strlen(hresp->response_headers) + entry->hresp->headers.cap * sizeof(struct http_header);
+
+	pthread_mutex_lock(&http_cache_lock);
+	if(entry->size > (size_t)http_cache_max_bytes)
+	{
+		pthread_mutex_unlock(&http_cache_lock);
+		http_response_free(entry->hresp);
+		free(entry->key);
+		free(entry->vary);
+		free(entry);
+		return;
+	}
+	{
+		struct http_cache_entry *old = http_cache_find(key);
+		unsigned int bucket = http_cache_hash(key);
+		if(old != NULL)
+			http_cache_remove(old);
+		while(http_cache_oldest != NULL && http_cache_bytes + entry->size > (size_t)http_cache_max_bytes)
+			http_cache_remove(http_cache_oldest);
+		entry->next = http_cache_table[bucket];
+		http_cache_table[bucket] = entry;
+		entry->older = http_cache_newest;
+		if(http_cache_newest != NULL)
+			http_cache_newest->newer = entry;
+		else
+			http_cache_oldest = entry;
+		http_cache_newest = entry;
+		http_cache_bytes += entry->size;
+	}
+	pthread_mutex_unlock(&http_cache_lock);
+}
+
+/*
+	Adds the validators of a cached response to a request head, as If-None-Match
+	and If-Modified-Since. The caller frees the returned head. Returns NULL when
+	the response has no validators or when out of memory.
+*/
+char* http_cache_conditional(const char *http_headers, struct http_response *cached)
+{
+	struct str_buffer head;
+	const char *etag, *modified;
+	size_t etag_len = 0, modified_len = 0;
+	size_t head_len = strlen(http_headers);
+
+	etag = http_response_header_by_id(cached, HTTP_HEADER_ETAG, &etag_len);
+	modified = http_response_header_by_id(cached, HTTP_HEADER_LAST_MODIFIED, &modified_len);
+	if((etag == NULL && modified == NULL) || head_len < 4 || strcmp(http_headers + head_len - 4, "\r\n\r\n") != 0)
+		return NULL;
+
+	/* The head without its blank line, the validators and the blank line */
+	str_buffer_init(&head);
+	if(str_buffer_reserve(&head, head_len + etag_len + modified_len + 40) < 0
+		|| str_buffer_append(&head, http_headers, head_len - 2) < 0
+		|| (etag != NULL && (str_buffer_append(&head, "If-None-Match: ", 15) < 0 || str_buffer_append(&head, etag, etag_len) < 0
+			|| str_buffer_append(&head, "\r\n", 2) < 0))
+		|| (modified != NULL && (str_buffer_append(&head, "If-Modified-Since: ", 19) < 0
+			|| str_buffer_append(&head, modified, modified_len) < 0 || str_buffer_append(&head, "\r\n", 2) < 0))
+		|| str_buffer_append(&head, "\r\n", 2) < 0)
+	{
+		str_buffer_free(&head);
+		return NULL;
+	}
+	return head.data;
+}
+
+/*
+	Looks up the cached response of a request. A fresh response is copied into
+	*hresp, which takes ownership of http_headers and purl. The head of a
+	conditional request is returned in *conditional for a stale response, or for
+	any response when revalidate is set.
+*/
+void http_cache_lookup(const char *key, char *http_headers, struct parsed_url *purl, int revalidate, struct http_response **hresp, char **conditional)
+{
+	struct http_cache_entry *entry;
+	char *vary = NULL;
+
+	*hresp = NULL;
+	*conditional = NULL;
+	pthread_mutex_lock(&http_cache_lock);
+	entry = http_cache_find(key);
+	if(entry != NULL)
+	{
+		size_t len = 0;
+		const char *value = http_response_header_by_id(entry->hresp, HTTP_HEADER_VARY, &len);
+		vary = http_cache_vary(value, value != NULL ? len : 0, http_headers);
+	}
+	if(entry != NULL && vary != NULL && strcmp(vary, entry->vary) == 0)
+	{
+		http_cache_touch(entry);
+		if(!revalidate && time(NULL) < entry->expires)
+			*hresp = http_cache_copy(entry->hresp, http_headers, purl, purl->arena);
+		else
+			*conditional = http_cache_conditional(http_headers, entry->hresp);
+	}
+	pthread_mutex_unlock(&http_cache_lock);
+	free(vary);
+}
+
+/*
+	Serves a 304 answer to a conditional request from the cache: the stored
+	response is made fresh again and copied into a new response, which takes over
+	the request headers and url of not_modified. Returns NULL when the entry is
+	gone meanwhile.
+*/
+struct http_response* http_cache_revalidated(const char *key, struct http_response *not_modified)
+{
+	struct http_cache_entry *entry;
+	struct http_response *hresp = NULL;
+
+	pthread_mutex_lock(&http_cache_lock);
+	entry = http_cache_find(key);
+	if(entry != NULL)
+	{
+		time_t now = time(NULL);
+		http_cache_touch(entry);
+		entry->expires = http_response_header_by_id(not_modified, HTTP_HEADER_CACHE_CONTROL, NULL) != NULL
+			? http_cache_expires(not_modified, now) : http_cache_expires(entry->hresp, now);
+		hresp = http_cache_copy(entry->hresp, not_modified->request_headers, not_modified->request_uri, not_modified->arena);
+	}
+	pthread_mutex_unlock(&http_cache_lock);
+	if(hresp != NULL)
+	{
+		not_modified->request_headers = NULL;
+		not_modified->request_uri = NULL;
+		http_response_discard(not_modified);
+	}
+	return hresp;
+}
+
+void http_cache_disk_lookup(const char *key, char *http_headers, struct parsed_url *purl, int revalidate, struct http_response **hresp, char **conditional);
+struct http_response* http_cache_disk_revalidated(const char *key, struct http_response *not_modified);
+void http_cache_disk_store(const char *key, const char *http_headers, struct http_response *hresp);
+
+/*
+	Makes a GET or HEAD request through the cache. A fresh cached response is
+	returned without network I/O, a stale one is revalidated first. The memory
+	cache is asked first, then the disk cache. Other requests, and requests that
+	carry their own validators or ask for no-store, go to the network.
+*/
+struct http_response* http_cache_req(char *http_headers, struct parsed_url *purl)
+{
+	struct http_cache_control control;
+	struct http_response *hresp;
+	char *key, *conditional;
+	const char *value;
+	size_t len = 0;
+
+	value = http_cache_request_header(http_headers, "Cache-Control", &len);
+	http_cache_control_parse(value, len, &control);
+	if(control.no_store || http_cache_request_header(http_headers, "If-None-Match", &len) != NULL
+		|| http_cache_request_header(http_headers, "If-Modified-Since", &len) != NULL
+		|| (key = http_cache_key(http_headers, purl)) == NULL)
+		return http_req_fetch(http_headers, purl);
+
+	/* no-cache in the request asks for revalidation of a fresh response */
+	http_cache_lookup(key, http_headers, purl, control.no_cache, &hresp, &conditional);
+	if(hresp == NULL && conditional == NULL && http_cache_dir != NULL)
+		http_cache_disk_lookup(key, http_headers, purl, control.no_cache, &hresp, &conditional);
+	if(hresp != NULL)
+	{
+		free(key);
+		return hresp;
+	}
+
+	if(conditional != NULL)
+	{
+		hresp = http_req_fetch(conditional, purl);
+		if(hresp != NULL && hresp->status_code_int == 304)
+		{
+			struct http_response *cached = http_cache_revalidated(key, hresp);
+			if(cached == NULL && http_cache_dir != NULL)
+				cached = http_cache_disk_revalidated(key, hresp);
+			if(cached != NULL)
+			{
+				if(!http_arena_owns(purl->arena, http_headers))
+					free(http_headers);
+				free(key);
+				return cached;
+			}
+
+			/* The entry was dropped meanwhile, the response is fetched again */
+			purl = hresp->request_uri;
+			hresp->request_uri = NULL;
+			free(hresp->request_headers);
+			hresp->request_headers = NULL;
+			http_response_discard(hresp);
+			hresp = http_req_fetch(http_headers, purl);
+		}
+		else if(hresp != NULL)
+		{
+			/* The response replaces the cached one, it is returned with the original request */
+			free(hresp->request_headers);
+			hresp->request_headers = http_headers;
+		}
+		else
+		{
+			free(conditional);
+		}
+	}
+	else
+	{
+		hresp = http_req_fetch(http_headers, purl);
+	}
+
+	if(hresp != NULL)
+	{
+		http_cache_store(key, hresp->request_headers, hresp);
+		if(http_cache_dir != NULL)
+			http_cache_disk_store(key, hresp->request_headers, hresp);
+	}
+	free(key);
+	return hresp;
+}
+
+/*
+	Empties the response cache
+*/
+void http_cache_flush()
+{
+	pthread_mutex_lock(&http_cache_lock);
+	while(http_cache_oldest != NULL)
+		http_cache_remove(http_cache_oldest);
+	pthread_mutex_unlock(&http_cache_lock);
+}
@@ -0,0 +1,661 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+
+/*
+	Disk tier of the response cache. Every response is a segment file holding its
+	status, headers and body, an index file lists the segments with their key,
+	freshness and size, so the cache survives restarts. A hit maps the segment
+	and the response points into the mapping, the body is not copied.
+*/
+
+/*
+	Directory of the disk cache, it must exist. NULL disables the cache.
+*/
+char *http_cache_dir = NULL;
+
+/*
+	Bytes of segment files kept at most, the least recently used are removed first
+*/
+long long http_cache_disk_max_bytes = 1LL << 30;
+
+#define HTTP_DISK_MAGIC "HTCDISK1"
+
+/*
+	Represents a segment listed in the index
+*/
+struct http_disk_entry
+{
+	char *key;
+	char name[17];						/* file name of the segment, the hash of the key in hex */
+	time_t expires;
+	time_t last_used;
+	size_t size;
+	struct http_disk_entry *next;
+};
+
+/*
+	Start of a segment file. The header fields of the response follow, then the
+	key, the Vary values, the status code, the status text, the response headers
+	and the body, each NUL terminated.
+*/
+struct http_disk_segment
+{
+	char magic[8];
+	int status_code_int;
+	int field_count;
+	size_t key_len;
+	size_t vary_len;
+	size_t status_text_len;
+	size_t headers_len;
+	size_t body_len;
+	size_t encoded_len;
+};
+
+struct http_disk_entry *http_disk_table[HTTP_CACHE_BUCKETS];
+char *http_disk_loaded = NULL;			/* directory the index was loaded from */
+long long http_disk_bytes = 0;
+pthread_mutex_t http_disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Builds the path of a file in the cache directory, the caller frees it
+*/
+char* http_disk_path(const char *name, const char *suffix)
+{
+	char *path = (char*)malloc(strlen(http_cache_dir) + strlen(name) + strlen(suffix) + 2);
+	if(path != NULL)
+		sprintf(path, "%s/%s%s", http_cache_dir, name, suffix);
+	return path;
+}
+
+/*
+	Finds the entry of a key, the lock must be held
+*/
+struct http_disk_entry* http_disk_find(const char *key)
+{
+	struct http_disk_entry *entry;
+	for(entry = http_disk_table[http_cache_hash(key)]; entry != NULL; entry = entry->next)
+	{
+		if(strcmp(entry->key, key) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+	Adds an entry to the table, the lock must be held
+*/
+void http_disk_insert(struct http_disk_entry *entry)
+{
+	unsigned int bucket = http_cache_hash(entry->key);
+	entry->next = http_disk_table[bucket];
+	http_disk_table[bucket] = entry;
+	http_disk_bytes += entry->size;
+}
+
+/*
+	Removes an entry from the table and frees it, its segment is deleted when
+	unlink_segment is set. Responses that still map the segment keep it. The lock
+	must be held.
+*/
+void http_disk_remove(struct http_disk_entry *entry, int unlink_segment)
+{
+	struct http_disk_entry **link = &http_disk_table[http_cache_hash(entry->key)];
+	while(*link != entry)
+		link = &(*link)->next;
+	*link = entry->next;
+	http_disk_bytes -= entry->size;
+	if(unlink_segment)
+	{
+		char *path = http_disk_path(entry->name, "");
+		if(path != NULL)
+			unlink(path);
+		free(path);
+	}
+	free(entry->key);
+	free(entry);
+}
+
+/*
+	Forgets the loaded index, the lock must be held
+*/
+void http_disk_unload()
+{
+	int i;
+	for(i = 0; i < HTTP_CACHE_BUCKETS; i++)
+	{
+		while(http_disk_table[i] != NULL)
+			http_disk_remove(http_disk_table[i], 0);
+	}
+	free(http_disk_loaded);
+	http_disk_loaded = NULL;
+}
+
+/*
+	Loads the index of the cache directory, unless it is loaded already. Every
+	line of the index is "name expires last_used size key". Returns 0 on success
+	and -1 when out of memory. The lock must be held.
+*/
+int http_disk_load()
+{
+	char line[8192];
+	char *path;
+	FILE *index;
+
+	if(http_disk_loaded != NULL && strcmp(http_disk_loaded, http_cache_dir) == 0)
+		return 0;
+	http_disk_unload();
+	http_disk_loaded = str_dup(http_cache_dir);
+	path = http_disk_path("index", "");
+	if(http_disk_loaded == NULL || path == NULL)
+	{
+		free(path);
+		return -1;
+	}
+	index = fopen(path, "r");
+	free(path);
+	if(index == NULL)
+		return 0;		/* a new cache */
+	while(fgets(line, sizeof(line), index) != NULL)
+	{
+		struct http_disk_entry *entry;
+		long long expires, last_used, size;
+		char name[17];
+		int key_at = 0;
+		size_t len = strlen(line);
+		if(len == 0 || line[len - 1] != '\n')
+			continue;
+		line[len - 1] = '\0';
+		if(sscanf(line, "%16s %lld %lld %lld %n", name, &expires, &last_used, &size, &key_at) != 4 || key_at == 0
+			|| strlen(name) != 16 || line[key_at] == '\0' || http_disk_find(line + key_at) != NULL)
+			continue;
+		entry = (struct http_disk_entry*)calloc(1, sizeof(struct http_disk_entry));
+		if(entry == NULL || (entry->key = str_dup(line + key_at)) == NULL)
+		{
+			free(entry);
+			break;
+		}
+		memcpy(entry->name, name, 17);
+		entry->expires = (time_t)expires;
+		entry->last_used = (time_t)last_used;
+		entry->size = (size_t)size;
+		http_disk_insert(entry);
+	}
+	fclose(index);
+	return 0;
+}
+
+/*
+	Writes the index, to a temporary file that replaces the index once complete.
+	The lock must be held.
+*/
+void http_disk_save()
+{
+	char *path = http_disk_path("index", ".tmp");
+	char *final_path = http_disk_path("index", "");
+	FILE *index = path != NULL && final_path != NULL ? fopen(path, "w") : NULL;
+	int i, failed = index == NULL;
+
+	for(i = 0; index != NULL && i < HTTP_CACHE_BUCKETS; i++)
+	{
+		struct http_disk_entry *entry;
+		for(entry = http_disk_table[i]; entry != NULL; entry = entry->next)
+		{
+			if(fprintf(index, "%s %lld %lld %lld %s\n", entry->name, (long long)entry->expires,
+				(long long)entry->last_used, (long long)entry->size, entry->key) < 0)
+				failed = 1;
+		}
+	}
+	if(index != NULL && fclose(index) != 0)
+		failed = 1;
+	if(!failed)
+		rename(path, final_path);
+	else if(path != NULL)
+		unlink(path);
+	free(path);
+	free(final_path);
+}
+
+/*
+	Removes the least recently used segments until extra more bytes fit the
+	budget. The lock must be held.
+*/
+void http_disk_evict(size_t extra)
+{
+	while(http_disk_bytes > 0 && http_disk_bytes + (long long)extra > http_cache_disk_max_bytes)
+	{
+		struct http_disk_entry *oldest = NULL, *entry;
+		int i;
+		for(i = 0; i < HTTP_CACHE_BUCKETS; i++)
+		{
+			for(entry = http_disk_table[i]; entry != NULL; entry = entry->next)
+			{
+				if(oldest == NULL || entry->last_used < oldest->last_used)
+					oldest = entry;
+			}
+		}
+		if(oldest == NULL)
+			break;
+		http_disk_remove(oldest, 1);
+	}
+}
+
+/*
+	Adds len to *size, returns -1 when the sum does not fit a size_t
+*/
+int http_disk_add_size(size_t *size, size_t len)
+{
+	if(len > ((size_t)-1) - *size)
+		return -1;
+	*size += len;
+	return 0;
+}
+
+/*
+	Computes the size of a segment from the sizes in its head. Returns 0 on
+	success and -1 when the sizes of a damaged segment do not add up to a size_t.
+*/
+int http_disk_segment_size(const struct http_disk_segment *segment, size_t *size)
+{
+	size_t strings[6];
+	int i, result = 0;
+
+	if(segment->field_count < 0 || (size_t)segment->field_count > ((size_t)-1) / sizeof(struct http_header))
+		return -1;
+	strings[0] = segment->key_len;
+	strings[1] = segment->vary_len;
+	strings[2] = 3;						/* the status code */
+	strings[3] = segment->status_text_len;
+	strings[4] = segment->headers_len;
+	strings[5] = segment->body_len;
+	*size = sizeof(struct http_disk_segment);
+	result |= http_disk_add_size(size, segment->field_count * sizeof(struct http_header));
+	for(i = 0; i < 6; i++)
+	{
+		/* Every string is followed by its terminator */
+		result |= http_disk_add_size(size, strings[i]);
+		result |= http_disk_add_size(size, 1);
+	}
+	return result;
+}
+
+/*
+	Checks that the header fields of a segment lie within its response headers.
+	Returns 0 when they do and -1 when the segment is damaged.
+*/
+int http_disk_check_fields(const struct http_header *fields, int count, size_t headers_len)
+{
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		const struct http_header *field = &fields[i];
+		if((int)field->id < HTTP_HEADER_OTHER || field->id >= HTTP_HEADER_COUNT
+			|| field->name_offset > headers_len || field->name_len > headers_len - field->name_offset
+			|| field->value_offset > headers_len || field->value_len > headers_len - field->value_offset)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Maps the segment of an entry and makes a response whose body and strings
+	point into the mapping, only the header fields are copied, in arena unless it
+	is NULL. Returns NULL when the segment is missing, does not belong to the key
+	or is damaged.
+*/
+struct http_response* http_disk_map(struct http_disk_entry *entry, char **vary, struct http_arena *arena)
+{
+	struct http_disk_segment segment;
+	struct http_response *hresp;
+	struct stat st;
+	size_t fields_len, need;
+	char *path = http_disk_path(entry->name, "");
+	char *map, *text, *key, *vary_text, *status_code, *status_text, *headers, *body;
+	int i;
+	int fd = path != NULL ? open(path, O_RDONLY) : -1;
+
+	free(path);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(segment))
+	{
+		close(fd);
+		return NULL;
+	}
+	map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
+
+	memcpy(&segment, map, sizeof(segment));
+	if(memcmp(segment.magic, HTTP_DISK_MAGIC, 8) != 0 || http_disk_segment_size(&segment, &need) < 0
+		|| need != (size_t)st.st_size)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	/* Each string must end in its terminator where the sizes say */
+	fields_len = segment.field_count * sizeof(struct http_header);
+	text = map + sizeof(segment) + fields_len;
+	key = text;
+	vary_text = key + segment.key_len + 1;
+	status_code = vary_text + segment.vary_len + 1;
+	status_text = status_code + 4;
+	headers = status_text + segment.status_text_len + 1;
+	body = headers + segment.headers_len + 1;
+	if(key[segment.key_len] != '\0' || vary_text[segment.vary_len] != '\0' || status_code[3] != '\0'
+		|| status_text[segment.status_text_len] != '\0' || headers[segment.headers_len] != '\0'
+		|| body[segment.body_len] != '\0'
+		|| segment.key_len != strlen(entry->key) || memcmp(key, entry->key, segment.key_len) != 0)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	hresp = (struct http_response*)http_arena_malloc(arena, sizeof(struct http_response));
+	if(hresp == NULL)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	memset(hresp, 0, sizeof(struct http_response));
+	hresp->arena = arena;
+	hresp->mapping = map;
+	hresp->mapping_len = st.st_size;
+	hresp->headers.arena = arena;
+	hresp->headers.fields = (struct http_header*)http_arena_malloc(arena, fields_len + sizeof(struct http_header));
+	if(hresp->headers.fields == NULL)
+	{
+		http_response_discard(hresp);
+		return NULL;
+	}
+	memcpy(hresp->headers.fields, map + sizeof(segment), fields_len);
+	if(http_disk_check_fields(hresp->headers.fields, segment.field_count, segment.headers_len) < 0)
+	{
+		http_response_discard(hresp);
+		return NULL;
+	}
+	hresp->headers.count = segment.field_count;
+	hresp->headers.cap = segment.field_count + 1;
+	for(i = segment.field_count - 1; i >= 0; i--)
+	{
+		enum http_header_id id = hresp->headers.fields[i].id;
+		if(id > HTTP_HEADER_OTHER && id < HTTP_HEADER_COUNT)
+			hresp->headers.index[id] = i + 1;
+	}
+
+	*vary = vary_text;
+	hresp->status_code = status_code;
+	hresp->status_text = status_text;
+	hresp->response_headers = headers;
+	hresp->body = body;
+	hresp->body_len = segment.body_len;
+	hresp->encoded_len = segment.encoded_len;
+	hresp->status_code_int = segment.status_code_int;
+	return hresp;
+}
+
+/*
+	Looks up the disk cache like http_cache_lookup looks up the memory cache. A
+	fresh response is returned mapped, with http_headers and purl.
+*/
+void http_cache_disk_lookup(const char *key, char *http_headers, struct parsed_url *purl, int revalidate, struct http_response **hresp, char **conditional)
+{
+	struct http_disk_entry *entry;
+	struct http_response *mapped = NULL;
+	char *stored_vary = NULL, *vary = NULL;
+	time_t now = time(NULL);
+	int fresh = 0;
+
+	*hresp = NULL;
+	*conditional = NULL;
+	pthread_mutex_lock(&http_disk_lock);
+	if(http_disk_load() == 0 && (entry = http_disk_find(key)) != NULL)
+	{
+		mapped = http_disk_map(entry, &stored_vary, purl->arena);
+		if(mapped == NULL)
+		{
+			http_disk_remove(entry, 1);
+			http_disk_save();
+		}
+		else
+		{
+			entry->last_used = now;
+			fresh = now < entry->expires;
+		}
+	}
+	pthread_mutex_unlock(&http_disk_lock);
+	if(mapped == NULL)
+		return;
+
+	{
+		size_t len = 0;
+		const char *value = http_response_header_by_id(mapped, HTTP_HEADER_VARY, &len);
+		vary = http_cache_vary(value, value != NULL ? len : 0, http_headers);
+	}
+	if(vary != NULL && strcmp(vary, stored_vary) == 0)
+	{
+		if(fresh && !revalidate)
+		{
+			mapped->request_headers = http_headers;
+			mapped->request_uri = purl;
+			*hresp = mapped;
+			mapped = NULL;
+		}
+		else
+		{
+			*conditional = http_cache_conditional(http_headers, mapped);
+		}
+	}
+	free(vary);
+	http_response_discard(mapped);
+}
+
+/*
+	Serves a 304 answer from the disk cache like http_cache_revalidated, the new
+	freshness is saved in the index
+*/
+struct http_response* http_cache_disk_revalidated(const char *key, struct http_response *not_modified)
+{
+	struct http_disk_entry *entry;
+	struct http_response *mapped = NULL;
+	char *vary;
+
+	pthread_mutex_lock(&http_disk_lock);
+	if(http_disk_load() == 0 && (entry = http_disk_find(key)) != NULL && (mapped = http_disk_map(entry, &vary, not_modified->arena)) != NULL)
+	{
+		time_t now = time(NULL);
+		entry->last_used = now;
+		entry->expires = http_response_header_by_id(not_modified, HTTP_HEADER_CACHE_CONTROL, NULL) != NULL
+			? http_cache_expires(not_modified, now) : http_cache_expires(mapped, now);
+		http_disk_save();
+	}
+	pthread_mutex_unlock(&http_disk_lock);
+	if(mapped != NULL)
+	{
+		mapped->request_headers = not_modified->request_headers;
+		mapped->request_uri = not_modified->request_uri;
+		not_modified->request_headers = NULL;
+		not_modified->request_uri = NULL;
+		http_response_discard(not_modified);
+	}
+	return mapped;
+}
+
+/*
+	Writes a segment file, to a temporary file that replaces the segment once
+	complete. Returns the size of the segment, 0 on failure.
+*/
+size_t http_disk_write(const char *name, const char *key, const char *vary, struct http_response *hresp)
+{
+	struct http_disk_segment segment;
+	struct iovec iov[8];
+	char *path = http_disk_path(name, ".tmp");
+	char *final_path = http_disk_path(name, "");
+	size_t total = 0;
+	int fd, i, failed;
+
+	memset(&segment, 0, sizeof(segment));
+	memcpy(segment.magic, HTTP_DISK_MAGIC, 8);
+	segment.status_code_int = hresp->status_code_int;
+	segment.field_count = hresp->headers.count;
+	segment.key_len = strlen(key);
+	segment.vary_len = strlen(vary);
+	segment.status_text_len = strlen(hresp->status_text);
+	segment.headers_len = strlen(hresp->response_headers);
+	segment.body_len = hresp->body_len;
+	segment.encoded_len = hresp->encoded_len;
+
+	iov[0].iov_base = &segment;
+	iov[0].iov_len = sizeof(segment);
+	iov[1].iov_base = hresp->headers.fields;
+	iov[1].iov_len = hresp->headers.count * sizeof(struct http_header);
+	iov[2].iov_base = (void*)key;
+	iov[2].iov_len = segment.key_len + 1;
+	iov[3].iov_base = (void*)vary;
+	iov[3].iov_len = segment.vary_len + 1;
+	iov[4].iov_base = hresp->status_code;
+	iov[4].iov_len = 4;
+	iov[5].iov_base = hresp->status_text;
+	iov[5].iov_len = segment.status_text_len + 1;
+	iov[6].iov_base = hresp->response_headers;
+	iov[6].iov_len = segment.headers_len + 1;
+	iov[7].iov_base = hresp->body;
+	iov[7].iov_len = segment.body_len + 1;
+	for(i = 0; i < 8; i++)
+		total += iov[i].iov_len;
+
+	fd = path != NULL && final_path != NULL ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	failed = fd < 0;
+	for(i = 0; !failed && i < 8; i++)
+	{
+		const char *data = (const char*)iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while(left > 0)
+		{
+			ssize_t n = write(fd, data, left);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+			{
+				failed = 1;
+				break;
+			}
+			data += n;
+			left -= n;
+		}
+	}
+	if(fd >= 0 && close(fd) != 0)
+		failed = 1;
+	if(!failed && rename(path, final_path) != 0)
+		failed = 1;
+	if(failed && path != NULL)
+		unlink(path);
+	free(path);
+	free(final_path);
+	return failed ? 0 : total;
+}
+
+/*
+	Stores a response in the disk cache, replacing the segment stored before
+*/
+void http_cache_disk_store(const char *key, const char *http_headers, struct http_response *hresp)
+{
+	struct http_disk_entry *entry, *old;
+	const char *value;
+	char *vary;
+	size_t len = 0;
+	unsigned long long hash = 14695981039346656037ULL;
+	const char *c;
+
+	if(!http_cache_storable(hresp) || hresp->body == NULL || strchr(key, '\n') != NULL)
+		return;
+	value = http_response_header_by_id(hresp, HTTP_HEADER_VARY, &len);
+	vary = http_cache_vary(value, value != NULL ? len : 0, http_headers);
+	entry = (struct http_disk_entry*)calloc(1, sizeof(struct http_disk_entry));
+	if(vary == NULL || entry == NULL || (entry->key = str_dup(key)) == NULL)
+	{
+		free(vary);
+		free(entry);
+		return;
+	}
+	for(c = key; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+	sprintf(entry->name, "%016llx", hash);
+	entry->last_used = time(NULL);
+	entry->expires = http_cache_expires(hresp, entry->last_used);
+
+	pthread_mutex_lock(&http_disk_lock);
+	if(http_disk_load() == 0)
+	{
+		old = http_disk_find(key);
+		if(old != NULL)
+			http_disk_remove(old, 0);		/* the segment is replaced below */
+		entry->size = http_disk_write(entry->name, key, vary, hresp);
+		if(entry->size > 0 && (long long)entry->size <= http_cache_disk_max_bytes)
+		{
+			http_disk_evict(entry->size);
+			http_disk_insert(entry);
+			entry = NULL;
+		}
+		else
+		{
+			/* Too large for the budget, or the write failed */
+			char *path = http_disk_path(entry->name, "");
+			if(path != NULL)
+				unlink(path);
+			free(path);
+		}
+		http_disk_save();
+	}
+	pthread_mutex_unlock(&http_disk_lock);
+	if(entry != NULL)
+	{
+		free(entry->key);
+		free(entry);
+	}
+	free(vary);
+}
+
+/*
+	Empties the disk cache, the segments and the index are deleted
+*/
+void http_cache_disk_flush()
+{
+	int i;
+	pthread_mutex_lock(&http_disk_lock);
+	if(http_cache_dir != NULL && http_disk_load() == 0)
+	{
+		for(i = 0; i < HTTP_CACHE_BUCKETS; i++)
+		{
+			while(http_disk_table[i] != NULL)
+				http_disk_remove(http_disk_table[i], 1);
+		}
+		http_disk_save();
+	}
+	pthread_mutex_unlock(&http_disk_lock);
+}
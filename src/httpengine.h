@@ -0,0 +1,1582 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+/*
+	Event driven engine that runs many requests at once from a single thread,
+	on non-blocking sockets and epoll. Only available on Linux.
+*/
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/*
+	Requests written back to back on one connection before their responses arrive,
+	1 disables pipelining. Only idempotent requests are pipelined.
+*/
+int http_pipeline_depth = 1;
+
+/*
+	Called when a request completes, hresp is NULL when it failed. The callback
+	owns the response and frees it with http_response_free.
+*/
+typedef void (*http_engine_callback)(struct http_response *hresp, enum http_error error, void *user);
+
+/*
+	States of a request in the engine
+*/
+enum http_engine_state
+{
+	HTTP_ENGINE_CONNECTING,
+	HTTP_ENGINE_HANDSHAKE,
+	HTTP_ENGINE_SENDING,
+	HTTP_ENGINE_RECEIVING,
+	HTTP_ENGINE_PIPELINED,			/* queued behind another request on its connection */
+	HTTP_ENGINE_HTTP2,				/* drives the HTTP/2 connection its stream is on */
+	HTTP_ENGINE_RESOLVING			/* waits for its host name to be resolved */
+};
+
+struct http_engine;
+
+/*
+	Wakes an engine up from epoll_wait when a host name it waits for is resolved.
+	The lookups still running hold a reference, so it outlives the engine.
+*/
+struct http_engine_wakeup
+{
+	int fd;							/* eventfd registered with the epoll of the engine */
+	int refs;
+};
+
+/*
+	A host name being resolved on another thread for the requests of an engine
+*/
+struct http_engine_lookup
+{
+	char *host;
+	int done;						/* the answer is in the DNS cache */
+	int refs;						/* the resolver thread and the requests waiting */
+	struct http_engine_wakeup *wakeup;
+};
+
+pthread_mutex_t http_engine_lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	A request in flight
+*/
+struct http_engine_request
+{
+	struct http_engine *engine;
+	enum http_engine_state state;
+	char *http_headers;
+	size_t headers_len;
+	size_t sent;
+	size_t received;
+	int attempt;
+	int pipelining;					/* may share a connection with other requests in flight */
+	int multiplex;					/* may wait for a connection that could speak HTTP/2 */
+	int lost;						/* may have been processed by a server that went away */
+	struct parsed_url *purl;
+	struct http_connection *conn;
+	struct http_engine_request *pipeline;	/* next request sent on the same connection */
+	struct http2_stream *stream;	/* set when sent on a HTTP/2 connection */
+	struct http_engine_lookup *lookup;	/* set while its host name is resolved */
+	long long deadline;				/* the request fails after this time, 0 for never */
+	long long connect_deadline;		/* its connection must be open by then, 0 for never */
+	long long active_at;			/* when its connection was last ready, for http_read_timeout */
+	struct http_req_context context;
+	http_engine_callback callback;
+	void *user;
+	struct http_engine_request *prev;
+	struct http_engine_request *next;
+};
+
+/*
+	Represents the engine
+*/
+struct http_engine
+{
+	int epfd;
+	int active;							/* requests in flight */
+	struct http_engine_request *requests;
+	struct http_engine_wakeup *wakeup;	/* created for the first lookup */
+};
+
+/*
+	Creates an engine, returns NULL on failure
+*/
+struct http_engine* http_engine_new()
+{
+	struct http_engine *engine = (struct http_engine*)malloc(sizeof(struct http_engine));
+	if(engine == NULL)
+		return NULL;
+	engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(engine->epfd < 0)
+	{
+		free(engine);
+		return NULL;
+	}
+	engine->active = 0;
+	engine->requests = NULL;
+	engine->wakeup = NULL;
+	return engine;
+}
+
+/*
+	Drops a reference to the wakeup of an engine, the lock must be held
+*/
+void http_engine_wakeup_release(struct http_engine_wakeup *wakeup)
+{
+	if(--wakeup->refs == 0)
+	{
+		close(wakeup->fd);
+		free(wakeup);
+	}
+}
+
+/*
+	Drops a reference to a lookup
+*/
+void http_engine_lookup_release(struct http_engine_lookup *lookup)
+{
+	pthread_mutex_lock(&http_engine_lookup_lock);
+	if(--lookup->refs == 0)
+	{
+		http_engine_wakeup_release(lookup->wakeup);
+		free(lookup->host);
+		free(lookup);
+	}
+	pthread_mutex_unlock(&http_engine_lookup_lock);
+}
+
+/*
+	Called on the resolver thread once the answer of a lookup is in the DNS cache,
+	wakes the engine up
+*/
+void http_engine_lookup_done(void *user)
+{
+	struct http_engine_lookup *lookup = (struct http_engine_lookup*)user;
+	uint64_t one = 1;
+	pthread_mutex_lock(&http_engine_lookup_lock);
+	lookup->done = 1;
+	if(write(lookup->wakeup->fd, &one, sizeof(one)) < 0)
+		printf("Unable to wake up the engine");
+	pthread_mutex_unlock(&http_engine_lookup_lock);
+	http_engine_lookup_release(lookup);
+}
+
+/*
+	Resolves the host name of a request on another thread, or lets the request
+	wait for a lookup of the same host that is running. Returns 0 when the
+	request waits and -1 when no lookup could be started.
+*/
+int http_engine_resolve(struct http_engine_request *req)
+{
+	struct http_engine *engine = req->engine;
+	struct http_engine_request *other;
+	struct http_engine_lookup *lookup;
+
+	pthread_mutex_lock(&http_engine_lookup_lock);
+	for(other = engine->requests; other != NULL; other = other->next)
+	{
+		if(other != req && other->lookup != NULL && !other->lookup->done
+			&& strcasecmp(other->lookup->host, req->purl->host) == 0)
+		{
+			req->lookup = other->lookup;
+			req->lookup->refs++;
+			pthread_mutex_unlock(&http_engine_lookup_lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&http_engine_lookup_lock);
+
+	if(engine->wakeup == NULL)
+	{
+		struct http_engine_wakeup *wakeup = (struct http_engine_wakeup*)malloc(sizeof(struct http_engine_wakeup));
+		struct epoll_event ev;
+		if(wakeup == NULL)
+			return -1;
+		wakeup->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		wakeup->refs = 1;
+		ev.events = EPOLLIN;
+		ev.data.ptr = wakeup;
+		if(wakeup->fd < 0 || epoll_ctl(engine->epfd, EPOLL_CTL_ADD, wakeup->fd, &ev) < 0)
+		{
+			if(wakeup->fd >= 0)
+				close(wakeup->fd);
+			free(wakeup);
+			return -1;
+		}
+		engine->wakeup = wakeup;
+	}
+
+	lookup = (struct http_engine_lookup*)malloc(sizeof(struct http_engine_lookup));
+	if(lookup == NULL)
+		return -1;
+	lookup->host = str_dup(req->purl->host);
+	lookup->done = 0;
+	lookup->refs = 2;
+	lookup->wakeup = engine->wakeup;
+	pthread_mutex_lock(&http_engine_lookup_lock);
+	engine->wakeup->refs++;
+	pthread_mutex_unlock(&http_engine_lookup_lock);
+	if(lookup->host == NULL || http_dns_lookup_async(lookup->host, http_engine_lookup_done, lookup) < 0)
+	{
+		pthread_mutex_lock(&http_engine_lookup_lock);
+		http_engine_wakeup_release(lookup->wakeup);
+		pthread_mutex_unlock(&http_engine_lookup_lock);
+		free(lookup->host);
+		free(lookup);
+		return -1;
+	}
+	req->lookup = lookup;
+	return 0;
+}
+
+/*
+	Changes the events a request waits for
+*/
+void http_engine_want(struct http_engine_request *req, unsigned int events)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = req;
+	epoll_ctl(req->engine->epfd, EPOLL_CTL_MOD, req->conn->sock, &ev);
+}
+
+/*
+	Registers the connection of a request with epoll
+*/
+int http_engine_watch(struct http_engine_request *req, unsigned int events)
+{
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = req;
+	return epoll_ctl(req->engine->epfd, EPOLL_CTL_ADD, req->conn->sock, &ev);
+}
+
+int http_engine_start(struct http_engine_request *req);
+int http_engine_pipeline(struct http_engine_request *req);
+int http_engine_multiplex(struct http_engine_request *req);
+int http_engine_idempotent(const char *http_headers);
+void http_engine_complete(struct http_engine_request *req, enum http_error error);
+
+/*
+	Returns whether the request of req or of a request queued behind it still has
+	to be written
+*/
+int http_engine_pipeline_pending(struct http_engine_request *req)
+{
+	for(; req != NULL; req = req->pipeline)
+	{
+		if(req->sent < req->headers_len)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Passes the connection of a completed request to the next request of its
+	pipeline, whose response is the next one on the connection
+*/
+void http_engine_hand_over(struct http_engine_request *req, struct http_engine_request *next)
+{
+	next->conn = req->conn;
+	next->active_at = http_time_ms();
+	if(next->conn->h2 != NULL)
+	{
+		next->state = HTTP_ENGINE_HTTP2;
+		http_engine_want(next, EPOLLIN | EPOLLOUT);
+	}
+	else if(http_engine_pipeline_pending(next))
+	{
+		next->state = HTTP_ENGINE_SENDING;
+		http_engine_want(next, EPOLLOUT);
+	}
+	else
+	{
+		next->state = HTTP_ENGINE_RECEIVING;
+		http_engine_want(next, EPOLLIN);
+	}
+}
+
+/*
+	Ends the HTTP/2 stream of a request, if it has one
+*/
+void http_engine_drop_stream(struct http_engine_request *req)
+{
+	if(req->stream == NULL)
+		return;
+	/* Unless the server refused it, a request that is not idempotent must not be sent twice */
+	req->lost = !req->stream->refused && !http_engine_idempotent(req->http_headers);
+	http2_stream_close(req->stream);
+	req->stream = NULL;
+}
+
+/*
+	Sends the requests of a pipeline whose connection failed again, each on a
+	connection of its own
+*/
+void http_engine_restart(struct http_engine_request *req)
+{
+	while(req != NULL)
+	{
+		struct http_engine_request *next = req->pipeline;
+		req->pipeline = NULL;
+		req->pipelining = 0;
+		req->multiplex = 0;
+		req->sent = 0;
+		req->conn = NULL;
+		http_engine_drop_stream(req);
+		if(req->lost)
+			http_engine_complete(req, HTTP_ERROR_RECV);
+		else if(http_engine_start(req) < 0)
+			http_engine_complete(req, http_connection_start_error(req->purl));
+		req = next;
+	}
+}
+
+/*
+	Removes a request from the pipeline it is queued in
+*/
+void http_engine_unlink(struct http_engine_request *req)
+{
+	struct http_engine_request *other, *prev;
+	for(other = req->engine->requests; other != NULL; other = other->next)
+	{
+		if(other->conn == NULL)
+			continue;
+		for(prev = other; prev->pipeline != NULL; prev = prev->pipeline)
+		{
+			if(prev->pipeline == req)
+			{
+				prev->pipeline = req->pipeline;
+				req->pipeline = NULL;
+				return;
+			}
+		}
+	}
+}
+
+/*
+	Lets go of the connection of a request. The next request of its pipeline takes
+	the connection over while it is usable, otherwise the connection is returned to
+	the pool or closed and the requests queued on it are sent again.
+*/
+void http_engine_release(struct http_engine_request *req, enum http_error error)
+{
+	struct http_engine *engine = req->engine;
+	struct http_engine_request *next = req->pipeline, *other;
+	struct http2_session *session = req->conn->h2;
+	int reusable = session != NULL ? !session->dead : error == HTTP_ERROR_NONE && req->context.parser.keep_alive;
+
+	req->pipeline = NULL;
+	if(next != NULL && reusable)
+	{
+		/* The next request of the pipeline takes over the connection */
+		http_engine_hand_over(req, next);
+		next = NULL;
+	}
+	else
+	{
+		/* The streams of the requests queued on the connection go away with it */
+		for(other = next; other != NULL; other = other->pipeline)
+			http_engine_drop_stream(other);
+		epoll_ctl(engine->epfd, EPOLL_CTL_DEL, req->conn->sock, NULL);
+		if(reusable && (session == NULL || !session->goaway) && http_connection_set_nonblocking(req->conn, 0) == 0)
+			http_pool_checkin(req->conn);
+		else
+			http_connection_close(req->conn);
+	}
+	req->conn = NULL;
+
+	/* The connection is gone, the requests queued on it are sent again one at a time */
+	if(next != NULL && error != HTTP_ERROR_ABORTED)
+		http_engine_restart(next);
+}
+
+/*
+	Removes a request from the engine and reports the result
+*/
+void http_engine_complete(struct http_engine_request *req, enum http_error error)
+{
+	struct http_engine *engine = req->engine;
+	struct http_response *hresp;
+
+	/* A request queued behind another one leaves the pipeline */
+	if(req->conn == NULL && req->state == HTTP_ENGINE_PIPELINED)
+		http_engine_unlink(req);
+	http_engine_drop_stream(req);
+	if(req->conn != NULL)
+		http_engine_release(req, error);
+	if(req->lookup != NULL)
+		http_engine_lookup_release(req->lookup);
+
+	if(req->prev != NULL)
+		req->prev->next = req->next;
+	else
+		engine->requests = req->next;
+	if(req->next != NULL)
+		req->next->prev = req->prev;
+	engine->active--;
+
+	if(error != HTTP_ERROR_NONE && req->context.parser.state == HTTP_PARSER_DONE)
+		req->context.parser.state = HTTP_PARSER_ERROR;
+	hresp = http_req_context_finish(&req->context);
+	if(hresp == NULL)
+	{
+		/* The response did not take ownership */
+		http_request_free(req->http_headers, req->purl);
+		if(error == HTTP_ERROR_NONE)
+			error = HTTP_ERROR_PROTOCOL;
+	}
+	if(req->callback != NULL)
+		req->callback(hresp, error, req->user);
+	else
+		http_response_free(hresp);
+	free(req);
+}
+
+/*
+	Registers the sockets of a connection that is being opened with epoll, one per
+	connection attempt that is in progress
+*/
+int http_engine_watch_connect(struct http_engine_request *req)
+{
+	struct http_connect_race *race = req->conn->race;
+	int i;
+
+	if(race == NULL)
+		return (http_engine_watch(req, EPOLLOUT) < 0 && errno != EEXIST) ? -1 : 0;
+	for(i = 0; i < race->count; i++)
+	{
+		struct epoll_event ev;
+		if(race->socks[i] < 0)
+			continue;
+		ev.events = EPOLLOUT;
+		ev.data.ptr = req;
+		if(epoll_ctl(req->engine->epfd, EPOLL_CTL_ADD, race->socks[i], &ev) < 0 && errno != EEXIST)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+	Starts opening a new connection for a request whose host name resolves without
+	waiting, returns -1 when that is not possible
+*/
+int http_engine_open(struct http_engine_request *req)
+{
+	req->conn = http_connection_start(req->purl);
+	if(req->conn == NULL)
+		return -1;
+	req->state = HTTP_ENGINE_CONNECTING;
+	return http_engine_watch_connect(req);
+}
+
+/*
+	Opens a new connection for a request, returns -1 when that is not possible.
+	The resolver blocks, so a host name that is not in the DNS cache is resolved
+	on another thread first while the engine goes on.
+*/
+int http_engine_connect(struct http_engine_request *req)
+{
+	req->connect_deadline = http_deadline_min(req->deadline, http_deadline(http_connect_timeout));
+	if(!http_dns_ready(req->purl->host) && http_engine_resolve(req) == 0)
+	{
+		req->state = HTTP_ENGINE_RESOLVING;
+		return 0;
+	}
+	return http_engine_open(req);
+}
+
+/*
+	Handles a failure on the connection. A reused connection that fails before any
+	response data arrived was closed by the server while idle, the request is then
+	retried once on a new connection, unless it is not idempotent and was already
+	partly sent.
+*/
+void http_engine_fail(struct http_engine_request *req, enum http_error error)
+{
+	if(req->conn->reused && req->received == 0 && req->attempt == 0
+		&& (req->sent == 0 || http_engine_idempotent(req->http_headers)))
+	{
+		struct http_engine_request *queued = req->pipeline, *other;
+		for(other = req; other != NULL; other = other->pipeline)
+			http_engine_drop_stream(other);
+		req->lost = 0;
+		epoll_ctl(req->engine->epfd, EPOLL_CTL_DEL, req->conn->sock, NULL);
+		http_connection_close(req->conn);
+		req->conn = NULL;
+		req->pipeline = NULL;
+		req->pipelining = 0;
+		req->attempt++;
+		req->sent = 0;
+		http_engine_restart(queued);
+		if(http_engine_connect(req) == 0)
+			return;
+		error = http_connection_start_error(req->purl);
+	}
+	http_engine_complete(req, error);
+}
+
+/*
+	Handles a failed write of the request out on the connection of req. When out
+	is queued behind req, the server may have closed the connection after
+	answering the earlier requests: those responses are still read, out and the
+	requests behind it are sent again on connections of their own.
+*/
+void http_engine_send_failed(struct http_engine_request *req, struct http_engine_request *out)
+{
+	struct http_engine_request *prev;
+	if(out == req)
+	{
+		http_engine_fail(req, HTTP_ERROR_SEND);
+		return;
+	}
+	for(prev = req; prev->pipeline != out; prev = prev->pipeline)
+		;
+	prev->pipeline = NULL;
+	req->pipelining = 0;
+	req->state = HTTP_ENGINE_RECEIVING;
+	http_engine_want(req, EPOLLIN);
+	http_engine_restart(out);
+}
+
+/*
+	Maps the result of a non-blocking TLS call to the events to wait for,
+	returns 0 when the call has to be retried later and -1 on failure.
+*/
+int http_engine_ssl_wait(struct http_engine_request *req, int result)
+{
+	switch(SSL_get_error(req->conn->ssl, result))
+	{
+		case SSL_ERROR_WANT_READ:
+			http_engine_want(req, EPOLLIN);
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			http_engine_want(req, EPOLLOUT);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/*
+	Feeds received bytes to the parser of a request. Bytes after the end of its
+	response belong to the next request of the pipeline, which is fed in turn.
+	Returns the request that is still receiving on the connection, NULL when
+	there is none.
+*/
+struct http_engine_request* http_engine_deliver(struct http_engine_request *req, const char *data, size_t len)
+{
+	while(req != NULL)
+	{
+		struct http_parser *parser = &req->context.parser;
+		struct http_engine_request *next = req->pipeline;
+		size_t used = http_parser_execute(parser, data, len);
+
+		req->received += len;
+		if(parser->state == HTTP_PARSER_ERROR)
+		{
+			http_engine_complete(req, HTTP_ERROR_PROTOCOL);
+			return NULL;
+		}
+		if(parser->state != HTTP_PARSER_DONE)
+			return req;
+		if(used < len && next == NULL)
+			parser->keep_alive = 0;		/* unexpected bytes after the response */
+		http_engine_complete(req, HTTP_ERROR_NONE);
+		if(next == NULL || next->conn == NULL)
+			return NULL;
+		req = next;
+		data += used;
+		len -= used;
+		if(len == 0)
+			return NULL;
+	}
+	return NULL;
+}
+
+/*
+	Sets up a new connection once it is established. When it speaks HTTP/2 the
+	requests waiting for it are sent as streams, otherwise the requests that may
+	not be pipelined on it are sent on connections of their own. Returns -1 when
+	req failed.
+*/
+int http_engine_ready(struct http_engine_request *req)
+{
+	struct http_engine_request *other, **link;
+	int depth = 1;
+
+	if(http2_connection_setup(req->conn) < 0)
+	{
+		http_engine_complete(req, HTTP_ERROR_MEMORY);
+		return -1;
+	}
+	if(req->conn->h2 != NULL)
+	{
+		req->state = HTTP_ENGINE_HTTP2;
+		for(other = req; other != NULL; other = other->pipeline)
+			other->stream = http2_session_submit(req->conn->h2, other->http_headers, NULL, &other->context.parser);
+		return 0;
+	}
+
+	req->state = HTTP_ENGINE_SENDING;
+	link = &req->pipeline;
+	while(*link != NULL)
+	{
+		other = *link;
+		if(other->pipelining && ++depth <= http_pipeline_depth)
+		{
+			link = &other->pipeline;
+			continue;
+		}
+		*link = other->pipeline;
+		other->pipeline = NULL;
+		http_engine_restart(other);
+	}
+	return 0;
+}
+
+/*
+	Returns whether a request on a HTTP/2 connection is over
+*/
+int http_engine_http2_done(struct http_engine_request *req, struct http2_session *session)
+{
+	return req->stream == NULL || req->stream->closed || session->dead || req->context.parser.state == HTTP_PARSER_ERROR;
+}
+
+/*
+	Completes a request on a HTTP/2 connection whose stream is over. A request the
+	server did not process is sent again.
+*/
+void http_engine_http2_finish(struct http_engine_request *req, struct http2_session *session)
+{
+	struct http_parser *parser = &req->context.parser;
+	struct http2_stream *stream = req->stream;
+
+	if(parser->state == HTTP_PARSER_DONE)
+	{
+		http_engine_complete(req, HTTP_ERROR_NONE);
+		return;
+	}
+	if(parser->state == HTTP_PARSER_ERROR || stream == NULL)
+	{
+		http_engine_complete(req, HTTP_ERROR_PROTOCOL);
+		return;
+	}
+	if(req->attempt == 0 && (stream->refused || (session->dead && parser->state == HTTP_PARSER_STATUS_LINE
+		&& parser->head.len == 0 && http_engine_idempotent(req->http_headers))))
+	{
+		req->attempt++;
+		http_engine_drop_stream(req);
+		if(req->conn != NULL)
+			http_engine_release(req, HTTP_ERROR_NONE);
+		http_engine_restart(req);
+		return;
+	}
+	http_engine_complete(req, session->dead ? HTTP_ERROR_RECV : HTTP_ERROR_PROTOCOL);
+}
+
+/*
+	Reads and writes the frames of a HTTP/2 connection, then completes the
+	requests on it whose stream is over. req owns the connection, the other
+	requests on it are queued behind req.
+*/
+void http_engine_http2_step(struct http_engine_request *req)
+{
+	struct http_connection *conn = req->conn;
+	struct http2_session *session = conn->h2;
+	struct http_engine_request **link;
+	char BUF[BUFSIZ];
+
+	/* Read what arrived */
+	while(!session->dead)
+	{
+		long n;
+		if(conn->ishttps)
+		{
+			n = SSL_read(conn->ssl, BUF, BUFSIZ);
+			if(n <= 0)
+			{
+				int ssl_error = SSL_get_error(conn->ssl, n);
+				if(ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE)
+					break;
+			}
+		}
+		else
+		{
+			n = recv(conn->sock, BUF, BUFSIZ, 0);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+		}
+		if(n <= 0)
+		{
+			session->dead = 1;
+			break;
+		}
+		req->received += n;
+		http2_session_feed(session, BUF, n);
+	}
+
+	/* Write the frames that are queued */
+	while(!session->dead && session->out.len > 0)
+	{
+		long n;
+		if(conn->ishttps)
+		{
+			n = SSL_write(conn->ssl, session->out.data, session->out.len);
+			if(n <= 0)
+			{
+				int ssl_error = SSL_get_error(conn->ssl, n);
+				if(ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE)
+					session->dead = 1;
+				break;
+			}
+		}
+		else
+		{
+			n = send(conn->sock, session->out.data, session->out.len, MSG_NOSIGNAL);
+			if(n < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				if(errno != EAGAIN && errno != EWOULDBLOCK)
+					session->dead = 1;
+				break;
+			}
+		}
+		memmove(session->out.data, session->out.data + n, session->out.len - n);
+		session->out.len -= n;
+	}
+
+	/* Complete the requests queued behind req first, req keeps the connection meanwhile */
+	link = &req->pipeline;
+	while(*link != NULL)
+	{
+		struct http_engine_request *other = *link;
+		if(!http_engine_http2_done(other, session))
+		{
+			link = &other->pipeline;
+			continue;
+		}
+		*link = other->pipeline;
+		other->pipeline = NULL;
+		http_engine_http2_finish(other, session);
+	}
+	if(http_engine_http2_done(req, session))
+		http_engine_http2_finish(req, session);
+	else
+		http_engine_want(req, EPOLLIN | (session->out.len > 0 ? (unsigned int)EPOLLOUT : 0u));
+}
+
+/*
+	Advances a request as far as possible without blocking
+*/
+void http_engine_step(struct http_engine_request *req)
+{
+	struct http_connection *conn = req->conn;
+	struct http_parser *parser = &req->context.parser;
+
+	for(;;)
+	{
+		switch(req->state)
+		{
+			case HTTP_ENGINE_CONNECTING:
+			{
+				int result = http_connect_race_step(conn, 0);
+				if(result < 0)
+				{
+					http_engine_complete(req, HTTP_ERROR_CONNECT);
+					return;
+				}
+				if(http_engine_watch_connect(req) < 0)
+				{
+					http_engine_complete(req, HTTP_ERROR_CONNECT);
+					return;
+				}
+				if(result == 0)
+					return;
+				if(http_connection_tls_setup(conn) < 0)
+				{
+					http_engine_complete(req, HTTP_ERROR_TLS);
+					return;
+				}
+				if(conn->ishttps)
+					req->state = HTTP_ENGINE_HANDSHAKE;
+				else if(http_engine_ready(req) < 0)
+					return;
+				break;
+			}
+			case HTTP_ENGINE_HANDSHAKE:
+			{
+				int result = SSL_connect(conn->ssl);
+				if(result != 1)
+				{
+					if(http_engine_ssl_wait(req, result) < 0)
+						http_engine_complete(req, HTTP_ERROR_TLS);
+					return;
+				}
+				if(http_engine_ready(req) < 0)
+					return;
+				break;
+			}
+			case HTTP_ENGINE_SENDING:
+			{
+				/* Write this request and the ones queued behind it back to back */
+				struct http_engine_request *out = req;
+				while(out != NULL)
+				{
+					long n;
+					if(out->sent == out->headers_len)
+					{
+						out = out->pipeline;
+						continue;
+					}
+					if(conn->ishttps)
+					{
+						n = SSL_write(conn->ssl, out->http_headers + out->sent, out->headers_len - out->sent);
+						if(n <= 0)
+						{
+							if(http_engine_ssl_wait(req, n) < 0)
+								http_engine_send_failed(req, out);
+							return;
+						}
+					}
+					else
+					{
+						n = send(conn->sock, out->http_headers + out->sent, out->headers_len - out->sent, MSG_NOSIGNAL);
+						if(n < 0)
+						{
+							if(errno == EAGAIN || errno == EWOULDBLOCK)
+								http_engine_want(req, EPOLLOUT);
+							else if(errno != EINTR)
+								http_engine_send_failed(req, out);
+							if(errno != EINTR)
+								return;
+							continue;
+						}
+					}
+					out->sent += n;
+				}
+				req->state = HTTP_ENGINE_RECEIVING;
+				http_engine_want(req, EPOLLIN);
+				break;
+			}
+			case HTTP_ENGINE_RECEIVING:
+			{
+				char BUF[BUFSIZ];
+				long n;
+				if(conn->ishttps)
+				{
+					n = SSL_read(conn->ssl, BUF, BUFSIZ);
+					if(n <= 0)
+					{
+						if(http_connection_ssl_eof(conn, n))
+						{
+							n = 0;
+						}
+						else
+						{
+							if(http_engine_ssl_wait(req, n) < 0)
+								http_engine_fail(req, HTTP_ERROR_RECV);
+							return;
+						}
+					}
+				}
+				else
+				{
+					n = recv(conn->sock, BUF, BUFSIZ, 0);
+					if(n < 0)
+					{
+						if(errno == EINTR)
+							continue;
+						if(errno != EAGAIN && errno != EWOULDBLOCK)
+							http_engine_fail(req, HTTP_ERROR_RECV);
+						return;
+					}
+				}
+
+				if(n == 0)
+				{
+					/* Connection closed by the server */
+					if(http_parser_finish(parser) == 0)
+					{
+						parser->keep_alive = 0;
+						http_engine_complete(req, HTTP_ERROR_NONE);
+					}
+					else
+					{
+						http_engine_fail(req, HTTP_ERROR_RECV);
+					}
+					return;
+				}
+
+				if(http_engine_deliver(req, BUF, n) != req)
+					return;
+				break;
+			}
+			case HTTP_ENGINE_PIPELINED:
+				return;		/* driven by the request in front of it */
+			case HTTP_ENGINE_RESOLVING:
+				return;		/* the lookup wakes the engine up */
+			case HTTP_ENGINE_HTTP2:
+				http_engine_http2_step(req);
+				return;
+		}
+		conn = req->conn;
+	}
+}
+
+/*
+	Starts a request on an idle pooled connection. When there is none, the
+	request is sent as a stream on a HTTP/2 connection to the same host, a request
+	that is pipelining is queued behind a request in flight to the same host, if
+	possible, and a new connection is opened otherwise. Returns -1 when no
+	connection could be started.
+*/
+int http_engine_start(struct http_engine_request *req)
+{
+	/* Prefer an idle pooled connection, the request can be sent right away */
+	req->conn = http_pool_take(req->purl);
+	if(req->conn != NULL)
+	{
+		req->state = req->conn->h2 != NULL ? HTTP_ENGINE_HTTP2 : HTTP_ENGINE_SENDING;
+		if(http_connection_set_nonblocking(req->conn, 1) < 0 || http_engine_watch(req, EPOLLOUT) < 0)
+		{
+			http_connection_close(req->conn);
+			req->conn = NULL;
+		}
+		else if(req->conn->h2 != NULL)
+		{
+			req->stream = http2_session_submit(req->conn->h2, req->http_headers, NULL, &req->context.parser);
+		}
+	}
+	if(req->conn == NULL && http_engine_multiplex(req) == 0)
+		return 0;
+	if(req->conn == NULL && req->pipelining && http_engine_pipeline(req) == 0)
+		return 0;
+	if(req->conn == NULL && http_engine_connect(req) < 0)
+	{
+		if(req->conn != NULL)
+			http_connection_close(req->conn);
+		req->conn = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Returns whether a request may be pipelined, only idempotent methods are
+	because a request that was sent may have to be sent again
+*/
+int http_engine_idempotent(const char *http_headers)
+{
+	static const char *methods[] = { "GET ", "HEAD ", "OPTIONS ", "PUT ", "DELETE ", "TRACE " };
+	size_t i;
+	for(i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+	{
+		if(strncmp(http_headers, methods[i], strlen(methods[i])) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Queues a request behind the request in flight to the same host with the shortest
+	pipeline. Returns -1 when there is no such request with room in its pipeline.
+*/
+int http_engine_pipeline(struct http_engine_request *req)
+{
+	struct http_engine_request *best = NULL, *other, *tail;
+	int best_depth = http_pipeline_depth;
+
+	for(other = req->engine->requests; other != NULL; other = other->next)
+	{
+		struct http_parser *parser = &other->context.parser;
+		int depth = 0;
+		if(other->conn == NULL || !other->pipelining || other->conn->h2 != NULL
+			|| (parser->state != HTTP_PARSER_STATUS_LINE && !parser->keep_alive)
+			|| strcmp(other->purl->scheme, req->purl->scheme) != 0
+			|| strcasecmp(other->purl->host, req->purl->host) != 0 || strcmp(other->purl->port, req->purl->port) != 0)
+			continue;
+		for(tail = other; tail != NULL; tail = tail->pipeline)
+			depth++;
+		if(depth < best_depth)
+		{
+			best = other;
+			best_depth = depth;
+		}
+	}
+	if(best == NULL)
+		return -1;
+
+	for(tail = best; tail->pipeline != NULL; tail = tail->pipeline)
+		;
+	tail->pipeline = req;
+	req->state = HTTP_ENGINE_PIPELINED;
+	if(best->state == HTTP_ENGINE_RECEIVING)
+	{
+		/* Write the new request while the earlier responses arrive */
+		best->state = HTTP_ENGINE_SENDING;
+		http_engine_want(best, EPOLLOUT);
+	}
+	return 0;
+}
+
+/*
+	Returns whether a request in flight owns a HTTP/2 connection to the host of
+	the parsed url
+*/
+int http_engine_http2_host(struct http_engine *engine, struct parsed_url *purl)
+{
+	struct http_engine_request *other;
+	for(other = engine->requests; other != NULL; other = other->next)
+	{
+		if(other->state == HTTP_ENGINE_HTTP2 && strcmp(other->purl->scheme, purl->scheme) == 0
+			&& strcasecmp(other->purl->host, purl->host) == 0 && strcmp(other->purl->port, purl->port) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Sends a request as a new stream on a HTTP/2 connection to the same host.
+	When there is none, a request that may multiplex waits for a connection to the
+	host that is being opened and could turn out to speak HTTP/2. Returns -1 when
+	there is no such connection.
+*/
+int http_engine_multiplex(struct http_engine_request *req)
+{
+	struct http_engine_request *other, *tail;
+	struct http_engine_request *waiting = NULL;
+
+	for(other = req->engine->requests; other != NULL; other = other->next)
+	{
+		int depth = 0;
+		if(other->conn == NULL || strcmp(other->purl->scheme, req->purl->scheme) != 0
+			|| strcasecmp(other->purl->host, req->purl->host) != 0 || strcmp(other->purl->port, req->purl->port) != 0)
+			continue;
+		if(other->state == HTTP_ENGINE_HTTP2 && http2_session_available(other->conn->h2))
+		{
+			req->stream = http2_session_submit(other->conn->h2, req->http_headers, NULL, &req->context.parser);
+			if(req->stream == NULL)
+				return -1;
+			for(tail = other; tail->pipeline != NULL; tail = tail->pipeline)
+				;
+			tail->pipeline = req;
+			req->state = HTTP_ENGINE_PIPELINED;
+			http_engine_want(other, EPOLLIN | EPOLLOUT);
+			return 0;
+		}
+		if(!req->multiplex || !other->multiplex || waiting != NULL
+			|| (other->state != HTTP_ENGINE_CONNECTING && other->state != HTTP_ENGINE_HANDSHAKE))
+			continue;
+		for(tail = other; tail != NULL; tail = tail->pipeline)
+			depth++;
+		if(depth < HTTP2_MAX_STREAMS)
+			waiting = other;
+	}
+	if(waiting == NULL)
+		return -1;
+
+	for(tail = waiting; tail->pipeline != NULL; tail = tail->pipeline)
+		;
+	tail->pipeline = req;
+	req->state = HTTP_ENGINE_PIPELINED;
+	return 0;
+}
+
+/*
+	Adds a request to the engine, it is started right away. The engine takes
+	ownership of http_headers and purl, they end up in the response passed to
+	the callback. Redirects are not followed.
+	Returns 0 on success and -1 when the request could not be started.
+*/
+int http_engine_add(struct http_engine *engine, char *http_headers, struct parsed_url *purl, http_engine_callback callback, void *user)
+{
+	struct http_engine_request *req;
+
+	if(purl == NULL || http_headers == NULL)
+		return -1;
+	req = (struct http_engine_request*)malloc(sizeof(struct http_engine_request));
+	if(req == NULL)
+		return -1;
+	memset(req, 0, sizeof(struct http_engine_request));
+	req->engine = engine;
+	req->http_headers = http_headers;
+	req->headers_len = strlen(http_headers);
+	req->purl = purl;
+	req->callback = callback;
+	req->user = user;
+	req->pipelining = http_pipeline_depth > 1 && http_engine_idempotent(http_headers);
+	req->deadline = http_deadline(http_request_timeout);
+	req->connect_deadline = http_deadline_min(req->deadline, http_deadline(http_connect_timeout));
+	req->active_at = http_time_ms();
+	req->multiplex = strcmp(purl->scheme, "https") == 0 ? http_tls_alpn_h2 : http2_prior_knowledge;
+	if(http_req_context_init(&req->context, http_headers, purl, NULL) < 0)
+	{
+		free(req);
+		return -1;
+	}
+
+	if(http_engine_start(req) < 0)
+	{
+		http_parser_free(&req->context.parser);
+		if(req->context.hresp->arena == NULL)
+			free(req->context.hresp);
+		free(req);
+		return -1;
+	}
+
+	req->next = engine->requests;
+	if(engine->requests != NULL)
+		engine->requests->prev = req;
+	engine->requests = req;
+	engine->active++;
+	return 0;
+}
+
+/*
+	Adds a HTTP GET request for the given url to the engine
+*/
+int http_engine_get(struct http_engine *engine, char *url, char *custom_headers, http_engine_callback callback, void *user)
+{
+	char *http_headers;
+	struct parsed_url *purl = http_request_url(url, NULL);
+	if(purl == NULL)
+		return -1;
+	http_headers = http_build_get(purl, custom_headers);
+	if(http_engine_add(engine, http_headers, purl, callback, user) < 0)
+	{
+		http_request_free(http_headers, purl);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Gets the time a request times out at in its current state, 0 when it has no
+	limit. error receives the reason it then fails with.
+*/
+long long http_engine_due(struct http_engine_request *req, enum http_error *error)
+{
+	long long due = req->deadline;
+	*error = HTTP_ERROR_TIMEOUT_RECV;
+	switch(req->state)
+	{
+		case HTTP_ENGINE_RESOLVING:
+		case HTTP_ENGINE_CONNECTING:
+		case HTTP_ENGINE_HANDSHAKE:
+			*error = req->state != HTTP_ENGINE_HANDSHAKE ? HTTP_ERROR_TIMEOUT_CONNECT : HTTP_ERROR_TIMEOUT_TLS;
+			return http_deadline_min(due, req->connect_deadline);
+		case HTTP_ENGINE_SENDING:
+			*error = HTTP_ERROR_TIMEOUT_SEND;
+			return due;
+		case HTTP_ENGINE_RECEIVING:
+		case HTTP_ENGINE_HTTP2:
+			return http_read_timeout > 0 ? http_deadline_min(due, req->active_at + http_read_timeout) : due;
+		default:
+			return due;
+	}
+}
+
+/*
+	Fails the requests whose time is up. Completing a request can complete the
+	requests queued behind it, so the list is walked again after each one.
+*/
+void http_engine_expire(struct http_engine *engine)
+{
+	struct http_engine_request *req;
+	long long now = http_time_ms();
+	do
+	{
+		enum http_error error = HTTP_ERROR_NONE;
+		for(req = engine->requests; req != NULL; req = req->next)
+		{
+			long long due = http_engine_due(req, &error);
+			if(due != 0 && now >= due)
+				break;
+		}
+		if(req != NULL)
+			http_engine_complete(req, error);
+	}
+	while(req != NULL);
+}
+
+/*
+	Opens the connections of the requests whose host name was resolved
+*/
+void http_engine_resolved(struct http_engine *engine)
+{
+	struct http_engine_request *req, *next;
+	for(req = engine->requests; req != NULL; req = next)
+	{
+		int done;
+		next = req->next;
+		if(req->lookup == NULL)
+			continue;
+		pthread_mutex_lock(&http_engine_lookup_lock);
+		done = req->lookup->done;
+		pthread_mutex_unlock(&http_engine_lookup_lock);
+		if(!done)
+			continue;
+		http_engine_lookup_release(req->lookup);
+		req->lookup = NULL;
+		if(http_engine_open(req) < 0)
+		{
+			if(req->conn != NULL)
+				http_connection_close(req->conn);
+			req->conn = NULL;
+			http_engine_complete(req, http_connection_start_error(req->purl));
+		}
+	}
+}
+
+/*
+	Waits at most timeout_ms milliseconds (-1 waits forever) for activity and
+	advances the requests that are ready. Requests that run out of time fail with
+	the timeout error of the phase they are in. Returns the number of requests
+	still in flight.
+*/
+int http_engine_poll(struct http_engine *engine, int timeout_ms)
+{
+	struct epoll_event events[64];
+	struct http_engine_request *req;
+	long long now = http_time_ms();
+	int n, i, j, resolved = 0;
+
+	if(engine->active == 0)
+		return 0;
+
+	/* Wake up in time to start the next connection attempt of a request, or to fail it */
+	for(req = engine->requests; req != NULL; req = req->next)
+	{
+		enum http_error error;
+		long long due = http_engine_due(req, &error);
+		int wait;
+		if(due != 0)
+		{
+			wait = due > now ? (due - now > INT_MAX ? INT_MAX : (int)(due - now)) : 0;
+			if(timeout_ms < 0 || wait < timeout_ms)
+				timeout_ms = wait;
+		}
+		if(req->state != HTTP_ENGINE_CONNECTING)
+			continue;
+		wait = http_connect_race_timeout(req->conn);
+		if(wait >= 0 && (timeout_ms < 0 || wait < timeout_ms))
+			timeout_ms = wait;
+	}
+
+	n = epoll_wait(engine->epfd, events, 64, timeout_ms);
+	for(i = 0; i < n; i++)
+	{
+		if(engine->wakeup != NULL && events[i].data.ptr == engine->wakeup)
+		{
+			uint64_t count;
+			if(read(engine->wakeup->fd, &count, sizeof(count)) > 0)
+				resolved = 1;
+			continue;
+		}
+
+		/* A request racing several sockets may be reported more than once */
+		for(j = 0; j < i; j++)
+		{
+			if(events[j].data.ptr == events[i].data.ptr)
+				break;
+		}
+		if(j == i)
+		{
+			/* Only data from the server counts against http_read_timeout once the request is sent */
+			req = (struct http_engine_request*)events[i].data.ptr;
+			if((events[i].events & EPOLLIN) || (req->state != HTTP_ENGINE_RECEIVING && req->state != HTTP_ENGINE_HTTP2))
+				req->active_at = http_time_ms();
+			http_engine_step(req);
+		}
+	}
+
+	if(resolved)
+		http_engine_resolved(engine);
+
+	/* Start the connection attempts that are due */
+	for(req = engine->requests; req != NULL; )
+	{
+		struct http_engine_request *next = req->next;
+		if(req->state == HTTP_ENGINE_CONNECTING && http_connect_race_timeout(req->conn) == 0)
+			http_engine_step(req);
+		req = next;
+	}
+	http_engine_expire(engine);
+	return engine->active;
+}
+
+/*
+	Runs the engine until all requests have completed
+*/
+void http_engine_run(struct http_engine *engine)
+{
+	while(http_engine_poll(engine, -1) > 0)
+		;
+}
+
+/*
+	Cancels the requests still in flight and frees the engine, the callbacks
+	of cancelled requests are called with HTTP_ERROR_ABORTED.
+*/
+void http_engine_free(struct http_engine *engine)
+{
+	if(engine == NULL)
+		return;
+	while(engine->requests != NULL)
+		http_engine_complete(engine->requests, HTTP_ERROR_ABORTED);
+	if(engine->wakeup != NULL)
+	{
+		pthread_mutex_lock(&http_engine_lookup_lock);
+		http_engine_wakeup_release(engine->wakeup);
+		pthread_mutex_unlock(&http_engine_lookup_lock);
+	}
+	close(engine->epfd);
+	free(engine);
+}
+
+/*
+	State of a batch of requests run by http_req_many
+*/
+struct http_batch
+{
+	struct http_engine *engine;
+	int count;
+	int concurrency;
+	int in_flight;
+	int next;						/* first request that has not been started */
+	char **http_headers;
+	struct parsed_url **purls;
+	struct http_response **responses;
+	enum http_error *errors;
+	char *started;
+	int *host;						/* index of the first request to the same host */
+	int *host_in_flight;			/* requests in flight, by host index */
+};
+
+/*
+	Identifies a request of a batch in the engine callback
+*/
+struct http_batch_item
+{
+	struct http_batch *batch;
+	int index;
+};
+
+void http_batch_schedule(struct http_batch *batch, struct http_batch_item *items);
+
+/*
+	Stores the result of a request of a batch and starts the next ones
+*/
+void http_batch_done(struct http_response *hresp, enum http_error error, void *user)
+{
+	struct http_batch_item *item = (struct http_batch_item*)user;
+	struct http_batch *batch = item->batch;
+
+	batch->responses[item->index] = hresp;
+	batch->errors[item->index] = error;
+	batch->in_flight--;
+	batch->host_in_flight[batch->host[item->index]]--;
+	http_batch_schedule(batch, item - item->index);
+}
+
+/*
+	Starts requests until the concurrency limit is reached. At most
+	http_pool_max_per_host requests run against the same host at once, so that
+	later requests to that host reuse the connections of earlier ones instead of
+	opening more.
+*/
+void http_batch_schedule(struct http_batch *batch, struct http_batch_item *items)
+{
+	int per_host = http_pool_max_per_host > 0 ? http_pool_max_per_host : 1;
+	int i;
+
+	/* Requests beyond a connection per host are pipelined on those connections */
+	if(http_pipeline_depth > 1)
+		per_host *= http_pipeline_depth;
+
+	for(i = batch->next; i < batch->count && batch->in_flight < batch->concurrency; i++)
+	{
+		int host = batch->host[i];
+		int limit = per_host;
+		if(batch->started[i])
+			continue;
+
+		/* A host that speaks HTTP/2 takes many requests on one connection */
+		if(batch->host_in_flight[host] >= limit && http_engine_http2_host(batch->engine, batch->purls[i]))
+			limit = HTTP2_MAX_STREAMS;
+		if(batch->host_in_flight[host] >= limit)
+			continue;
+		batch->started[i] = 1;
+		if(http_engine_add(batch->engine, batch->http_headers[i], batch->purls[i], http_batch_done, &items[i]) < 0)
+		{
+			batch->errors[i] = http_connection_start_error(batch->purls[i]);
+			http_request_free(batch->http_headers[i], batch->purls[i]);
+			continue;
+		}
+		batch->in_flight++;
+		batch->host_in_flight[host]++;
+	}
+	while(batch->next < batch->count && batch->started[batch->next])
+		batch->next++;
+}
+
+/*
+	Makes many requests in parallel, at most concurrency at a time, and returns
+	their responses in the same order. http_headers and purls are arrays of count
+	requests as taken by http_req, ownership of them passes to the responses.
+	A response is NULL when its request failed, errors (when not NULL) receives
+	the reason of every request. The returned array is freed with free().
+*/
+struct http_response** http_req_many(char **http_headers, struct parsed_url **purls, int count, int concurrency, enum http_error *errors)
+{
+	struct http_batch batch;
+	struct http_batch_item *items;
+	int i, j;
+
+	if(count <= 0)
+		return NULL;
+	memset(&batch, 0, sizeof(batch));
+	batch.count = count;
+	batch.concurrency = concurrency > 0 ? concurrency : count;
+	batch.http_headers = http_headers;
+	batch.purls = purls;
+	batch.engine = http_engine_new();
+	batch.responses = (struct http_response**)calloc(count, sizeof(struct http_response*));
+	batch.errors = errors != NULL ? errors : (enum http_error*)malloc(count * sizeof(enum http_error));
+	batch.started = (char*)calloc(count, 1);
+	batch.host = (int*)malloc(count * sizeof(int));
+	batch.host_in_flight = (int*)calloc(count, sizeof(int));
+	items = (struct http_batch_item*)malloc(count * sizeof(struct http_batch_item));
+	if(batch.engine == NULL || batch.responses == NULL || batch.errors == NULL || batch.started == NULL
+		|| batch.host == NULL || batch.host_in_flight == NULL || items == NULL)
+	{
+		http_engine_free(batch.engine);
+		free(batch.responses);
+		if(errors == NULL)
+			free(batch.errors);
+		free(batch.started);
+		free(batch.host);
+		free(batch.host_in_flight);
+		free(items);
+		return NULL;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		items[i].batch = &batch;
+		items[i].index = i;
+		batch.errors[i] = HTTP_ERROR_NONE;
+		batch.host[i] = i;
+		if(purls[i] == NULL || http_headers[i] == NULL)
+		{
+			http_request_free(http_headers[i], purls[i]);
+			purls[i] = NULL;
+			batch.started[i] = 1;
+			batch.errors[i] = HTTP_ERROR_URL;
+			continue;
+		}
+
+		/* Group requests to the same (scheme, host, port) */
+		for(j = 0; j < i; j++)
+		{
+			if(purls[j] != NULL && strcmp(purls[j]->scheme, purls[i]->scheme) == 0
+				&& strcasecmp(purls[j]->host, purls[i]->host) == 0 && strcmp(purls[j]->port, purls[i]->port) == 0)
+			{
+				batch.host[i] = batch.host[j];
+				break;
+			}
+		}
+	}
+
+	http_batch_schedule(&batch, items);
+	http_engine_run(batch.engine);
+	http_engine_free(batch.engine);
+
+	if(errors == NULL)
+		free(batch.errors);
+	free(batch.started);
+	free(batch.host);
+	free(batch.host_in_flight);
+	free(items);
+	return batch.responses;
+}
+
+/*
+	Makes a HTTP GET request to every url in parallel, at most concurrency at a
+	time, and returns the responses in the same order as the urls. Hosts are
+	resolved through the DNS cache when they are first connected to. A response
+	is NULL when its request failed, errors (when not NULL) receives the reason
+	of every request. Redirects are not followed. The returned array is freed
+	with free().
+*/
+struct http_response** http_get_many(char **urls, int count, char *custom_headers, int concurrency, enum http_error *errors)
+{
+	struct http_response **responses;
+	struct parsed_url **purls;
+	char **http_headers;
+	int i;
+
+	if(count <= 0)
+		return NULL;
+	purls = (struct parsed_url**)calloc(count, sizeof(struct parsed_url*));
+	http_headers = (char**)calloc(count, sizeof(char*));
+	if(purls == NULL || http_headers == NULL)
+	{
+		free(purls);
+		free(http_headers);
+		return NULL;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		purls[i] = http_request_url(urls[i], NULL);
+		if(purls[i] == NULL)
+			continue;
+		http_headers[i] = http_build_get(purls[i], custom_headers);
+	}
+
+	responses = http_req_many(http_headers, purls, count, concurrency, errors);
+	if(responses == NULL)
+	{
+		for(i = 0; i < count; i++)
+		{
+			http_request_free(http_headers[i], purls[i]);
+		}
+	}
+	free(purls);
+	free(http_headers);
+	return responses;
+}
+
+#endif
@@ -0,0 +1,256 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+/*
+	Well-known header names, recognized with a perfect hash
+*/
+enum http_header_id
+{
+	HTTP_HEADER_OTHER = 0,
+	HTTP_HEADER_ACCEPT_RANGES,
+	HTTP_HEADER_AGE,
+	HTTP_HEADER_ALLOW,
+	HTTP_HEADER_ALT_SVC,
+	HTTP_HEADER_CACHE_CONTROL,
+	HTTP_HEADER_CONNECTION,
+	HTTP_HEADER_CONTENT_DISPOSITION,
+	HTTP_HEADER_CONTENT_ENCODING,
+	HTTP_HEADER_CONTENT_LANGUAGE,
+	HTTP_HEADER_CONTENT_LENGTH,
+	HTTP_HEADER_CONTENT_LOCATION,
+	HTTP_HEADER_CONTENT_RANGE,
+	HTTP_HEADER_CONTENT_TYPE,
+	HTTP_HEADER_DATE,
+	HTTP_HEADER_ETAG,
+	HTTP_HEADER_EXPIRES,
+	HTTP_HEADER_KEEP_ALIVE,
+	HTTP_HEADER_LAST_MODIFIED,
+	HTTP_HEADER_LINK,
+	HTTP_HEADER_LOCATION,
+	HTTP_HEADER_PRAGMA,
+	HTTP_HEADER_PROXY_AUTHENTICATE,
+	HTTP_HEADER_RETRY_AFTER,
+	HTTP_HEADER_SERVER,
+	HTTP_HEADER_SET_COOKIE,
+	HTTP_HEADER_STRICT_TRANSPORT_SECURITY,
+	HTTP_HEADER_TRAILER,
+	HTTP_HEADER_TRANSFER_ENCODING,
+	HTTP_HEADER_UPGRADE,
+	HTTP_HEADER_VARY,
+	HTTP_HEADER_VIA,
+	HTTP_HEADER_WARNING,
+	HTTP_HEADER_WWW_AUTHENTICATE,
+	HTTP_HEADER_COUNT
+};
+
+/*
+	Names of the well-known headers, by id
+*/
+const char *http_header_names[HTTP_HEADER_COUNT] =
+{
+	"",
+	"Accept-Ranges",
+	"Age",
+	"Allow",
+	"Alt-Svc",
+	"Cache-Control",
+	"Connection",
+	"Content-Disposition",
+	"Content-Encoding",
+	"Content-Language",
+	"Content-Length",
+	"Content-Location",
+	"Content-Range",
+	"Content-Type",
+	"Date",
+	"ETag",
+	"Expires",
+	"Keep-Alive",
+	"Last-Modified",
+	"Link",
+	"Location",
+	"Pragma",
+	"Proxy-Authenticate",
+	"Retry-After",
+	"Server",
+	"Set-Cookie",
+	"Strict-Transport-Security",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"Vary",
+	"Via",
+	"Warning",
+	"WWW-Authenticate"
+};
+
+/*
+	Perfect hash of the well-known names, see http_header_id. The slots hold ids,
+	no two names share a slot.
+*/
+const unsigned char http_header_slots[128] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 17, 0, 0, 0, 0, 0, 8,
+	0, 0, 18, 0, 14, 0, 0, 0, 0, 0, 0, 10, 0, 0, 19, 0,
+	24, 0, 23, 0, 27, 0, 0, 0, 0, 0, 0, 3, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 6, 0, 0, 5, 0, 0, 11, 0, 0, 7,
+	15, 2, 32, 28, 0, 0, 22, 0, 0, 0, 0, 0, 0, 0, 0, 20,
+	0, 12, 0, 0, 9, 0, 26, 0, 25, 33, 31, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 13, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0,
+	30, 1, 0, 0, 0, 0, 0, 16, 0, 0, 29, 0, 0, 0, 0, 21
+};
+
+/*
+	Gets the id of a header name, case insensitive. HTTP_HEADER_OTHER is returned
+	for names that are not well-known.
+*/
+enum http_header_id http_header_id(const char *name, size_t len)
+{
+	unsigned int slot;
+	int id;
+	if(len < 2)
+		return HTTP_HEADER_OTHER;
+	slot = (len + tolower((unsigned char)name[0]) * 3 + tolower((unsigned char)name[len - 2]) * 45) & 127;
+	id = http_header_slots[slot];
+	if(id != 0 && strlen(http_header_names[id]) == len && strncasecmp(http_header_names[id], name, len) == 0)
+		return (enum http_header_id)id;
+	return HTTP_HEADER_OTHER;
+}
+
+/*
+	A header field, as offsets into the text of the head it was parsed from
+*/
+struct http_header
+{
+	enum http_header_id id;
+	size_t name_offset;
+	size_t name_len;
+	size_t value_offset;
+	size_t value_len;
+};
+
+/*
+	The header fields of a response in order of appearance. index holds, for every
+	well-known header, the position of its first occurrence plus one. A table with
+	an arena grows inside the arena.
+*/
+struct http_header_table
+{
+	struct http_header *fields;
+	int count;
+	int cap;
+	int index[HTTP_HEADER_COUNT];
+	struct http_arena *arena;
+};
+
+/*
+	Initializes an empty table
+*/
+void http_header_table_init(struct http_header_table *table)
+{
+	memset(table, 0, sizeof(struct http_header_table));
+}
+
+/*
+	Initializes an empty table that allocates in arena
+*/
+void http_header_table_init_arena(struct http_header_table *table, struct http_arena *arena)
+{
+	http_header_table_init(table);
+	table->arena = arena;
+}
+
+/*
+	Empties a table, its memory is kept for the next head
+*/
+void http_header_table_clear(struct http_header_table *table)
+{
+	table->count = 0;
+	memset(table->index, 0, sizeof(table->index));
+}
+
+/*
+	Frees the memory of a table
+*/
+void http_header_table_free(struct http_header_table *table)
+{
+	struct http_arena *arena = table->arena;
+	if(arena == NULL)
+		free(table->fields);
+	http_header_table_init_arena(table, arena);
+}
+
+/*
+	Adds a field to a table, returns 0 on success and -1 when out of memory
+*/
+int http_header_table_add(struct http_header_table *table, enum http_header_id id, size_t name_offset, size_t name_len, size_t value_offset, size_t value_len)
+{
+	struct http_header *field;
+	if(table->count == table->cap)
+	{
+		int cap = table->cap ? table->cap * 2 : 16;
+		struct http_header *fields;
+		if(table->arena != NULL)
+			fields = (struct http_header*)http_arena_realloc(table->arena, table->fields, table->cap * sizeof(struct http_header), cap * sizeof(struct http_header));
+		else
+			fields = (struct http_header*)realloc(table->fields, cap * sizeof(struct http_header));
+		if(fields == NULL)
+			return -1;
+		table->fields = fields;
+		table->cap = cap;
+	}
+	field = &table->fields[table->count++];
+	field->id = id;
+	field->name_offset = name_offset;
+	field->name_len = name_len;
+	field->value_offset = value_offset;
+	field->value_len = value_len;
+	if(id != HTTP_HEADER_OTHER && table->index[id] == 0)
+		table->index[id] = table->count;
+	return 0;
+}
+
+/*
+	Finds the first field with the given name in a table, text is the head the
+	table was parsed from. Returns NULL when there is none.
+*/
+const struct http_header* http_header_table_find(const struct http_header_table *table, const char *text, const char *name)
+{
+	size_t len = strlen(name);
+	enum http_header_id id = http_header_id(name, len);
+	int i;
+
+	if(id != HTTP_HEADER_OTHER)
+		return table->index[id] ? &table->fields[table->index[id] - 1] : NULL;
+	for(i = 0; i < table->count; i++)
+	{
+		const struct http_header *field = &table->fields[i];
+		if(field->name_len == len && strncasecmp(text + field->name_offset, name, len) == 0)
+			return field;
+	}
+	return NULL;
+}
@@ -0,0 +1,187 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+
+/*
+	Decoding of gzip and deflate response bodies with zlib, piece by piece as the
+	body arrives
+*/
+
+/*
+	Advertise gzip and deflate in the Accept-Encoding header of requests and
+	decode the bodies the server compressed. Off by default.
+*/
+int http_accept_encoding = 0;
+
+/*
+	Called for every piece of decoded body, a non-zero return aborts
+*/
+typedef int (*http_inflate_callback)(void *user, const char *data, size_t len);
+
+/*
+	State of the decoder of a response body
+*/
+struct http_inflate
+{
+	z_stream zs;
+	int active;						/* zs is initialized */
+	int deflate;					/* Content-Encoding is deflate, which may come without zlib header */
+	int raw;						/* decoding raw deflate data */
+	int ended;						/* the compressed stream is complete */
+};
+
+/*
+	Recognizes a Content-Encoding value, returns 1 for gzip, 2 for deflate and 0
+	for encodings that can not be decoded
+*/
+int http_inflate_encoding(const char *value, size_t len)
+{
+	while(len > 0 && (*value == ' ' || *value == '\t'))
+	{
+		value++;
+		len--;
+	}
+	while(len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+		len--;
+	if((len == 4 && strncasecmp(value, "gzip", 4) == 0) || (len == 6 && strncasecmp(value, "x-gzip", 6) == 0))
+		return 1;
+	if(len == 7 && strncasecmp(value, "deflate", 7) == 0)
+		return 2;
+	return 0;
+}
+
+/*
+	zlib allocator that takes the memory of a decoder from an arena
+*/
+voidpf http_inflate_alloc(voidpf opaque, uInt items, uInt size)
+{
+	return http_arena_alloc((struct http_arena*)opaque, (size_t)items * size);
+}
+
+/*
+	The memory of a decoder in an arena is freed with the arena
+*/
+void http_inflate_release(voidpf opaque, voidpf address)
+{
+	(void)opaque;
+	(void)address;
+}
+
+/*
+	Prepares a decoder for a body with the encoding returned by
+	http_inflate_encoding, its state is allocated in arena unless arena is NULL.
+	Returns 0 on success and -1 when out of memory.
+*/
+int http_inflate_init(struct http_inflate *inflater, int encoding, struct http_arena *arena)
+{
+	memset(inflater, 0, sizeof(struct http_inflate));
+	inflater->deflate = encoding == 2;
+	if(arena != NULL)
+	{
+		inflater->zs.zalloc = http_inflate_alloc;
+		inflater->zs.zfree = http_inflate_release;
+		inflater->zs.opaque = arena;
+	}
+
+	/* 15 + 32 accepts both the gzip and the zlib header */
+	if(inflateInit2(&inflater->zs, 15 + 32) != Z_OK)
+		return -1;
+	inflater->active = 1;
+	return 0;
+}
+
+/*
+	Frees the memory of a decoder
+*/
+void http_inflate_free(struct http_inflate *inflater)
+{
+	if(inflater->active)
+		inflateEnd(&inflater->zs);
+	inflater->active = 0;
+}
+
+/*
+	Decodes a piece of the body and passes the output to emit. Returns 0 on success
+	and -1 when the data is not valid or emit aborted.
+*/
+int http_inflate_feed(struct http_inflate *inflater, const char *data, size_t len, http_inflate_callback emit, void *user)
+{
+	char out[16384];
+	z_stream *zs = &inflater->zs;
+	int first = zs->total_in == 0;		/* nothing was decoded before this piece */
+
+	zs->next_in = (Bytef*)data;
+	zs->avail_in = (uInt)len;
+	for(;;)
+	{
+		int result;
+		size_t produced;
+
+		/* Bytes after the end of a gzip member start the next member */
+		if(inflater->ended)
+		{
+			if(zs->avail_in == 0)
+				break;
+			if(inflater->deflate || inflateReset(zs) != Z_OK)
+				return -1;
+			inflater->ended = 0;
+		}
+		zs->next_out = (Bytef*)out;
+		zs->avail_out = sizeof(out);
+		result = inflate(zs, Z_NO_FLUSH);
+
+		/* Some servers send deflate as raw deflate data, without the zlib header */
+		if(result == Z_DATA_ERROR && inflater->deflate && !inflater->raw && first && zs->total_out == 0)
+		{
+			if(inflateReset2(zs, -15) != Z_OK)
+				return -1;
+			inflater->raw = 1;
+			zs->next_in = (Bytef*)data;
+			zs->avail_in = (uInt)len;
+			continue;
+		}
+		if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+			return -1;
+		produced = sizeof(out) - zs->avail_out;
+		if(produced > 0 && emit(user, out, produced) != 0)
+			return -1;
+		if(result == Z_STREAM_END)
+			inflater->ended = 1;
+		else if(result == Z_BUF_ERROR || (zs->avail_in == 0 && zs->avail_out > 0))
+			break;		/* everything is decoded that can be */
+	}
+	return 0;
+}
+
+/*
+	Checks that the body ended with a complete compressed stream, returns 0 when
+	it did and -1 when it was truncated
+*/
+int http_inflate_finish(struct http_inflate *inflater)
+{
+	return inflater->ended ? 0 : -1;
+}
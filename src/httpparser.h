@@ -0,0 +1,444 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+/*
+	States of the response parser
+*/
+enum http_parser_state
+{
+	HTTP_PARSER_STATUS_LINE,
+	HTTP_PARSER_HEADER_LINE,
+	HTTP_PARSER_BODY_IDENTITY,		/* Content-Length delimited body */
+	HTTP_PARSER_BODY_EOF,			/* body runs until the connection closes */
+	HTTP_PARSER_CHUNK_SIZE,
+	HTTP_PARSER_CHUNK_DATA,
+	HTTP_PARSER_CHUNK_DATA_END,		/* CRLF after the chunk data */
+	HTTP_PARSER_TRAILER,
+	HTTP_PARSER_DONE,
+	HTTP_PARSER_ERROR
+};
+
+/*
+	Push style HTTP/1.x response parser. Bytes are fed with http_parser_execute
+	in fragments of any size, every byte is looked at once.
+*/
+struct http_parser
+{
+	enum http_parser_state state;
+	int head_request;				/* the response to a HEAD request has no body */
+	int http_minor;
+	int status_code;
+	size_t status_text_offset;		/* status text, as offset into head */
+	size_t status_text_len;
+	int keep_alive;					/* connection can be reused after this response */
+	int chunked;
+	int has_content_length;
+	size_t content_length;
+	size_t remaining;				/* body or chunk bytes still expected */
+	size_t line_start;				/* offset of the line being parsed in head or trailers */
+	struct str_buffer head;			/* status line and headers of the final response */
+	struct http_header_table headers;	/* header fields, as offsets into head */
+	struct str_buffer trailers;		/* trailer fields of a chunked body */
+
+	/* Called once the headers of the final (non 1xx) response are parsed */
+	int (*on_headers_complete)(struct http_parser *parser, void *data);
+	/* Called for every piece of (decoded) body, a non-zero return aborts */
+	int (*on_body)(struct http_parser *parser, const char *at, size_t len, void *data);
+	void *data;
+};
+
+/*
+	Initializes a parser for the response to a request
+*/
+void http_parser_init(struct http_parser *parser, int head_request)
+{
+	memset(parser, 0, sizeof(struct http_parser));
+	parser->state = HTTP_PARSER_STATUS_LINE;
+	parser->head_request = head_request;
+	str_buffer_init(&parser->head);
+	str_buffer_init(&parser->trailers);
+	http_header_table_init(&parser->headers);
+}
+
+/*
+	Initializes a parser whose head, headers and trailers are kept in arena
+*/
+void http_parser_init_arena(struct http_parser *parser, int head_request, struct http_arena *arena)
+{
+	http_parser_init(parser, head_request);
+	str_buffer_init_arena(&parser->head, arena);
+	str_buffer_init_arena(&parser->trailers, arena);
+	http_header_table_init_arena(&parser->headers, arena);
+}
+
+/*
+	Frees the memory of a parser
+*/
+void http_parser_free(struct http_parser *parser)
+{
+	str_buffer_free(&parser->head);
+	str_buffer_free(&parser->trailers);
+	http_header_table_free(&parser->headers);
+}
+
+/*
+	Prepares the parser for the next response on the same connection,
+	the callbacks are kept.
+*/
+void http_parser_reset(struct http_parser *parser, int head_request)
+{
+	struct str_buffer head = parser->head;
+	struct str_buffer trailers = parser->trailers;
+	struct http_header_table headers = parser->headers;
+	int (*on_headers_complete)(struct http_parser*, void*) = parser->on_headers_complete;
+	int (*on_body)(struct http_parser*, const char*, size_t, void*) = parser->on_body;
+	void *data = parser->data;
+
+	memset(parser, 0, sizeof(struct http_parser));
+	parser->state = HTTP_PARSER_STATUS_LINE;
+	parser->head_request = head_request;
+	parser->head = head;
+	parser->head.len = 0;
+	parser->trailers = trailers;
+	parser->trailers.len = 0;
+	parser->headers = headers;
+	http_header_table_clear(&parser->headers);
+	parser->on_headers_complete = on_headers_complete;
+	parser->on_body = on_body;
+	parser->data = data;
+}
+
+/*
+	Checks whether a comma separated header value contains a token
+*/
+int http_parser_has_token(const char *value, size_t len, const char *token)
+{
+	size_t token_len = strlen(token);
+	size_t i = 0;
+	while(i < len)
+	{
+		size_t start, end;
+		while(i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+			i++;
+		start = i;
+		while(i < len && value[i] != ',')
+			i++;
+		end = i;
+		while(end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+			end--;
+		if(end - start == token_len && strncasecmp(value + start, token, token_len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Parses the status line, "HTTP/1.1 200 OK"
+*/
+int http_parser_status_line(struct http_parser *parser, const char *line, size_t len)
+{
+	size_t i;
+	if(len < 12 || strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)line[7]) || line[8] != ' ')
+		return -1;
+	parser->http_minor = line[7] - '0';
+	if(!isdigit((unsigned char)line[9]) || !isdigit((unsigned char)line[10]) || !isdigit((unsigned char)line[11]))
+		return -1;
+	parser->status_code = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+	i = 12;
+	while(i < len && line[i] == ' ')
+		i++;
+	parser->status_text_offset = (line - parser->head.data) + i;
+	parser->status_text_len = len - i;
+	parser->keep_alive = parser->http_minor >= 1;
+	return 0;
+}
+
+/*
+	Parses a header line into the header table, only the headers that affect
+	framing are interpreted
+*/
+int http_parser_header_line(struct http_parser *parser, const char *line, size_t len)
+{
+	size_t name_len = http_scan_token(line, len);
+	const char *value;
+	size_t value_len;
+	enum http_header_id id;
+
+	/* The name must be a token directly followed by the colon */
+	if(name_len == 0 || name_len == len || line[name_len] != ':')
+		return -1;
+	value = line + name_len + 1;
+	value_len = len - name_len - 1;
+	while(value_len > 0 && (*value == ' ' || *value == '\t'))
+	{
+		value++;
+		value_len--;
+	}
+	while(value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+		value_len--;
+
+	id = http_header_id(line, name_len);
+	if(http_header_table_add(&parser->headers, id, line - parser->head.data, name_len, value - parser->head.data, value_len) < 0)
+		return -1;
+
+	if(id == HTTP_HEADER_CONTENT_LENGTH)
+	{
+		size_t length = 0;
+		size_t i;
+		if(value_len == 0)
+			return -1;
+		for(i = 0; i < value_len; i++)
+		{
+			size_t digit = value[i] - '0';
+			if(!isdigit((unsigned char)value[i]))
+				return -1;
+			/* A length that does not fit would frame the body wrong */
+			if(length > (((size_t)-1) - digit) / 10)
+				return -1;
+			length = length * 10 + digit;
+		}
+		if(parser->has_content_length && parser->content_length != length)
+			return -1;
+		parser->has_content_length = 1;
+		parser->content_length = length;
+	}
+	else if(id == HTTP_HEADER_TRANSFER_ENCODING)
+	{
+		parser->chunked = http_parser_has_token(value, value_len, "chunked");
+	}
+	else if(id == HTTP_HEADER_CONNECTION)
+	{
+		if(http_parser_has_token(value, value_len, "close"))
+			parser->keep_alive = 0;
+		else if(http_parser_has_token(value, value_len, "keep-alive"))
+			parser->keep_alive = 1;
+	}
+	return 0;
+}
+
+/*
+	Decides how the body is delimited once all headers have been parsed
+*/
+int http_parser_headers_done(struct http_parser *parser)
+{
+	/* Interim responses are dropped, the final response follows on the same connection */
+	if(parser->status_code >= 100 && parser->status_code < 200 && parser->status_code != 101)
+	{
+		http_parser_reset(parser, parser->head_request);
+		return 0;
+	}
+
+	if(parser->on_headers_complete != NULL && parser->on_headers_complete(parser, parser->data) != 0)
+		return -1;
+
+	if(parser->head_request || parser->status_code == 204 || parser->status_code == 304 || parser->status_code == 101)
+	{
+		parser->state = HTTP_PARSER_DONE;
+	}
+	else if(parser->chunked)
+	{
+		parser->state = HTTP_PARSER_CHUNK_SIZE;
+	}
+	else if(parser->has_content_length)
+	{
+		parser->remaining = parser->content_length;
+		parser->state = parser->remaining > 0 ? HTTP_PARSER_BODY_IDENTITY : HTTP_PARSER_DONE;
+	}
+	else
+	{
+		/* Without framing the body ends when the server closes the connection */
+		parser->keep_alive = 0;
+		parser->state = HTTP_PARSER_BODY_EOF;
+	}
+	return 0;
+}
+
+/*
+	Parses the size line of a chunk, "1a2b;ext=value"
+*/
+int http_parser_chunk_size(struct http_parser *parser, const char *line, size_t len)
+{
+	size_t size = 0;
+	size_t i;
+	for(i = 0; i < len && isxdigit((unsigned char)line[i]); i++)
+	{
+		if(size > ((size_t)-1) >> 4)
+			return -1;
+		size = size * 16 + (isdigit((unsigned char)line[i]) ? line[i] - '0' : (tolower((unsigned char)line[i]) - 'a' + 10));
+	}
+	if(i == 0)
+		return -1;
+	parser->remaining = size;
+	parser->state = size > 0 ? HTTP_PARSER_CHUNK_DATA : HTTP_PARSER_TRAILER;
+	return 0;
+}
+
+/*
+	Handles a complete line, without its line ending
+*/
+int http_parser_line(struct http_parser *parser, const char *line, size_t len)
+{
+	switch(parser->state)
+	{
+		case HTTP_PARSER_STATUS_LINE:
+			if(http_parser_status_line(parser, line, len) < 0)
+				return -1;
+			parser->state = HTTP_PARSER_HEADER_LINE;
+			return 0;
+		case HTTP_PARSER_HEADER_LINE:
+			if(len == 0)
+				return http_parser_headers_done(parser);
+			return http_parser_header_line(parser, line, len);
+		case HTTP_PARSER_CHUNK_SIZE:
+			return http_parser_chunk_size(parser, line, len);
+		case HTTP_PARSER_TRAILER:
+			if(len == 0)
+				parser->state = HTTP_PARSER_DONE;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/*
+	Feeds bytes to the parser. Returns the amount of bytes consumed, this is less
+	than len when the response ended and the rest belongs to the next response.
+	The parser state is HTTP_PARSER_ERROR when the response is malformed.
+*/
+size_t http_parser_execute(struct http_parser *parser, const char *data, size_t len)
+{
+	size_t pos = 0;
+	while(pos < len && parser->state != HTTP_PARSER_DONE && parser->state != HTTP_PARSER_ERROR)
+	{
+		const char *at = data + pos;
+		size_t avail = len - pos;
+
+		switch(parser->state)
+		{
+			case HTTP_PARSER_STATUS_LINE:
+			case HTTP_PARSER_HEADER_LINE:
+			case HTTP_PARSER_CHUNK_SIZE:
+			case HTTP_PARSER_TRAILER:
+			{
+				/*
+					Lines are collected in head (or trailers for chunk framing), only
+					the new bytes are searched for the end of the line.
+				*/
+				struct str_buffer *lines = (parser->state == HTTP_PARSER_STATUS_LINE || parser->state == HTTP_PARSER_HEADER_LINE)
+					? &parser->head : &parser->trailers;
+				const char *eol = http_scan_any(at, avail, "\n", 1);
+				size_t take = eol != NULL ? (size_t)(eol - at) + 1 : avail;
+				enum http_parser_state line_state = parser->state;
+				size_t line_len;
+
+				if(str_buffer_append(lines, at, take) < 0)
+				{
+					parser->state = HTTP_PARSER_ERROR;
+					break;
+				}
+				pos += take;
+				if(eol == NULL)
+					break;
+
+				line_len = lines->len - parser->line_start - 1;
+				if(line_len > 0 && lines->data[parser->line_start + line_len - 1] == '\r')
+					line_len--;
+				if(http_parser_line(parser, lines->data + parser->line_start, line_len) < 0)
+				{
+					parser->state = HTTP_PARSER_ERROR;
+					break;
+				}
+
+				/* Chunk size lines and the blank line ending the trailers are not kept */
+				if(line_state == HTTP_PARSER_CHUNK_SIZE || (line_state == HTTP_PARSER_TRAILER && line_len == 0))
+				{
+					lines->len = parser->line_start;
+					lines->data[lines->len] = '\0';
+				}
+
+				/* The next line may go to the other buffer once the headers are done */
+				lines = (parser->state == HTTP_PARSER_STATUS_LINE || parser->state == HTTP_PARSER_HEADER_LINE)
+					? &parser->head : &parser->trailers;
+				parser->line_start = lines->len;
+				break;
+			}
+			case HTTP_PARSER_BODY_IDENTITY:
+			case HTTP_PARSER_CHUNK_DATA:
+			case HTTP_PARSER_BODY_EOF:
+			{
+				size_t take = avail;
+				if(parser->state != HTTP_PARSER_BODY_EOF && take > parser->remaining)
+					take = parser->remaining;
+				if(parser->on_body != NULL && parser->on_body(parser, at, take, parser->data) != 0)
+				{
+					parser->state = HTTP_PARSER_ERROR;
+					break;
+				}
+				pos += take;
+				if(parser->state == HTTP_PARSER_BODY_EOF)
+					break;
+				parser->remaining -= take;
+				if(parser->remaining == 0)
+					parser->state = parser->state == HTTP_PARSER_CHUNK_DATA ? HTTP_PARSER_CHUNK_DATA_END : HTTP_PARSER_DONE;
+				break;
+			}
+			case HTTP_PARSER_CHUNK_DATA_END:
+			{
+				if(*at == '\r' && parser->remaining == 0)
+				{
+					parser->remaining = 1;
+				}
+				else if(*at == '\n')
+				{
+					parser->remaining = 0;
+					parser->state = HTTP_PARSER_CHUNK_SIZE;
+				}
+				else
+				{
+					parser->state = HTTP_PARSER_ERROR;
+					break;
+				}
+				pos++;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	return pos;
+}
+
+/*
+	Tells the parser the connection was closed, returns 0 when this completes
+	the response and -1 when the response was cut short.
+*/
+int http_parser_finish(struct http_parser *parser)
+{
+	if(parser->state == HTTP_PARSER_BODY_EOF)
+		parser->state = HTTP_PARSER_DONE;
+	return parser->state == HTTP_PARSER_DONE ? 0 : -1;
+}
@@ -0,0 +1,353 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+
+/*
+	Retries and hedging of safe requests (GET, HEAD and OPTIONS) made without
+	callbacks. A request whose connection fails, or that gets a 502, 503 or 504,
+	is sent again after an exponential, jittered backoff. A request that is slower
+	than most recent requests gets a second copy on another connection, the first
+	response wins. Both are paid for from a retry budget, so that they can not
+	multiply the load on a server that is already overloaded.
+*/
+
+/*
+	Times a request is sent again after a failure, 0 disables retries
+*/
+int http_retry_max = 0;
+
+/*
+	Backoff before a retry in milliseconds: a random time up to
+	http_retry_base_delay times 2 to the power of the retries made so far, at
+	most http_retry_max_delay
+*/
+int http_retry_base_delay = 100;
+int http_retry_max_delay = 5000;
+
+/*
+	Retries and hedges allowed per 100 requests. Every request adds to the
+	budget, every retry and hedge takes one off, so under failure at most this
+	share of extra requests is sent.
+*/
+int http_retry_budget = 10;
+
+/*
+	Percentile of the latency of recent requests after which a second copy of a
+	request is sent, e.g. 95. 0 disables hedging.
+*/
+int http_hedge_percentile = 0;
+
+/*
+	Milliseconds a request is given at least before it is hedged
+*/
+int http_hedge_min_delay = 10;
+
+/*
+	Budget in hundredths of a request, it starts full and holds at most ten
+	retries so that a burst of failures is cut off quickly
+*/
+#define HTTP_RETRY_BUDGET_CAP 1000
+
+/*
+	Latencies of the most recent requests, the hedge delay is taken from them
+	once there are HTTP_HEDGE_MIN_SAMPLES
+*/
+#define HTTP_HEDGE_SAMPLES 256
+#define HTTP_HEDGE_MIN_SAMPLES 20
+
+int http_retry_tokens = HTTP_RETRY_BUDGET_CAP;
+int http_hedge_samples[HTTP_HEDGE_SAMPLES];
+int http_hedge_sample_count = 0;
+int http_hedge_sample_next = 0;
+pthread_mutex_t http_retry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Seed of the jitter of the calling thread
+*/
+__thread unsigned int http_retry_seed = 0;
+
+/*
+	Checks whether a request may be retried or hedged: GET, HEAD and OPTIONS
+	do not change anything on the server
+*/
+int http_retry_safe(const char *http_headers)
+{
+	return strncmp(http_headers, "GET ", 4) == 0 || strncmp(http_headers, "HEAD ", 5) == 0
+		|| strncmp(http_headers, "OPTIONS ", 8) == 0;
+}
+
+/*
+	Adds the share of a request to the retry budget
+*/
+void http_retry_deposit()
+{
+	pthread_mutex_lock(&http_retry_lock);
+	http_retry_tokens += http_retry_budget;
+	if(http_retry_tokens > HTTP_RETRY_BUDGET_CAP)
+		http_retry_tokens = HTTP_RETRY_BUDGET_CAP;
+	pthread_mutex_unlock(&http_retry_lock);
+}
+
+/*
+	Takes a retry or hedge from the budget, returns 0 when the budget is spent
+*/
+int http_retry_spend()
+{
+	int allowed = 0;
+	pthread_mutex_lock(&http_retry_lock);
+	if(http_retry_tokens >= 100)
+	{
+		http_retry_tokens -= 100;
+		allowed = 1;
+	}
+	pthread_mutex_unlock(&http_retry_lock);
+	return allowed;
+}
+
+/*
+	Checks whether the outcome of a request is worth a retry: no connection
+	could be opened, or the server or a gateway in front of it is unavailable.
+	A host that does not resolve (HTTP_ERROR_RESOLVE) is not retried, the
+	failed lookup is cached and would fail again.
+*/
+int http_retry_wanted(struct http_response *hresp)
+{
+	if(hresp == NULL)
+		return http_req_error == HTTP_ERROR_CONNECT || http_req_error == HTTP_ERROR_TIMEOUT_CONNECT;
+	return hresp->status_code_int == 502 || hresp->status_code_int == 503 || hresp->status_code_int == 504;
+}
+
+/*
+	Sleeps before retry number retry (0 for the first one), a random time up to
+	the exponential backoff ("full jitter"), so that the clients of a server
+	that failed do not come back all at once
+*/
+void http_retry_backoff(int retry)
+{
+	long long ceiling = http_retry_base_delay;
+	long long delay;
+	struct timespec ts;
+
+	while(retry-- > 0 && ceiling < http_retry_max_delay)
+		ceiling *= 2;
+	if(ceiling > http_retry_max_delay)
+		ceiling = http_retry_max_delay;
+	if(ceiling <= 0)
+		return;
+	if(http_retry_seed == 0)
+		http_retry_seed = (unsigned int)http_time_ms() ^ (unsigned int)(size_t)&http_retry_seed;
+	delay = rand_r(&http_retry_seed) % (ceiling + 1);
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+	Adds the latency of a completed request to the samples
+*/
+void http_hedge_record(long long latency)
+{
+	pthread_mutex_lock(&http_retry_lock);
+	http_hedge_samples[http_hedge_sample_next] = latency > INT_MAX ? INT_MAX : (int)latency;
+	http_hedge_sample_next = (http_hedge_sample_next + 1) % HTTP_HEDGE_SAMPLES;
+	if(http_hedge_sample_count < HTTP_HEDGE_SAMPLES)
+		http_hedge_sample_count++;
+	pthread_mutex_unlock(&http_retry_lock);
+}
+
+/*
+	Orders latencies for qsort
+*/
+int http_hedge_compare(const void *a, const void *b)
+{
+	int x = *(const int*)a, y = *(const int*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+	Gets the milliseconds after which a request is hedged, -1 when hedging is
+	disabled or too few latencies are known
+*/
+long long http_hedge_delay()
+{
+	int samples[HTTP_HEDGE_SAMPLES];
+	int count, index;
+
+	if(http_hedge_percentile <= 0)
+		return -1;
+	pthread_mutex_lock(&http_retry_lock);
+	count = http_hedge_sample_count;
+	memcpy(samples, http_hedge_samples, count * sizeof(int));
+	pthread_mutex_unlock(&http_retry_lock);
+	if(count < HTTP_HEDGE_MIN_SAMPLES)
+		return -1;
+	qsort(samples, count, sizeof(int), http_hedge_compare);
+	index = count * (http_hedge_percentile < 100 ? http_hedge_percentile : 100) / 100;
+	if(index >= count)
+		index = count - 1;
+	return samples[index] > http_hedge_min_delay ? samples[index] : http_hedge_min_delay;
+}
+
+#ifdef __linux__
+/*
+	Outcome of the copies of a hedged request
+*/
+struct http_hedge
+{
+	struct http_response *hresp;		/* the first response */
+	enum http_error error;				/* why the last failed copy failed */
+};
+
+/*
+	Called by the engine when a copy of a hedged request completes, the first
+	response wins
+*/
+void http_hedge_done(struct http_response *hresp, enum http_error error, void *user)
+{
+	struct http_hedge *hedge = (struct http_hedge*)user;
+	if(hresp != NULL && hedge->hresp == NULL)
+		hedge->hresp = hresp;
+	else
+		http_response_free(hresp);
+	if(hresp == NULL && error != HTTP_ERROR_ABORTED)
+		hedge->error = error;
+}
+
+/*
+	Adds a copy of a request to the engine of a hedged request, the copy is
+	allocated with malloc as it ends up in the response of the engine.
+	Returns 0 on success and -1 on failure.
+*/
+int http_hedge_send(struct http_engine *engine, const char *http_headers, struct parsed_url *purl, struct http_hedge *hedge)
+{
+	char *headers = str_dup(http_headers);
+	struct parsed_url *copy = parsed_url_dup(purl, NULL);
+	if(headers == NULL || copy == NULL || http_engine_add(engine, headers, copy, http_hedge_done, hedge) < 0)
+	{
+		free(headers);
+		parsed_url_free(copy);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+	Makes a request, and when it has not been answered after the hedge delay a
+	second copy of it on another connection. The first response wins, the other
+	copy is cancelled and its connection closed. Like http_req, the response takes
+	over http_headers and purl.
+*/
+struct http_response* http_req_hedged(char *http_headers, struct parsed_url *purl)
+{
+	struct http_response *hresp;
+	long long start = http_time_ms();
+	long long delay = http_hedge_delay();
+#ifdef __linux__
+	struct http_engine *engine = delay >= 0 ? http_engine_new() : NULL;
+	struct http_hedge hedge;
+	int copies = 0;
+
+	hedge.hresp = NULL;
+	hedge.error = HTTP_ERROR_PROTOCOL;
+	if(engine != NULL && http_hedge_send(engine, http_headers, purl, &hedge) == 0)
+		copies = 1;
+	if(copies > 0)
+	{
+		while(hedge.hresp == NULL && engine->active > 0)
+		{
+			long long wait = -1;
+			if(copies == 1)
+			{
+				wait = start + delay - http_time_ms();
+				if(wait <= 0)
+				{
+					/* The request is slower than most, a second copy races it */
+					if(http_retry_spend())
+						http_hedge_send(engine, http_headers, purl, &hedge);
+					copies = 2;
+					continue;
+				}
+			}
+			http_engine_poll(engine, wait > INT_MAX ? INT_MAX : (int)wait);
+		}
+
+		/* The copy that lost is cancelled */
+		http_engine_free(engine);
+		hresp = hedge.hresp;
+		http_req_error = hresp != NULL ? HTTP_ERROR_NONE : hedge.error;
+		if(hresp == NULL)
+			return NULL;
+
+		/* The response takes over the request of the caller */
+		free(hresp->request_headers);
+		parsed_url_free(hresp->request_uri);
+		hresp->request_headers = http_headers;
+		hresp->request_uri = purl;
+		http_hedge_record(http_time_ms() - start);
+		return hresp;
+	}
+	if(engine != NULL)
+		http_engine_free(engine);
+#endif
+	hresp = http_req_body(http_headers, purl, NULL, 0, NULL);
+	if(hresp != NULL && http_hedge_percentile > 0)
+		http_hedge_record(http_time_ms() - start);
+	return hresp;
+}
+
+/*
+	Makes a request without callbacks with the retry and hedging policy: safe
+	requests are hedged and retried as configured, others are made once. Like
+	http_req, the response takes over http_headers and purl, the last response
+	is returned when every retry failed.
+*/
+struct http_response* http_req_fetch(char *http_headers, struct parsed_url *purl)
+{
+	struct http_response *hresp;
+	int retry;
+
+	if((http_retry_max <= 0 && http_hedge_percentile <= 0) || !http_retry_safe(http_headers))
+		return http_req_body(http_headers, purl, NULL, 0, NULL);
+	http_retry_deposit();
+	for(retry = 0; ; retry++)
+	{
+		hresp = http_req_hedged(http_headers, purl);
+		if(retry >= http_retry_max || !http_retry_wanted(hresp) || !http_retry_spend())
+			return hresp;
+
+		/* The request is sent again, the response gives it back */
+		if(hresp != NULL)
+		{
+			hresp->request_headers = NULL;
+			hresp->request_uri = NULL;
+			http_response_discard(hresp);
+		}
+		http_retry_backoff(retry);
+	}
+}
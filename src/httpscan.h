@@ -0,0 +1,237 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+
+	Warning:
+	This library does not tend to work that stable nor does it fully implent the
+	standards described by IETF. For more information on the precise implentation of the
+	Hyper Text Transfer Protocol:
+
+	http://www.ietf.org/rfc/rfc2616.txt
+*/
+
+/*
+	Byte scanners used by the response parser and the url parser. On x86 they
+	are vectorized with SSE2 or AVX2, picked at runtime by CPU feature
+	detection, other platforms use the scalar versions.
+*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define HTTP_SCAN_X86
+	#include <immintrin.h>
+#endif
+
+#define HTTP_SCAN_MAX_SET 8
+
+/*
+	Characters allowed in a token, like a header name (RFC 7230 tchar)
+*/
+int http_scan_is_tchar(unsigned char c)
+{
+	return isalnum(c) || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+/*
+	Finds the first byte of data that is one of the nset (at most
+	HTTP_SCAN_MAX_SET) bytes of set, returns NULL when there is none
+*/
+const char* http_scan_any_scalar(const char *data, size_t len, const char *set, int nset)
+{
+	size_t i;
+	int j;
+	for(i = 0; i < len; i++)
+	{
+		for(j = 0; j < nset; j++)
+		{
+			if(data[i] == set[j])
+				return data + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+	Gets the length of the token at the start of data, the position of the
+	first byte that is not a tchar
+*/
+size_t http_scan_token_scalar(const char *data, size_t len)
+{
+	size_t i = 0;
+	while(i < len && http_scan_is_tchar((unsigned char)data[i]))
+		i++;
+	return i;
+}
+
+#ifdef HTTP_SCAN_X86
+__attribute__((target("sse2")))
+const char* http_scan_any_sse2(const char *data, size_t len, const char *set, int nset)
+{
+	__m128i needles[HTTP_SCAN_MAX_SET];
+	size_t i = 0;
+	int j;
+
+	for(j = 0; j < nset; j++)
+		needles[j] = _mm_set1_epi8(set[j]);
+	for(; i + 16 <= len; i += 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+		__m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+		for(j = 1; j < nset; j++)
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[j]));
+		if(_mm_movemask_epi8(hits) != 0)
+			return data + i + __builtin_ctz(_mm_movemask_epi8(hits));
+	}
+	return http_scan_any_scalar(data + i, len - i, set, nset);
+}
+
+__attribute__((target("avx2")))
+const char* http_scan_any_avx2(const char *data, size_t len, const char *set, int nset)
+{
+	__m256i needles[HTTP_SCAN_MAX_SET];
+	size_t i = 0;
+	int j;
+
+	for(j = 0; j < nset; j++)
+		needles[j] = _mm256_set1_epi8(set[j]);
+	for(; i + 32 <= len; i += 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i hits = _mm256_cmpeq_epi8(block, needles[0]);
+		for(j = 1; j < nset; j++)
+			hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[j]));
+		if(_mm256_movemask_epi8(hits) != 0)
+			return data + i + __builtin_ctz((unsigned int)_mm256_movemask_epi8(hits));
+	}
+	return http_scan_any_sse2(data + i, len - i, set, nset);
+}
+
+/*
+	The vector token scanners accept letters, digits and '-' a block at a time,
+	the rare other tchars are checked one by one.
+*/
+__attribute__((target("sse2")))
+size_t http_scan_token_sse2(const char *data, size_t len)
+{
+	const __m128i lower_a = _mm_set1_epi8('a' - 1), lower_z = _mm_set1_epi8('z' + 1);
+	const __m128i digit_0 = _mm_set1_epi8('0' - 1), digit_9 = _mm_set1_epi8('9' + 1);
+	const __m128i dash = _mm_set1_epi8('-'), case_bit = _mm_set1_epi8(0x20);
+	size_t i = 0;
+
+	while(i + 16 <= len)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+		__m128i folded = _mm_or_si128(block, case_bit);
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(folded, lower_a), _mm_cmplt_epi8(folded, lower_z));
+		int mask;
+		ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(block, digit_0), _mm_cmplt_epi8(block, digit_9)));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(block, dash));
+		mask = ~_mm_movemask_epi8(ok) & 0xffff;
+		if(mask == 0)
+		{
+			i += 16;
+			continue;
+		}
+		i += __builtin_ctz(mask);
+		if(!http_scan_is_tchar((unsigned char)data[i]))
+			return i;
+		i++;
+	}
+	return i + http_scan_token_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t http_scan_token_avx2(const char *data, size_t len)
+{
+	const __m256i lower_a = _mm256_set1_epi8('a' - 1), lower_z = _mm256_set1_epi8('z' + 1);
+	const __m256i digit_0 = _mm256_set1_epi8('0' - 1), digit_9 = _mm256_set1_epi8('9' + 1);
+	const __m256i dash = _mm256_set1_epi8('-'), case_bit = _mm256_set1_epi8(0x20);
+	size_t i = 0;
+
+	while(i + 32 <= len)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i folded = _mm256_or_si256(block, case_bit);
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(folded, lower_a), _mm256_cmpgt_epi8(lower_z, folded));
+		unsigned int mask;
+		ok = _mm256_or_si256(ok, _mm256_and_si256(_mm256_cmpgt_epi8(block, digit_0), _mm256_cmpgt_epi8(digit_9, block)));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(block, dash));
+		mask = ~(unsigned int)_mm256_movemask_epi8(ok);
+		if(mask == 0)
+		{
+			i += 32;
+			continue;
+		}
+		i += __builtin_ctz(mask);
+		if(!http_scan_is_tchar((unsigned char)data[i]))
+			return i;
+		i++;
+	}
+	return i + http_scan_token_sse2(data + i, len - i);
+}
+#endif
+
+/*
+	The scanners picked for this CPU, set by http_scan_init
+*/
+const char* (*http_scan_any_impl)(const char*, size_t, const char*, int) = NULL;
+size_t (*http_scan_token_impl)(const char*, size_t) = NULL;
+
+/*
+	Picks the fastest scanners the CPU supports
+*/
+void http_scan_init()
+{
+	const char* (*scan_any)(const char*, size_t, const char*, int) = http_scan_any_scalar;
+	size_t (*scan_token)(const char*, size_t) = http_scan_token_scalar;
+#ifdef HTTP_SCAN_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		scan_any = http_scan_any_avx2;
+		scan_token = http_scan_token_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		scan_any = http_scan_any_sse2;
+		scan_token = http_scan_token_sse2;
+	}
+#endif
+	http_scan_token_impl = scan_token;
+	http_scan_any_impl = scan_any;
+}
+
+/*
+	Finds the first byte of data that is one of the nset (at most
+	HTTP_SCAN_MAX_SET) bytes of set, returns NULL when there is none
+*/
+const char* http_scan_any(const char *data, size_t len, const char *set, int nset)
+{
+	if(http_scan_any_impl == NULL)
+		http_scan_init();
+	return http_scan_any_impl(data, len, set, nset);
+}
+
+/*
+	Gets the length of the token at the start of data, the position of the
+	first byte that is not a tchar
+*/
+size_t http_scan_token(const char *data, size_t len)
+{
+	if(http_scan_token_impl == NULL)
+		http_scan_init();
+	return http_scan_token_impl(data, len);
+}
@@ -0,0 +1,98 @@
+/*
+	http-client-c
+	Copyright (C) 2012-2013  Swen Kooij
+
+	This file is part of http-client-c.
+
+    http-client-c is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    http-client-c is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with http-client-c. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+	Benchmark of the response parser with the scanners picked for this CPU
+	against the scalar scanners, on a response with a large block of headers.
+	It is not part of the library, build and run it with:
+
+		gcc -O2 -DOPENSSL src/httpscan_bench.c -o httpscan_bench -lssl -lcrypto -lz -lpthread
+		./httpscan_bench [headers] [rounds]
+*/
+#include "http-client-c.h"
+
+/*
+	Builds a response with count headers of about 100 bytes and an empty body
+*/
+char* bench_response(int count, size_t *len)
+{
+	struct str_buffer buf;
+	char line[160];
+	int i;
+
+	str_buffer_init(&buf);
+	str_buffer_append(&buf, "HTTP/1.1 200 OK\r\n", 17);
+	for(i = 0; i < count; i++)
+	{
+		int n = snprintf(line, sizeof(line), "X-Benchmark-Header-%05d: value-%05d; path=/some/resource/path; "
+			"max-age=3600; domain=example.com\r\n", i, i);
+		str_buffer_append(&buf, line, n);
+	}
+	str_buffer_append(&buf, "Content-Length: 0\r\n\r\n", 21);
+	*len = buf.len;
+	return buf.data;
+}
+
+/*
+	Parses the response rounds times, returns the throughput in GB/s or -1 when
+	the response does not parse
+*/
+double bench_parse(const char *response, size_t len, int rounds)
+{
+	struct http_parser parser;
+	long long start, elapsed;
+	int i;
+
+	start = http_time_ms();
+	for(i = 0; i < rounds; i++)
+	{
+		http_parser_init(&parser, 0);
+		if(http_parser_execute(&parser, response, len) != len || parser.state != HTTP_PARSER_DONE)
+		{
+			http_parser_free(&parser);
+			return -1;
+		}
+		http_parser_free(&parser);
+	}
+	elapsed = http_time_ms() - start;
+	if(elapsed <= 0)
+		elapsed = 1;
+	return (double)len * rounds / (elapsed / 1000.0) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 2000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+	size_t len;
+	char *response = bench_response(count, &len);
+	double picked, scalar;
+
+	http_scan_init();
+	picked = bench_parse(response, len, rounds);
+	http_scan_any_impl = http_scan_any_scalar;
+	http_scan_token_impl = http_scan_token_scalar;
+	scalar = bench_parse(response, len, rounds);
+	printf("%d headers, %zu bytes, %d rounds\n", count, len, rounds);
+	printf("picked scanners: %.2f GB/s\n", picked);
+	printf("scalar scanners: %.2f GB/s\n", scalar);
+	free(response);
+	return picked < 0 || scalar < 0;
+}
@@ -173,6 +173,328 @@ char* get_until(char *haystack, char *until)
 	return str_ndup(haystack, offset);
 }
 
+/*
+	Default size of the blocks of an arena, large enough for the response
+	head, the url and a small body
+*/
+#define HTTP_ARENA_BLOCK 8192
+
+/*
+	Alignment of the allocations in an arena
+*/
+#define HTTP_ARENA_ALIGN 16
+
+/*
+	Block of memory of an arena, the allocations follow the header
+*/
+struct http_arena_block
+{
+	struct http_arena_block *next;
+	size_t size;					/* bytes after the header */
+	size_t used;
+};
+
+/*
+	Bump allocator for everything a single request allocates. Allocating is
+	moving a pointer and freeing is done for all allocations at once, by
+	resetting or freeing the arena. The arena itself lives in its first block.
+*/
+struct http_arena
+{
+	struct http_arena_block *blocks;	/* block allocations are taken from, first */
+	size_t block_size;
+	int keep;						/* owned by the caller: released by resetting instead of freeing */
+	char *last;						/* most recent allocation, grows in place */
+	size_t last_len;
+};
+
+#define HTTP_ARENA_HEADER ((sizeof(struct http_arena_block) + HTTP_ARENA_ALIGN - 1) & ~(size_t)(HTTP_ARENA_ALIGN - 1))
+#define HTTP_ARENA_ROUND(len) (((len) + HTTP_ARENA_ALIGN - 1) & ~(size_t)(HTTP_ARENA_ALIGN - 1))
+
+/*
+	Creates an arena with blocks of block_size bytes, 0 for the default. The arena
+	is kept by the caller: responses allocated in it reset it when they are freed,
+	http_arena_free frees it. Returns NULL when out of memory.
+*/
+struct http_arena* http_arena_new(size_t block_size)
+{
+	struct http_arena_block *block;
+	struct http_arena *arena;
+	if(block_size < 1024)
+		block_size = HTTP_ARENA_BLOCK;
+	block = (struct http_arena_block*)malloc(HTTP_ARENA_HEADER + block_size);
+	if(block == NULL)
+		return NULL;
+	block->next = NULL;
+	block->size = block_size;
+	block->used = HTTP_ARENA_ROUND(sizeof(struct http_arena));
+	arena = (struct http_arena*)((char*)block + HTTP_ARENA_HEADER);
+	arena->blocks = block;
+	arena->block_size = block_size;
+	arena->keep = 1;
+	arena->last = NULL;
+	arena->last_len = 0;
+	return arena;
+}
+
+/*
+	Allocates len bytes in the arena, returns NULL when out of memory
+*/
+void* http_arena_alloc(struct http_arena *arena, size_t len)
+{
+	struct http_arena_block *block = arena->blocks;
+	char *ptr;
+	len = HTTP_ARENA_ROUND(len ? len : 1);
+	if(block->size - block->used < len)
+	{
+		/* Large allocations get a block of their own behind the current one, so
+		   the free space of the current block is not lost */
+		int own = len > arena->block_size / 4;
+		size_t size = own ? len : arena->block_size;
+		struct http_arena_block *fresh = (struct http_arena_block*)malloc(HTTP_ARENA_HEADER + size);
+		if(fresh == NULL)
+			return NULL;
+		fresh->size = size;
+		fresh->used = 0;
+		if(own)
+		{
+			fresh->next = block->next;
+			block->next = fresh;
+		}
+		else
+		{
+			fresh->next = block;
+			arena->blocks = fresh;
+		}
+		block = fresh;
+	}
+	ptr = (char*)block + HTTP_ARENA_HEADER + block->used;
+	block->used += len;
+	arena->last = ptr;
+	arena->last_len = len;
+	return ptr;
+}
+
+/*
+	Grows an allocation of the arena to len bytes. The most recent allocation
+	grows in place when its block has room, an allocation with a block of its own
+	is reallocated, others are copied. Returns NULL when out of memory.
+*/
+void* http_arena_realloc(struct http_arena *arena, void *ptr, size_t old_len, size_t len)
+{
+	struct http_arena_block *block = arena->blocks;
+	char *data;
+	if(ptr == NULL)
+		return http_arena_alloc(arena, len);
+	if(len <= old_len)
+		return ptr;
+	if(ptr == arena->last)
+	{
+		size_t extra;
+		if(HTTP_ARENA_ROUND(len) <= arena->last_len)
+			return ptr;
+		extra = HTTP_ARENA_ROUND(len) - arena->last_len;
+		if((char*)ptr + arena->last_len == (char*)block + HTTP_ARENA_HEADER + block->used && block->size - block->used >= extra)
+		{
+			block->used += extra;
+			arena->last_len += extra;
+			return ptr;
+		}
+	}
+	block = block->next;
+	if(block != NULL && (char*)ptr == (char*)block + HTTP_ARENA_HEADER && block->used == HTTP_ARENA_ROUND(old_len))
+	{
+		struct http_arena_block *moved = (struct http_arena_block*)realloc(block, HTTP_ARENA_HEADER + HTTP_ARENA_ROUND(len));
+		if(moved == NULL)
+			return NULL;
+		moved->size = moved->used = HTTP_ARENA_ROUND(len);
+		arena->blocks->next = moved;
+		if(arena->last == ptr)
+			arena->last = NULL;
+		return (char*)moved + HTTP_ARENA_HEADER;
+	}
+	data = (char*)http_arena_alloc(arena, len);
+	if(data != NULL)
+		memcpy(data, ptr, old_len);
+	return data;
+}
+
+/*
+	Allocates len bytes in arena, or with malloc when arena is NULL
+*/
+void* http_arena_malloc(struct http_arena *arena, size_t len)
+{
+	return arena != NULL ? http_arena_alloc(arena, len) : malloc(len);
+}
+
+/*
+	Copies at most max characters of str into arena, or with malloc when arena is NULL
+*/
+char* http_arena_strndup(struct http_arena *arena, const char *str, size_t max)
+{
+	size_t len;
+	char *res;
+	if(arena == NULL)
+		return str_ndup(str, max);
+	len = strnlen(str, max);
+	res = (char*)http_arena_alloc(arena, len + 1);
+	if(res != NULL)
+	{
+		memcpy(res, str, len);
+		res[len] = '\0';
+	}
+	return res;
+}
+
+/*
+	Checks whether ptr was allocated in arena
+*/
+int http_arena_owns(struct http_arena *arena, const void *ptr)
+{
+	struct http_arena_block *block;
+	if(arena == NULL || ptr == NULL)
+		return 0;
+	for(block = arena->blocks; block != NULL; block = block->next)
+	{
+		const char *data = (const char*)block + HTTP_ARENA_HEADER;
+		if((const char*)ptr >= data && (const char*)ptr < data + block->size)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Frees all allocations of the arena at once. The block holding the arena is
+	kept, so a reset arena serves the next request without calling malloc.
+*/
+void http_arena_reset(struct http_arena *arena)
+{
+	struct http_arena_block *block = arena->blocks;
+	struct http_arena_block *first = NULL;
+	while(block != NULL)
+	{
+		struct http_arena_block *next = block->next;
+		if((char*)arena == (char*)block + HTTP_ARENA_HEADER)
+			first = block;
+		else
+			free(block);
+		block = next;
+	}
+	first->next = NULL;
+	first->used = HTTP_ARENA_ROUND(sizeof(struct http_arena));
+	arena->blocks = first;
+	arena->last = NULL;
+	arena->last_len = 0;
+}
+
+/*
+	Frees the arena and everything allocated in it
+*/
+void http_arena_free(struct http_arena *arena)
+{
+	if(arena == NULL)
+		return;
+	http_arena_reset(arena);
+	free(arena->blocks);
+}
+
+/*
+	Gives back the memory of a finished request: an arena kept by the caller is
+	reset for the next request, others are freed
+*/
+void http_arena_release(struct http_arena *arena)
+{
+	if(arena == NULL)
+		return;
+	if(arena->keep)
+		http_arena_reset(arena);
+	else
+		http_arena_free(arena);
+}
+
+/*
+	Growable byte buffer, the data is always NUL terminated but may contain
+	NUL bytes itself, len is the amount of bytes stored. A buffer with an arena
+	grows inside the arena and is freed with it.
+*/
+struct str_buffer
+{
+	char *data;
+	size_t len;
+	size_t cap;
+	struct http_arena *arena;
+};
+
+/*
+	Initializes an empty buffer
+*/
+void str_buffer_init(struct str_buffer *buf)
+{
+	buf->data = NULL;
+	buf->len = 0;
+	buf->cap = 0;
+	buf->arena = NULL;
+}
+
+/*
+	Initializes an empty buffer that allocates in arena
+*/
+void str_buffer_init_arena(struct str_buffer *buf, struct http_arena *arena)
+{
+	str_buffer_init(buf);
+	buf->arena = arena;
+}
+
+/*
+	Makes sure the buffer can hold at least extra more bytes, the capacity is
+	doubled so that appending n bytes costs O(n) in total.
+	Returns 0 on success and -1 when out of memory.
+*/
+int str_buffer_reserve(struct str_buffer *buf, size_t extra)
+{
+	size_t needed = buf->len + extra + 1;
+	size_t cap = buf->cap ? buf->cap : 256;
+	char *data;
+	if(needed <= buf->cap)
+		return 0;
+	while(cap < needed)
+		cap *= 2;
+	if(buf->arena != NULL)
+		data = (char*)http_arena_realloc(buf->arena, buf->data, buf->cap, cap);
+	else
+		data = (char*)realloc(buf->data, cap);
+	if(data == NULL)
+		return -1;
+	buf->data = data;
+	buf->cap = cap;
+	return 0;
+}
+
+/*
+	Appends len bytes to the buffer, returns 0 on success and -1 when out of memory
+*/
+int str_buffer_append(struct str_buffer *buf, const char *data, size_t len)
+{
+	if(str_buffer_reserve(buf, len) < 0)
+		return -1;
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+	return 0;
+}
+
+/*
+	Frees the memory of the buffer, the memory of a buffer in an arena is left to
+	the arena
+*/
+void str_buffer_free(struct str_buffer *buf)
+{
+	struct http_arena *arena = buf->arena;
+	if(arena == NULL)
+		free(buf->data);
+	str_buffer_init_arena(buf, arena);
+}
+
 
 /* decodeblock - decode 4 '6-bit' characters into 3 8-bit binary bytes */
 void decodeblock(unsigned char in[], char *clrstr) 
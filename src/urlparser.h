@@ -28,7 +28,8 @@
 
 
 /*
-	Represents an url
+	Represents an url. All components live in the same allocation as the
+	structure itself, components that are absent are NULL.
 */
 struct parsed_url 
 {
@@ -42,40 +43,91 @@ struct parsed_url
     char *fragment;             /* optional */
     char *username;             /* optional */
     char *password;             /* optional */
+	char ip_buf[INET6_ADDRSTRLEN];	/* storage of ip */
+	struct http_arena *arena;	/* arena of the request, NULL when allocated with malloc */
 };
 
 /*
-	Free memory of parsed url
+	Position of a component in an url string, len is -1 when the component is absent
+*/
+struct url_span
+{
+	int offset;
+	int len;
+};
+
+/*
+	Positions of the components of an url, as found by parse_url_spans
+*/
+struct url_spans
+{
+	struct url_span scheme;
+	struct url_span username;
+	struct url_span password;
+	struct url_span host;
+	struct url_span port;
+	struct url_span path;
+	struct url_span query;
+	struct url_span fragment;
+};
+
+/*
+	Free memory of parsed url, an url in an arena is freed with the arena
 */
 void parsed_url_free(struct parsed_url *purl)
 {
-    if ( NULL != purl ) 
+	if(purl != NULL && purl->arena == NULL)
+		free(purl);
+}
+
+/*
+	Sets the ip of a parsed url, ip may be NULL. Returns 0 on success and -1 when
+	ip is not a valid address.
+*/
+int parsed_url_set_ip(struct parsed_url *purl, const char *ip)
+{
+	if(ip == NULL)
 	{
-        if ( NULL != purl->scheme ) free(purl->scheme);
-        if ( NULL != purl->host ) free(purl->host);
-        if ( NULL != purl->port ) free(purl->port);
-        if ( NULL != purl->path )  free(purl->path);
-        if ( NULL != purl->query ) free(purl->query);
-        if ( NULL != purl->fragment ) free(purl->fragment);
-        if ( NULL != purl->username ) free(purl->username);
-        if ( NULL != purl->password ) free(purl->password);
-        free(purl);
-    }
+		purl->ip = NULL;
+		return 0;
+	}
+	if(strlen(ip) >= sizeof(purl->ip_buf))
+		return -1;
+	strcpy(purl->ip_buf, ip);
+	purl->ip = purl->ip_buf;
+	return 0;
 }
 
 /*
-	Retrieves the IP adress of a hostname
+	Retrieves the IP adress of a hostname, the caller frees the returned string.
+	Answers come from the DNS cache when possible.
 */
 char* hostname_to_ip(char *hostname)
 {
-	char *ip = "0.0.0.0";
-	struct hostent *h;
-	if ((h=gethostbyname(hostname)) == NULL) 
+	char *ip = http_dns_lookup(hostname);
+	if (ip == NULL) 
 	{  
-		printf("gethostbyname");
+		printf("getaddrinfo");
 		return NULL;
 	}
-	return inet_ntoa(*((struct in_addr *)h->h_addr));
+	return ip;
+}
+
+/*
+	Resolves the host of a parsed url into purl->ip, unless that was done before.
+	Returns 0 on success and -1 when the host does not resolve.
+*/
+int parsed_url_resolve(struct parsed_url *purl)
+{
+	char *ip;
+	if(purl->ip != NULL)
+		return 0;
+	ip = hostname_to_ip(purl->host);
+	if(ip == NULL)
+		return -1;
+	parsed_url_set_ip(purl, ip);
+	free(ip);
+	return 0;
 }
 
 /*
@@ -87,321 +139,417 @@ int is_scheme_char(int c)
 }
 
 /*
-	Parses a specified URL and returns the structure named 'parsed_url'
+	Finds the components of an url in a single scan, without allocating or
+	copying: the spans point into url. Delimiters are found with the vectorized
+	scanners. Returns 0 on success and -1 when the url
+	is not valid.
 	Implented according to:
 	RFC 1738 - http://www.ietf.org/rfc/rfc1738.txt
 	RFC 3986 -  http://www.ietf.org/rfc/rfc3986.txt
 */
-struct parsed_url *parse_url(const char *url)
+int parse_url_spans(const char *url, struct url_spans *spans)
 {
-	
-	/* Define variable */
-    struct parsed_url *purl;
-    const char *tmpstr;
-    const char *curstr;
-    int len;
-    int i;
-    int userpass_flag;
-    int bracket_flag;
-
-    /* Allocate the parsed url storage */
-    purl = (struct parsed_url*)malloc(sizeof(struct parsed_url));
-    if ( NULL == purl ) 
-	{
-        return NULL;
-    }
-    purl->scheme = NULL;
-    purl->host = NULL;
-    purl->port = NULL;
-    purl->path = NULL;
-    purl->query = NULL;
-    purl->fragment = NULL;
-    purl->username = NULL;
-    purl->password = NULL;
-    curstr = url;
-
-    /*
-     * <scheme>:<scheme-specific-part>
-     * <scheme> := [a-z\+\-\.]+
-     *             upper case = lower case for resiliency
-     */
-    /* Read scheme */
-    tmpstr = strchr(curstr, ':');
-    if ( NULL == tmpstr ) 
-	{
-        parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-		
-        return NULL;
-    }
+	const char *cur = url;
+	const char *end = url + strlen(url);
+	const char *start;
+	const char *at = NULL;				/* end of the user information */
+	const char *user_colon = NULL;		/* separates username and password */
+	const char *port_colon = NULL;		/* separates host and port */
+	struct url_span absent = { 0, -1 };
 
-    /* Get the scheme length */
-    len = tmpstr - curstr;
+	spans->scheme = spans->username = spans->password = spans->host = absent;
+	spans->port = spans->path = spans->query = spans->fragment = absent;
 
-    /* Check restrictions */
-    for ( i = 0; i < len; i++ ) 
+	/*
+	 * <scheme>:<scheme-specific-part>
+	 * <scheme> := [a-z\+\-\.]+
+	 *             upper case = lower case for resiliency
+	 */
+	while(*cur != ':')
 	{
-        if (is_scheme_char(curstr[i]) == 0) 
-		{
-            /* Invalid format */
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-    }
-    /* Copy the scheme to the storage */
-    purl->scheme = (char*)malloc(sizeof(char) * (len + 1));
-    if ( NULL == purl->scheme ) 
-	{
-        parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-		
-        return NULL;
-    }
-
-    (void)strncpy(purl->scheme, curstr, len);
-    purl->scheme[len] = '\0';
+		if(*cur == '\0' || is_scheme_char((unsigned char)*cur) == 0)
+			return -1;
+		cur++;
+	}
+	spans->scheme.offset = 0;
+	spans->scheme.len = cur - url;
 
-    /* Make the character to lower if it is upper case. */
-    for ( i = 0; i < len; i++ ) 
-	{
-        purl->scheme[i] = tolower(purl->scheme[i]);
-    }
-
-    /* Skip ':' */
-    tmpstr++;
-    curstr = tmpstr;
-
-    /*
-     * //<user>:<password>@<host>:<port>/<url-path>
-     * Any ":", "@" and "/" must be encoded.
-     */
-    /* Eat "//" */
-    for ( i = 0; i < 2; i++ ) 
+	/*
+	 * //<user>:<password>@<host>:<port>/<url-path>
+	 * Any ":", "@" and "/" must be encoded.
+	 */
+	if(cur[1] != '/' || cur[2] != '/')
+		return -1;
+	cur += 3;
+	start = cur;
+	for(;; cur++)
 	{
-        if ( '/' != *curstr ) 
+		cur = http_scan_any(cur, end - cur, "/?#@:]", 6);
+		if(cur == NULL)
 		{
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-        curstr++;
-    }
-
-    /* Check if the user (and password) are specified. */
-    userpass_flag = 0;
-    tmpstr = curstr;
-    while ( '\0' != *tmpstr ) 
-	{
-        if ( '@' == *tmpstr ) 
-		{
-            /* Username and password are specified */
-            userpass_flag = 1;
-            break;
-        } 
-		else if ( '/' == *tmpstr ) 
+			cur = end;
+			break;
+		}
+		if(*cur == '/' || *cur == '?' || *cur == '#')
+			break;
+		if(*cur == '@' && at == NULL)
 		{
-            /* End of <host>:<port> specification */
-            userpass_flag = 0;
-            break;
-        }
-        tmpstr++;
-    }
-
-    /* User and password specification */
-    tmpstr = curstr;
-    if ( userpass_flag ) 
-	{
-        /* Read username */
-        while ( '\0' != *tmpstr && ':' != *tmpstr && '@' != *tmpstr ) 
+			at = cur;
+			port_colon = NULL;
+		}
+		else if(*cur == ':')
 		{
-            tmpstr++;
-        }
-        len = tmpstr - curstr;
-        purl->username = (char*)malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->username ) 
+			if(at == NULL && user_colon == NULL)
+				user_colon = cur;
+			port_colon = cur;
+		}
+		else if(*cur == ']')
 		{
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-        (void)strncpy(purl->username, curstr, len);
-        purl->username[len] = '\0';
-
-        /* Proceed current pointer */
-        curstr = tmpstr;
-        if ( ':' == *curstr ) 
+			/* End of an IPv6 address, its colons do not start a port */
+			port_colon = NULL;
+		}
+	}
+
+	/* User and password specification */
+	if(at != NULL)
+	{
+		spans->username.offset = start - url;
+		if(user_colon != NULL && user_colon < at)
 		{
-            /* Skip ':' */
-            curstr++;
-            
-            /* Read password */
-            tmpstr = curstr;
-            while ( '\0' != *tmpstr && '@' != *tmpstr ) 
-			{
-                tmpstr++;
-            }
-            len = tmpstr - curstr;
-            purl->password = (char*)malloc(sizeof(char) * (len + 1));
-            if ( NULL == purl->password ) 
-			{
-                parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-                return NULL;
-            }
-            (void)strncpy(purl->password, curstr, len);
-            purl->password[len] = '\0';
-            curstr = tmpstr;
-        }
-        /* Skip '@' */
-        if ( '@' != *curstr ) 
+			spans->username.len = user_colon - start;
+			spans->password.offset = user_colon + 1 - url;
+			spans->password.len = at - user_colon - 1;
+		}
+		else
 		{
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-        curstr++;
-    }
+			spans->username.len = at - start;
+		}
+		start = at + 1;
+	}
 
-    if ( '[' == *curstr ) 
+	/* Host and port */
+	spans->host.offset = start - url;
+	spans->host.len = (port_colon != NULL ? port_colon : cur) - start;
+	if(spans->host.len <= 0)
+		return -1;
+	if(port_colon != NULL)
 	{
-        bracket_flag = 1;
-    } 
-	else 
+		spans->port.offset = port_colon + 1 - url;
+		spans->port.len = cur - port_colon - 1;
+	}
+
+	/* Path, without the leading '/' */
+	if(*cur == '/')
 	{
-        bracket_flag = 0;
-    }
-    /* Proceed on by delimiters with reading host */
-    tmpstr = curstr;
-    while ( '\0' != *tmpstr ) {
-        if ( bracket_flag && ']' == *tmpstr )
- 		{
-            /* End of IPv6 address. */
-            tmpstr++;
-            break;
-        } 
-		else if ( !bracket_flag && (':' == *tmpstr || '/' == *tmpstr) ) 
-		{
-            /* Port number is specified. */
-            break;
-        }
-        tmpstr++;
-    }
-    len = tmpstr - curstr;
-    purl->host = (char*)malloc(sizeof(char) * (len + 1));
-    if ( NULL == purl->host || len <= 0 ) 
+		start = ++cur;
+		cur = http_scan_any(cur, end - cur, "?#", 2);
+		if(cur == NULL)
+			cur = end;
+		spans->path.offset = start - url;
+		spans->path.len = cur - start;
+	}
+
+	/* Query */
+	if(*cur == '?')
 	{
-        parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-        return NULL;
-    }
-    (void)strncpy(purl->host, curstr, len);
-    purl->host[len] = '\0';
-    curstr = tmpstr;
-
-    /* Is port number specified? */
-    if ( ':' == *curstr ) 
+		start = ++cur;
+		cur = (const char*)memchr(cur, '#', end - cur);
+		if(cur == NULL)
+			cur = end;
+		spans->query.offset = start - url;
+		spans->query.len = cur - start;
+	}
+
+	/* Fragment */
+	if(*cur == '#')
 	{
-        curstr++;
-        /* Read port number */
-        tmpstr = curstr;
-        while ( '\0' != *tmpstr && '/' != *tmpstr ) 
-		{
-            tmpstr++;
-        }
-        len = tmpstr - curstr;
-        purl->port = (char*)malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->port ) 
-		{
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-        (void)strncpy(purl->port, curstr, len);
-        purl->port[len] = '\0';
-        curstr = tmpstr;
-    }
-	else
+		start = ++cur;
+		cur = end;
+		spans->fragment.offset = start - url;
+		spans->fragment.len = cur - start;
+	}
+	return 0;
+}
+
+/*
+	Copies a component of an url into the storage of a parsed url, returns the
+	copy or NULL when the component is absent
+*/
+char* parsed_url_copy_span(char **storage, const char *url, struct url_span span)
+{
+	char *copy = *storage;
+	if(span.len < 0)
+		return NULL;
+	memcpy(copy, url + span.offset, span.len);
+	copy[span.len] = '\0';
+	*storage += span.len + 1;
+	return copy;
+}
+
+/*
+	Parses a specified URL and returns the structure named 'parsed_url', the
+	host is only resolved when resolve is set, purl->ip is NULL otherwise.
+	The url is parsed with a single allocation in arena, or with malloc when
+	arena is NULL, purl->uri points to url itself.
+*/
+struct parsed_url *parse_url_into(const char *url, int resolve, struct http_arena *arena)
+{
+	struct parsed_url *purl;
+	struct url_spans spans;
+	struct url_span *span;
+	const char *default_port;
+	size_t size = sizeof(struct parsed_url);
+	char *storage;
+	int i;
+
+	if(parse_url_spans(url, &spans) < 0)
 	{
-        if(strncmp(url,"https",5)==0)
-            purl->port = "443";
-        else
-            purl->port = "80";
+		fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
+		return NULL;
 	}
-	
-	/* Get ip */
-	char *ip = hostname_to_ip(purl->host);
-	purl->ip = ip;
-	
-	/* Set uri */
+	for(span = &spans.scheme; span <= &spans.fragment; span++)
+	{
+		if(span->len >= 0)
+			size += span->len + 1;
+	}
+	default_port = (spans.scheme.len == 5 && strncasecmp(url, "https", 5) == 0) ? "443" : "80";
+	if(spans.port.len < 0)
+		size += strlen(default_port) + 1;
+
+	/* Allocate the parsed url storage */
+	purl = (struct parsed_url*)http_arena_malloc(arena, size);
+	if(purl == NULL)
+	{
+		fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
+		return NULL;
+	}
+	storage = (char*)(purl + 1);
 	purl->uri = (char*)url;
+	purl->ip = NULL;
+	purl->arena = arena;
+	purl->scheme = parsed_url_copy_span(&storage, url, spans.scheme);
+	purl->username = parsed_url_copy_span(&storage, url, spans.username);
+	purl->password = parsed_url_copy_span(&storage, url, spans.password);
+	purl->host = parsed_url_copy_span(&storage, url, spans.host);
+	purl->port = parsed_url_copy_span(&storage, url, spans.port);
+	purl->path = parsed_url_copy_span(&storage, url, spans.path);
+	purl->query = parsed_url_copy_span(&storage, url, spans.query);
+	purl->fragment = parsed_url_copy_span(&storage, url, spans.fragment);
+	if(purl->port == NULL)
+	{
+		strcpy(storage, default_port);
+		purl->port = storage;
+	}
+
+	/* Make the character to lower if it is upper case. */
+	for(i = 0; purl->scheme[i]; i++)
+		purl->scheme[i] = tolower((unsigned char)purl->scheme[i]);
+
+	/* Get ip */
+	if(resolve)
+		parsed_url_resolve(purl);
+	return purl;
+}
+
+/*
+	Parses a specified URL and returns the structure named 'parsed_url', the
+	host is only resolved when resolve is set
+*/
+struct parsed_url *parse_url_ex(const char *url, int resolve)
+{
+	return parse_url_into(url, resolve, NULL);
+}
+
+/*
+	Parses a specified URL, no network I/O is done. The host is resolved when
+	a connection to it is opened, purl->ip stays NULL until
+	parsed_url_resolve is called.
+*/
+struct parsed_url *parse_url(const char *url)
+{
+	return parse_url_ex(url, 0);
+}
+
+/*
+	Copies a component of a parsed url into storage, returns the copy or NULL when
+	the component is absent
+*/
+char* parsed_url_copy_component(char **storage, const char *component)
+{
+	char *copy = *storage;
+	size_t len;
+	if(component == NULL)
+		return NULL;
+	len = strlen(component) + 1;
+	memcpy(copy, component, len);
+	*storage += len;
+	return copy;
+}
+
+/*
+	Copies a parsed url into arena, or with malloc when arena is NULL. The copy
+	points to the same uri. Returns NULL when out of memory.
+*/
+struct parsed_url *parsed_url_dup(const struct parsed_url *purl, struct http_arena *arena)
+{
+	const char *components[8];
+	struct parsed_url *copy;
+	size_t size = sizeof(struct parsed_url);
+	char *storage;
+	int i;
 
-    /* End of the string */
-    if ( '\0' == *curstr ) 
+	components[0] = purl->scheme;
+	components[1] = purl->host;
+	components[2] = purl->port;
+	components[3] = purl->path;
+	components[4] = purl->query;
+	components[5] = purl->fragment;
+	components[6] = purl->username;
+	components[7] = purl->password;
+	for(i = 0; i < 8; i++)
 	{
-        return purl;
-    }
+		if(components[i] != NULL)
+			size += strlen(components[i]) + 1;
+	}
+	copy = (struct parsed_url*)http_arena_malloc(arena, size);
+	if(copy == NULL)
+		return NULL;
+	memcpy(copy, purl, sizeof(struct parsed_url));
+	copy->arena = arena;
+	copy->ip = purl->ip != NULL ? copy->ip_buf : NULL;
+	storage = (char*)(copy + 1);
+	copy->scheme = parsed_url_copy_component(&storage, purl->scheme);
+	copy->host = parsed_url_copy_component(&storage, purl->host);
+	copy->port = parsed_url_copy_component(&storage, purl->port);
+	copy->path = parsed_url_copy_component(&storage, purl->path);
+	copy->query = parsed_url_copy_component(&storage, purl->query);
+	copy->fragment = parsed_url_copy_component(&storage, purl->fragment);
+	copy->username = parsed_url_copy_component(&storage, purl->username);
+	copy->password = parsed_url_copy_component(&storage, purl->password);
+	return copy;
+}
 
-    /* Skip '/' */
-    if ( '/' != *curstr ) 
+/*
+	Parses a specified URL into arena. A request made with the url allocates its
+	response in the same arena, freeing the response releases the arena.
+*/
+struct parsed_url *parse_url_arena(const char *url, struct http_arena *arena)
+{
+	return parse_url_into(url, 0, arena);
+}
+
+/*
+	Removes the "." and ".." segments of the path of an url in place, path starts
+	with '/' and ends at the query or the end of the string
+*/
+void parsed_url_remove_dot_segments(char *path)
+{
+	char *end = path + strcspn(path, "?");
+	char *in = path, *out = path;
+	while(in < end)
 	{
-        parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-        return NULL;
-    }
-    curstr++;
-
-    /* Parse path */
-    tmpstr = curstr;
-    while ( '\0' != *tmpstr && '#' != *tmpstr  && '?' != *tmpstr ) 
+		char *next = in + 1;
+		while(next < end && *next != '/')
+			next++;
+		if(next - in == 2 && in[1] == '.')
+		{
+			if(next == end)
+				*out++ = '/';
+		}
+		else if(next - in == 3 && in[1] == '.' && in[2] == '.')
+		{
+			while(out > path && *--out != '/')
+				;
+			if(next == end)
+				*out++ = '/';
+		}
+		else
+		{
+			memmove(out, in, next - in);
+			out += next - in;
+		}
+		in = next;
+	}
+	if(out == path)
+		*out++ = '/';
+	memmove(out, end, strlen(end) + 1);
+}
+
+/*
+	Resolves the len bytes of reference, an absolute or relative url like the
+	Location of a redirect, against the url base. The fragment of reference is
+	dropped. The resulting url is allocated in arena, or with malloc when arena is
+	NULL. Returns NULL when out of memory.
+*/
+char* parsed_url_join(const struct parsed_url *base, const char *reference, size_t len, struct http_arena *arena)
+{
+	struct str_buffer url;
+	const char *fragment = (const char*)memchr(reference, '#', len);
+	const char *default_port = strcmp(base->scheme, "https") == 0 ? "443" : "80";
+	size_t i, path_start = 0;
+	int result = 0;
+
+	if(fragment != NULL)
+		len = fragment - reference;
+	str_buffer_init_arena(&url, arena);
+	for(i = 0; i < len && is_scheme_char(reference[i]); i++)
+		;
+	if(i > 0 && i + 2 < len && reference[i] == ':' && reference[i + 1] == '/' && reference[i + 2] == '/')
 	{
-        tmpstr++;
-    }
-    len = tmpstr - curstr;
-    purl->path = (char*)malloc(sizeof(char) * (len + 1));
-    if ( NULL == purl->path ) 
+		/* An absolute url is taken as is */
+		result |= str_buffer_append(&url, reference, len);
+	}
+	else if(len >= 2 && reference[0] == '/' && reference[1] == '/')
 	{
-        parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-        return NULL;
-    }
-    (void)strncpy(purl->path, curstr, len);
-    purl->path[len] = '\0';
-    curstr = tmpstr;
-
-    /* Is query specified? */
-    if ( '?' == *curstr ) 
+		/* A network path only takes the scheme */
+		result |= str_buffer_append(&url, base->scheme, strlen(base->scheme));
+		result |= str_buffer_append(&url, ":", 1);
+		result |= str_buffer_append(&url, reference, len);
+	}
+	else
 	{
-        /* Skip '?' */
-        curstr++;
-        /* Read query */
-        tmpstr = curstr;
-        while ( '\0' != *tmpstr && '#' != *tmpstr ) 
+		/* Anything else stays on the origin of base, credentials included */
+		result |= str_buffer_append(&url, base->scheme, strlen(base->scheme));
+		result |= str_buffer_append(&url, "://", 3);
+		if(base->username != NULL)
+		{
+			result |= str_buffer_append(&url, base->username, strlen(base->username));
+			if(base->password != NULL)
+			{
+				result |= str_buffer_append(&url, ":", 1);
+				result |= str_buffer_append(&url, base->password, strlen(base->password));
+			}
+			result |= str_buffer_append(&url, "@", 1);
+		}
+		result |= str_buffer_append(&url, base->host, strlen(base->host));
+		if(strcmp(base->port, default_port) != 0)
 		{
-            tmpstr++;
-        }
-        len = tmpstr - curstr;
-        purl->query = (char*)malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->query ) 
+			result |= str_buffer_append(&url, ":", 1);
+			result |= str_buffer_append(&url, base->port, strlen(base->port));
+		}
+		path_start = url.len;
+		if(len == 0 || reference[0] != '/')
 		{
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-        (void)strncpy(purl->query, curstr, len);
-        purl->query[len] = '\0';
-        curstr = tmpstr;
-    }
-
-    /* Is fragment specified? */
-    if ( '#' == *curstr ) 
+			/* The path of base up to its last segment, or all of it when reference is empty or a query */
+			const char *path = base->path != NULL ? base->path : "";
+			const char *slash = strrchr(path, '/');
+			size_t keep = len == 0 || reference[0] == '?' ? strlen(path) : slash != NULL ? (size_t)(slash - path) + 1 : 0;
+			result |= str_buffer_append(&url, "/", 1);
+			result |= str_buffer_append(&url, path, keep);
+			if(len == 0 && base->query != NULL)
+			{
+				result |= str_buffer_append(&url, "?", 1);
+				result |= str_buffer_append(&url, base->query, strlen(base->query));
+			}
+		}
+		result |= str_buffer_append(&url, reference, len);
+	}
+	if(result < 0)
 	{
-        /* Skip '#' */
-        curstr++;
-        /* Read fragment */
-        tmpstr = curstr;
-        while ( '\0' != *tmpstr ) 
-		{
-            tmpstr++;
-        }
-        len = tmpstr - curstr;
-        purl->fragment = (char*)malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->fragment )
- 		{
-            parsed_url_free(purl); fprintf(stderr, "Error on line %d (%s)\n", __LINE__, __FILE__);
-            return NULL;
-        }
-        (void)strncpy(purl->fragment, curstr, len);
-        purl->fragment[len] = '\0';
-        curstr = tmpstr;
-    }
-	return purl;
-}
\ No newline at end of file
+		str_buffer_free(&url);
+		return NULL;
+	}
+	if(path_start > 0)
+		parsed_url_remove_dot_segments(url.data + path_start);
+	return url.data;
+}